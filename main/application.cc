@@ -12,6 +12,7 @@
 #include "wifi_station.h" 
 
 #include <cstring>
+#include <algorithm>
 #include <esp_log.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
@@ -107,7 +108,8 @@ void Application::CheckNewVersion() {
             auto& board = Board::GetInstance();
             board.SetPowerSaveMode(false);
 #if CONFIG_USE_WAKE_WORD_DETECT
-            wake_word_detect_.StopDetection();
+            // Release the AFE and the wakenet model to leave PSRAM for the upgrade
+            wake_word_detect_.Unload();
 #endif
             // 预先关闭音频输出，避免升级过程有音频操作
             auto codec = board.GetAudioCodec();
@@ -116,6 +118,7 @@ void Application::CheckNewVersion() {
             {
                 std::lock_guard<std::mutex> lock(mutex_);
                 audio_decode_queue_.clear();
+                audio_playback_queue_.clear();
             }
             background_task_->WaitForCompletion();
             delete background_task_;
@@ -249,7 +252,9 @@ void Application::PlaySound(const std::string_view& sound) {
 
         std::lock_guard<std::mutex> lock(mutex_);
         audio_decode_queue_.emplace_back(std::move(opus));
+        audio_packets_queued_++;
     }
+    xEventGroupSetBits(event_group_, AUDIO_OUTPUT_READY_EVENT);
 }
 
 void Application::ToggleChatState() {
@@ -360,7 +365,7 @@ void Application::Start() {
     /* Setup the audio codec */
     auto codec = board.GetAudioCodec();
     opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+    opus_encoder_ = std::make_unique<OpusFrameEncoder>(16000, 1, OPUS_FRAME_DURATION_MS);
     if (realtime_chat_enabled_) {
         ESP_LOGI(TAG, "Realtime chat enabled, setting opus encoder complexity to 0");
         opus_encoder_->SetComplexity(0);
@@ -372,17 +377,40 @@ void Application::Start() {
         opus_encoder_->SetComplexity(3);
     }
 
+#if CONFIG_USE_AUDIO_PROCESSOR
+    if (realtime_chat_enabled_) {
+        if (codec->input_reference()) {
+            // The hardware loopback is used as it is, its echo delay is only measured and logged
+            codec->EnableEchoDelayEstimator();
+        } else {
+            // Without a hardware loopback, AEC needs the software playback reference
+            codec->EnablePlaybackReference();
+        }
+    }
+#endif
     if (codec->input_sample_rate() != 16000) {
-        input_resampler_.Configure(codec->input_sample_rate(), 16000);
-        reference_resampler_.Configure(codec->input_sample_rate(), 16000);
+        // input_channels() already counts the software reference enabled above
+        for (int i = 0; i < codec->input_channels(); i++) {
+            input_resamplers_.push_back(std::make_unique<OpusResampler>());
+            input_resamplers_.back()->Configure(codec->input_sample_rate(), 16000);
+        }
+        input_channel_pcm_.resize(codec->input_channels());
+        resampled_channel_pcm_.resize(codec->input_channels());
     }
     codec->Start();
 
+    // Capture and playback run in separate tasks, each paced by its own I2S DMA channel,
+    // so a blocking read never delays the speaker and vice versa
+    xTaskCreatePinnedToCore([](void* arg) {
+        Application* app = (Application*)arg;
+        app->AudioInputTask();
+        vTaskDelete(NULL);
+    }, "audio_input", 4096 * 2, this, AUDIO_INPUT_TASK_PRIORITY, &audio_input_task_handle_, realtime_chat_enabled_ ? 1 : 0);
     xTaskCreatePinnedToCore([](void* arg) {
         Application* app = (Application*)arg;
-        app->AudioLoop();
+        app->AudioOutputTask();
         vTaskDelete(NULL);
-    }, "audio_loop", 4096 * 2, this, 8, &audio_loop_task_handle_, realtime_chat_enabled_ ? 1 : 0);
+    }, "audio_output", 4096 * 2, this, AUDIO_OUTPUT_TASK_PRIORITY, &audio_output_task_handle_, 0);
 
     /* Wait for the network to be ready */
     //board.StartNetwork();
@@ -418,16 +446,35 @@ void Application::Start() {
 #else
     protocol_ = std::make_unique<MqttProtocol>();
 #endif
+#if CONFIG_USE_WAKE_WORD_DETECT
+    // Every board with wake word detection can switch its model
+    iot::ThingManager::GetInstance().AddThing(iot::CreateThing("WakeWord"));
+#endif
+    protocol_->SetIotDescriptorsHash(iot::ThingManager::GetInstance().GetDescriptorsHash());
+    // IoT methods run on their own workers, the result and the states they changed are sent from the main loop
+    iot::ThingManager::GetInstance().OnCommandResult([this](std::string&& result) {
+        Schedule([this, result = std::move(result)]() {
+            if (protocol_->IsAudioChannelOpened()) {
+                protocol_->SendIotResult(result);
+                UpdateIotStates();
+            }
+        });
+    });
     protocol_->OnNetworkError([this](const std::string& message) {
         SetDeviceState(kDeviceStateIdle);
         Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
     });
     protocol_->OnIncomingAudio([this](std::vector<uint8_t>&& data) {
         const int max_packets_in_queue = 300 / OPUS_FRAME_DURATION_MS;
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (audio_decode_queue_.size() < max_packets_in_queue) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (audio_decode_queue_.size() >= max_packets_in_queue) {
+                return;
+            }
             audio_decode_queue_.emplace_back(std::move(data));
+            audio_packets_queued_++;
         }
+        xEventGroupSetBits(event_group_, AUDIO_OUTPUT_READY_EVENT);
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
@@ -437,7 +484,7 @@ void Application::Start() {
         }
         SetDecodeSampleRate(protocol_->server_sample_rate(), protocol_->server_frame_duration());
         auto& thing_manager = iot::ThingManager::GetInstance();
-        protocol_->SendIotDescriptors(thing_manager.GetDescriptorsJson());
+        protocol_->SendIotDescriptors(thing_manager.GetDescriptorsJson(), thing_manager.GetDescriptorsHash());
         std::string states;
         if (thing_manager.GetStatesJson(states, false)) {
             protocol_->SendIotStates(states);
@@ -464,8 +511,12 @@ void Application::Start() {
                     }
                 });
             } else if (strcmp(state->valuestring, "stop") == 0) {
+                EndTtsSentence();
                 Schedule([this]() {
                     background_task_->WaitForCompletion();
+                    WaitForPlaybackDrained();
+                    // Show whatever was not revealed by playback, e.g. after an abort
+                    FlushTtsText();
                     if (device_state_ == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
                             SetDeviceState(kDeviceStateIdle);
@@ -478,9 +529,8 @@ void Application::Start() {
                 auto text = cJSON_GetObjectItem(root, "text");
                 if (text != NULL) {
                     ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
-                    });
+                    // Revealed by the audio output task as the sentence is played
+                    StartTtsSentence(text->valuestring);
                 }
             }
         } else if (strcmp(type->valuestring, "stt") == 0) {
@@ -534,13 +584,15 @@ void Application::Start() {
     protocol_->Start();
 
 #if CONFIG_USE_AUDIO_PROCESSOR
-    audio_processor_.Initialize(codec, realtime_chat_enabled_);
-    audio_processor_.OnOutput([this](std::vector<int16_t>&& data) {
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
+    audio_processor_.Initialize(codec, realtime_chat_enabled_, OPUS_FRAME_DURATION_MS);
+    audio_processor_.OnOutput([this](PcmFrame&& frame) {
+        background_task_->Schedule([this, frame = std::move(frame)]() mutable {
             if (protocol_->IsAudioChannelBusy()) {
                 return;
             }
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
+            // A whole Opus frame, encoded in place. The slot goes back to the pool with its storage
+            // when the frame is dropped.
+            opus_encoder_->Encode(frame.data(), frame.size(), [this](std::vector<uint8_t>&& opus) {
                 Schedule([this, opus = std::move(opus)]() {
                     protocol_->SendAudio(opus);
                 });
@@ -548,23 +600,20 @@ void Application::Start() {
         });
     });
     audio_processor_.OnVadStateChange([this](bool speaking) {
-        if (device_state_ == kDeviceStateListening) {
-            Schedule([this, speaking]() {
-                if (speaking) {
-                    voice_detected_ = true;
-                } else {
-                    voice_detected_ = false;
-                }
-                auto led = Board::GetInstance().GetLed();
-                led->OnStateChanged();
-            });
-        }
+        OnVoiceDetected(speaking);
     });
 #endif
 
 #if CONFIG_USE_WAKE_WORD_DETECT
     wake_word_detect_.Initialize(codec);
     wake_word_detect_.OnWakeWordDetected([this](const std::string& wake_word) {
+        auto action = wake_word_detect_.GetAction(wake_word);
+        if (action != kWakeWordActionChat) {
+            Schedule([this, action]() {
+                HandleLocalCommand(action);
+            });
+            return;
+        }
         Schedule([this, &wake_word]() {
             if (device_state_ == kDeviceStateIdle) {
                 SetDeviceState(kDeviceStateConnecting);
@@ -572,6 +621,7 @@ void Application::Start() {
 
                 if (!protocol_->OpenAudioChannel()) {
                     wake_word_detect_.StartDetection();
+                    xEventGroupSetBits(event_group_, AUDIO_INPUT_READY_EVENT);
                     return;
                 }
                 
@@ -661,17 +711,132 @@ void Application::MainEventLoop() {
     }
 }
 
-// The Audio Loop is used to input and output audio data
-void Application::AudioLoop() {
+// The audio input task reads the microphone whenever a consumer (wake word detection,
+// audio processor or the uplink encoder) needs data, and sleeps otherwise
+void Application::AudioInputTask() {
+    while (true) {
+        if (!OnAudioInput()) {
+            xEventGroupWaitBits(event_group_, AUDIO_INPUT_READY_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(1000));
+        }
+    }
+}
+
+// The audio output task writes decoded PCM to the speaker, it wakes up when new opus packets
+// or decoded frames are queued and is paced by the I2S DMA while writing
+void Application::AudioOutputTask() {
     auto codec = Board::GetInstance().GetAudioCodec();
     while (true) {
-        OnAudioInput();
-        if (codec->output_enabled()) {
-            OnAudioOutput();
+        xEventGroupWaitBits(event_group_, AUDIO_OUTPUT_READY_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(1000));
+
+        while (true) {
+            if (codec->output_enabled()) {
+                OnAudioOutput();
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (audio_playback_queue_.empty()) {
+                break;
+            }
+            auto pcm = std::move(audio_playback_queue_.front());
+            audio_playback_queue_.pop_front();
+            lock.unlock();
+
+            if (!aborted_ && codec->output_enabled()) {
+                // Schedule the next packet for decoding before blocking on the DMA
+                OnAudioOutput();
+                output_level_.Process(pcm.data(), pcm.size(), codec->output_sample_rate());
+                codec->OutputData(pcm);
+                last_output_time_ = std::chrono::steady_clock::now();
+            }
+            UpdateTtsText(true);
+            audio_decode_cv_.notify_all();
+        }
+    }
+}
+
+// A sentence starts with the next packet that arrives after its sentence_start message
+void Application::StartTtsSentence(const std::string& text) {
+    uint32_t estimated_ms = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        uint8_t c = text[i];
+        if ((c & 0xC0) != 0x80) {
+            estimated_ms += c >= 0xE0 ? TTS_MS_PER_WIDE_CHAR : TTS_MS_PER_CHAR;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!tts_sentences_.empty() && !tts_sentences_.back().ended) {
+        tts_sentences_.back().end_packet = audio_packets_queued_;
+        tts_sentences_.back().ended = true;
+    }
+    int frame_duration = std::max(opus_decoder_->duration_ms(), 1);
+    tts_sentences_.push_back({text, audio_packets_queued_, 0, estimated_ms / frame_duration, false, false, 0.0f});
+}
+
+void Application::EndTtsSentence() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!tts_sentences_.empty() && !tts_sentences_.back().ended) {
+        tts_sentences_.back().end_packet = audio_packets_queued_;
+        tts_sentences_.back().ended = true;
+    }
+}
+
+// Called from the audio output task for every packet that leaves the playback queue.
+// The sentence being played is revealed in proportion to its packets played so far.
+void Application::UpdateTtsText(bool packet_played) {
+    auto display = Board::GetInstance().GetDisplay();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (packet_played && audio_packets_played_ < audio_packets_queued_) {
+        audio_packets_played_++;
+    }
+
+    while (!tts_sentences_.empty()) {
+        auto& sentence = tts_sentences_.front();
+        if (audio_packets_played_ <= sentence.first_packet) {
+            break;
+        }
+        if (!sentence.shown) {
+            display->SetStreamingMessage("assistant", sentence.text.c_str());
+            sentence.shown = true;
+        }
+
+        // Until the next sentence starts, the length is the larger of what arrived and the estimate
+        uint32_t played = audio_packets_played_ - sentence.first_packet;
+        uint32_t total = sentence.ended ? sentence.end_packet - sentence.first_packet
+            : std::max(audio_packets_queued_ - sentence.first_packet, sentence.estimated_packets);
+        bool finished = sentence.ended && played >= total;
+        float progress = (finished || total == 0) ? 1.0f : std::min(1.0f, (float)played / total);
+        if (progress > sentence.progress) {
+            display->RevealStreamingMessage(progress);
+            sentence.progress = progress;
+        }
+        if (!finished) {
+            break;
         }
+        tts_sentences_.pop_front();
     }
 }
 
+void Application::FlushTtsText() {
+    auto display = Board::GetInstance().GetDisplay();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& sentence : tts_sentences_) {
+        if (!sentence.shown) {
+            display->SetStreamingMessage("assistant", sentence.text.c_str());
+        }
+        display->RevealStreamingMessage(1.0f);
+    }
+    tts_sentences_.clear();
+    audio_packets_played_ = audio_packets_queued_;
+}
+
+void Application::WaitForPlaybackDrained() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    audio_decode_cv_.wait(lock, [this]() {
+        return audio_playback_queue_.empty();
+    });
+}
+
 void Application::OnAudioOutput() {
     if (busy_decoding_audio_) {
         return;
@@ -684,7 +849,7 @@ void Application::OnAudioOutput() {
     std::unique_lock<std::mutex> lock(mutex_);
     if (audio_decode_queue_.empty()) {
         // Disable the output if there is no audio data for a long time
-        if (device_state_ == kDeviceStateIdle) {
+        if (device_state_ == kDeviceStateIdle && audio_playback_queue_.empty()) {
             auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_output_time_).count();
             if (duration > max_silence_seconds) {
                 codec->EnableOutput(false);
@@ -696,6 +861,8 @@ void Application::OnAudioOutput() {
     if (device_state_ == kDeviceStateListening) {
         audio_decode_queue_.clear();
         audio_decode_cv_.notify_all();
+        lock.unlock();
+        FlushTtsText();
         return;
     }
 
@@ -722,89 +889,201 @@ void Application::OnAudioOutput() {
             output_resampler_.Process(pcm.data(), pcm.size(), resampled.data());
             pcm = std::move(resampled);
         }
-        codec->OutputData(pcm);
-        last_output_time_ = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            audio_playback_queue_.emplace_back(std::move(pcm));
+        }
+        xEventGroupSetBits(event_group_, AUDIO_OUTPUT_READY_EVENT);
     });
 }
 
-void Application::OnAudioInput() {
+// Returns false if no consumer needs microphone data at the moment
+bool Application::OnAudioInput() {
 #if CONFIG_USE_WAKE_WORD_DETECT
     if (wake_word_detect_.IsDetectionRunning()) {
-        std::vector<int16_t> data;
         int samples = wake_word_detect_.GetFeedSize();
         if (samples > 0) {
-            ReadAudio(data, 16000, samples);
-            wake_word_detect_.Feed(data);
-            return;
+            ReadAudio(input_frame_, 16000, samples);
+            wake_word_detect_.Feed(input_frame_);
+            return true;
         }
     }
 #endif
 #if CONFIG_USE_AUDIO_PROCESSOR
     if (audio_processor_.IsRunning()) {
-        std::vector<int16_t> data;
         int samples = audio_processor_.GetFeedSize();
         if (samples > 0) {
-            ReadAudio(data, 16000, samples);
-            audio_processor_.Feed(data);
-            return;
+            ReadAudio(input_frame_, 16000, samples);
+            if (device_state_ == kDeviceStateListening) {
+                input_level_.Process(input_frame_.data(), input_frame_.size(), 16000, Board::GetInstance().GetAudioCodec()->input_channels());
+            }
+            audio_processor_.Feed(input_frame_);
+            return true;
         }
     }
 #else
     if (device_state_ == kDeviceStateListening) {
         std::vector<int16_t> data;
         ReadAudio(data, 16000, 30 * 16000 / 1000);
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            if (protocol_->IsAudioChannelBusy()) {
-                return;
+        input_level_.Process(data.data(), data.size(), 16000);
+#if CONFIG_USE_UPLINK_VAD
+        bool was_speaking = uplink_vad_.speaking();
+        bool speaking = uplink_vad_.Process(data.data(), data.size());
+        if (speaking != was_speaking) {
+            OnVoiceDetected(speaking);
+        }
+        if (!speaking) {
+            // Suppress silence on the uplink, but keep a short pre-roll so the onset is not clipped
+            uplink_preroll_.emplace_back(std::move(data));
+            if (uplink_preroll_.size() > CONFIG_UPLINK_VAD_PREROLL_MS / 30) {
+                uplink_preroll_.pop_front();
             }
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
-                });
+            return true;
+        }
+        if (!was_speaking) {
+            for (auto& frame : uplink_preroll_) {
+                SendUplinkAudio(std::move(frame));
+            }
+            uplink_preroll_.clear();
+        }
+#endif
+        SendUplinkAudio(std::move(data));
+        return true;
+    }
+#if CONFIG_USE_UPLINK_VAD
+    if (uplink_vad_.speaking() || !uplink_preroll_.empty()) {
+        uplink_vad_.Reset();
+        uplink_preroll_.clear();
+    }
+#endif
+#endif
+    return false;
+}
+
+#if CONFIG_USE_WAKE_WORD_DETECT
+// Keywords mapped to a local action are handled on the device, without opening the audio channel
+void Application::HandleLocalCommand(WakeWordAction action) {
+    auto& board = Board::GetInstance();
+    auto codec = board.GetAudioCodec();
+    switch (action) {
+        case kWakeWordActionStop:
+            ESP_LOGI(TAG, "Local command: stop");
+            if (device_state_ == kDeviceStateSpeaking) {
+                AbortSpeaking(kAbortReasonNone);
+            } else if (device_state_ == kDeviceStateListening) {
+                protocol_->CloseAudioChannel();
+            }
+            break;
+        case kWakeWordActionVolumeUp:
+        case kWakeWordActionVolumeDown: {
+            int volume = codec->output_volume() + (action == kWakeWordActionVolumeUp ? 10 : -10);
+            volume = std::max(0, std::min(100, volume));
+            ESP_LOGI(TAG, "Local command: volume %d", volume);
+            codec->SetOutputVolume(volume);
+            board.GetDisplay()->ShowNotification(Lang::Strings::VOLUME + std::to_string(volume));
+            break;
+        }
+        default:
+            break;
+    }
+
+    // Detection stops on every hit, resume it where the device state would have kept it running
+    bool resume = device_state_ == kDeviceStateIdle;
+#if CONFIG_USE_SHARED_AFE
+    resume = resume || device_state_ == kDeviceStateSpeaking;
+#else
+    resume = resume || (device_state_ == kDeviceStateSpeaking && listening_mode_ != kListeningModeRealtime);
+#endif
+    if (resume) {
+        wake_word_detect_.StartDetection();
+    }
+}
+#endif
+
+void Application::SendUplinkAudio(std::vector<int16_t>&& data) {
+    background_task_->Schedule([this, data = std::move(data)]() mutable {
+        if (protocol_->IsAudioChannelBusy()) {
+            return;
+        }
+        opus_encoder_->Encode(data.data(), data.size(), [this](std::vector<uint8_t>&& opus) {
+            Schedule([this, opus = std::move(opus)]() {
+                protocol_->SendAudio(opus);
             });
         });
+    });
+}
+
+void Application::OnVoiceDetected(bool speaking) {
+    if (device_state_ != kDeviceStateListening) {
         return;
     }
+    Schedule([this, speaking]() {
+        voice_detected_ = speaking;
+        auto led = Board::GetInstance().GetLed();
+        led->OnStateChanged();
+#if CONFIG_USE_UPLINK_VAD
+        // Silence is not sent to the server, so the end of speech has to be detected locally
+        if (!speaking && device_state_ == kDeviceStateListening && listening_mode_ == kListeningModeAutoStop) {
+            ESP_LOGI(TAG, "End of speech detected");
+            protocol_->SendStopListening();
+        }
 #endif
-    vTaskDelay(pdMS_TO_TICKS(30));
+    });
 }
 
+// Called from the audio input task only, the resampling buffers are reused between calls
 void Application::ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples) {
     auto codec = Board::GetInstance().GetAudioCodec();
-    if (codec->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec->input_sample_rate() / sample_rate);
-        if (!codec->InputData(data)) {
-            return;
-        }
-        if (codec->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
-        } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
-        }
-    } else {
+    if (codec->input_sample_rate() == sample_rate) {
         data.resize(samples);
-        if (!codec->InputData(data)) {
-            return;
+        codec->InputData(data);
+        return;
+    }
+
+    input_raw_.resize(samples * codec->input_sample_rate() / sample_rate);
+    if (!codec->InputData(input_raw_)) {
+        return;
+    }
+    const int channels = codec->input_channels();
+    if (channels == 1) {
+        data.resize(input_resamplers_[0]->GetOutputSamples(input_raw_.size()));
+        input_resamplers_[0]->Process(input_raw_.data(), input_raw_.size(), data.data());
+        return;
+    }
+
+    // Every channel is resampled on its own, microphones first and the reference last
+    const size_t frames = input_raw_.size() / channels;
+    size_t resampled_frames = 0;
+    for (int c = 0; c < channels; c++) {
+        auto& channel = input_channel_pcm_[c];
+        channel.resize(frames);
+        for (size_t i = 0, j = c; i < frames; ++i, j += channels) {
+            channel[i] = input_raw_[j];
+        }
+        auto& resampled = resampled_channel_pcm_[c];
+        resampled.resize(input_resamplers_[c]->GetOutputSamples(frames));
+        input_resamplers_[c]->Process(channel.data(), frames, resampled.data());
+        resampled_frames = resampled.size();
+    }
+    data.resize(resampled_frames * channels);
+    for (int c = 0; c < channels; c++) {
+        auto& resampled = resampled_channel_pcm_[c];
+        for (size_t i = 0, j = c; i < resampled_frames; ++i, j += channels) {
+            data[j] = resampled[i];
         }
     }
 }
 
+AudioLevel Application::GetAudioLevel() const {
+    if (device_state_ == kDeviceStateSpeaking) {
+        return output_level_.level();
+    }
+    if (device_state_ == kDeviceStateListening) {
+        return input_level_.level();
+    }
+    return AudioLevel();
+}
+
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
@@ -832,6 +1111,9 @@ void Application::SetDeviceState(DeviceState state) {
     auto display = board.GetDisplay();
     auto led = board.GetLed();
     led->OnStateChanged();
+    // Status icons are pushed on state changes and polled less often while idle
+    display->SetIdle(state == kDeviceStateIdle);
+    display->RefreshStatusIcons();
     switch (state) {
         case kDeviceStateUnknown:
         case kDeviceStateIdle:
@@ -876,6 +1158,10 @@ void Application::SetDeviceState(DeviceState state) {
                 audio_processor_.Start();
 #endif
             }
+#if CONFIG_USE_SHARED_AFE
+            // Realtime mode keeps the processor running while speaking, only drop the barge-in detection
+            wake_word_detect_.StopDetection();
+#endif
             break;
         case kDeviceStateSpeaking:
             display->SetStatus(Lang::Strings::SPEAKING);
@@ -888,6 +1174,12 @@ void Application::SetDeviceState(DeviceState state) {
                 wake_word_detect_.StartDetection();
 #endif
             }
+#if CONFIG_USE_SHARED_AFE
+            else {
+                // The shared AFE already runs AEC for the uplink, so the wake word can interrupt playback too
+                wake_word_detect_.StartDetection();
+            }
+#endif
             ResetDecoder();
             break;
         case kDeviceStateBleProvisioning:
@@ -899,12 +1191,18 @@ void Application::SetDeviceState(DeviceState state) {
             // Do nothing
             break;
     }
+
+    // Wake up the audio input task in case a new consumer started
+    xEventGroupSetBits(event_group_, AUDIO_INPUT_READY_EVENT);
 }
 
 void Application::ResetDecoder() {
     std::lock_guard<std::mutex> lock(mutex_);
     opus_decoder_->ResetState();
     audio_decode_queue_.clear();
+    audio_playback_queue_.clear();
+    tts_sentences_.clear();
+    audio_packets_played_ = audio_packets_queued_;
     audio_decode_cv_.notify_all();
     last_output_time_ = std::chrono::steady_clock::now();
     
@@ -927,11 +1225,11 @@ void Application::SetDecodeSampleRate(int sample_rate, int frame_duration) {
     }
 }
 
+// Called on every listening start, only the properties that changed are serialized
 void Application::UpdateIotStates() {
     auto& thing_manager = iot::ThingManager::GetInstance();
-    std::string states;
-    if (thing_manager.GetStatesJson(states, true)) {
-        protocol_->SendIotStates(states);
+    if (thing_manager.GetStatesJson(iot_states_, true)) {
+        protocol_->SendIotStates(iot_states_);
     }
 }
 
@@ -12,13 +12,14 @@
 #include <vector>
 #include <condition_variable>
 
-#include <opus_encoder.h>
 #include <opus_decoder.h>
 #include <opus_resampler.h>
 
 #include "protocol.h"
 #include "ota.h"
 #include "background_task.h"
+#include "audio_level_meter.h"
+#include "opus_frame_encoder.h"
 
 #if CONFIG_USE_WAKE_WORD_DETECT
 #include "wake_word_detect.h"
@@ -26,6 +27,9 @@
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "audio_processor.h"
 #endif
+#if CONFIG_USE_UPLINK_VAD
+#include "voice_activity_detector.h"
+#endif
 
 #define SCHEDULE_EVENT (1 << 0)
 #define AUDIO_INPUT_READY_EVENT (1 << 1)
@@ -48,6 +52,13 @@ enum DeviceState {
 
 #define OPUS_FRAME_DURATION_MS 60
 
+// Speaking rate used to reveal a sentence before all of its audio has arrived
+#define TTS_MS_PER_WIDE_CHAR 220
+#define TTS_MS_PER_CHAR 60
+
+#define AUDIO_INPUT_TASK_PRIORITY 8
+#define AUDIO_OUTPUT_TASK_PRIORITY 9
+
 class Application {
 public:
     static Application& GetInstance() {
@@ -74,6 +85,11 @@ public:
     void WakeWordInvoke(const std::string& wake_word);
     void PlaySound(const std::string_view& sound);
     bool CanEnterSleepMode();
+    // Level of the TTS audio while speaking, or of the microphone while listening
+    AudioLevel GetAudioLevel() const;
+#if CONFIG_USE_WAKE_WORD_DETECT
+    WakeWordDetect& GetWakeWordDetect() { return wake_word_detect_; }
+#endif
 
 private:
     Application();
@@ -84,6 +100,11 @@ private:
 #endif
 #if CONFIG_USE_AUDIO_PROCESSOR
     AudioProcessor audio_processor_;
+#endif
+#if CONFIG_USE_UPLINK_VAD
+    // Only accessed from the audio input task
+    VoiceActivityDetector uplink_vad_;
+    std::list<std::vector<int16_t>> uplink_preroll_;
 #endif
     Ota ota_;
     std::mutex mutex_;
@@ -103,32 +124,72 @@ private:
     bool busy_decoding_audio_ = false;
     int clock_ticks_ = 0;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
+    // Reused for every delta state report, keeps its capacity. Only touched by the main loop
+    std::string iot_states_;
 
     // Audio encode / decode
-    TaskHandle_t audio_loop_task_handle_ = nullptr;
+    TaskHandle_t audio_input_task_handle_ = nullptr;
+    TaskHandle_t audio_output_task_handle_ = nullptr;
     BackgroundTask* background_task_ = nullptr;
     std::chrono::steady_clock::time_point last_output_time_;
     std::list<std::vector<uint8_t>> audio_decode_queue_;
+    std::list<std::vector<int16_t>> audio_playback_queue_;
     std::condition_variable audio_decode_cv_;
 
-    std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
+    // TTS sentences waiting to be revealed, the boundaries are counted in opus packets.
+    // Guarded by mutex_
+    struct TtsSentence {
+        std::string text;
+        uint32_t first_packet;
+        uint32_t end_packet;
+        uint32_t estimated_packets;
+        bool ended;
+        bool shown;
+        float progress;
+    };
+    std::list<TtsSentence> tts_sentences_;
+    uint32_t audio_packets_queued_ = 0;
+    uint32_t audio_packets_played_ = 0;
+
+    AudioLevelMeter output_level_{"output"};
+    AudioLevelMeter input_level_{"input"};
+
+    std::unique_ptr<OpusFrameEncoder> opus_encoder_;
     std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
 
-    OpusResampler input_resampler_;
-    OpusResampler reference_resampler_;
+    // One resampler per input channel, the reference is the last channel when there is one
+    std::vector<std::unique_ptr<OpusResampler>> input_resamplers_;
     OpusResampler output_resampler_;
 
+    // Microphone buffers, only touched by the audio input task. They keep their capacity, so
+    // feeding the wake word detector or the audio processor does not allocate
+    std::vector<int16_t> input_frame_;
+    std::vector<int16_t> input_raw_;
+    std::vector<std::vector<int16_t>> input_channel_pcm_;
+    std::vector<std::vector<int16_t>> resampled_channel_pcm_;
+
     void MainEventLoop();
-    void OnAudioInput();
+    bool OnAudioInput();
     void OnAudioOutput();
     void ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples);
+    void SendUplinkAudio(std::vector<int16_t>&& data);
+    void OnVoiceDetected(bool speaking);
     void ResetDecoder();
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckNewVersion();
     void ShowActivationCode();
     void OnClockTimer();
     void SetListeningMode(ListeningMode mode);
-    void AudioLoop();
+    void AudioInputTask();
+    void AudioOutputTask();
+    void WaitForPlaybackDrained();
+    void StartTtsSentence(const std::string& text);
+    void EndTtsSentence();
+    void UpdateTtsText(bool packet_played);
+    void FlushTtsText();
+#if CONFIG_USE_WAKE_WORD_DETECT
+    void HandleLocalCommand(WakeWordAction action);
+#endif
 };
 
 #endif // _APPLICATION_H_
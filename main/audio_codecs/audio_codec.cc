@@ -1,8 +1,10 @@
 #include "audio_codec.h"
 #include "board.h"
 #include "settings.h"
+#include "display.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <cstring>
 #include <driver/i2s_common.h>
 
@@ -14,16 +16,90 @@ AudioCodec::AudioCodec() {
 AudioCodec::~AudioCodec() {
 }
 
+bool IRAM_ATTR AudioCodec::OnInputDmaDone(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = (AudioCodec*)user_ctx;
+    portENTER_CRITICAL_ISR(&codec->dma_spinlock_);
+    codec->last_input_dma_time_ = esp_timer_get_time();
+    portEXIT_CRITICAL_ISR(&codec->dma_spinlock_);
+    return false;
+}
+
+bool IRAM_ATTR AudioCodec::OnOutputDmaDone(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = (AudioCodec*)user_ctx;
+    portENTER_CRITICAL_ISR(&codec->dma_spinlock_);
+    codec->last_output_dma_time_ = esp_timer_get_time();
+    portEXIT_CRITICAL_ISR(&codec->dma_spinlock_);
+    return false;
+}
+
 void AudioCodec::OutputData(std::vector<int16_t>& data) {
     Write(data.data(), data.size());
+
+    if (playback_reference_ != nullptr) {
+        // The block just written fills the buffer released by the last DMA event,
+        // it finishes playing after all the other descriptors in the ring
+        portENTER_CRITICAL(&dma_spinlock_);
+        int64_t dma_time = last_output_dma_time_;
+        portEXIT_CRITICAL(&dma_spinlock_);
+        int64_t play_end = dma_time + (int64_t)AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM * 1000000 / output_sample_rate_;
+        int64_t play_start = play_end - (int64_t)data.size() * 1000000 / output_sample_rate_;
+        playback_reference_->Write(data.data(), data.size(), play_start);
+    }
 }
 
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
-    int samples = Read(data.data(), data.size());
-    if (samples > 0) {
+    if (playback_reference_ == nullptr) {
+        int samples = Read(data.data(), data.size());
+        if (samples <= 0) {
+            return false;
+        }
+        if (echo_delay_estimator_ != nullptr) {
+            // The loopback is the last channel, the first microphone is compared against it
+            echo_delay_estimator_->Process(data.data(), input_channels_, data.data() + input_channels_ - 1, input_channels_,
+                samples / input_channels_);
+        }
         return true;
     }
-    return false;
+
+    // Read the microphone channels, then interleave the software reference as the last channel
+    const int channels = input_channels();
+    const int mic_channels = input_channels_;
+    size_t frames = data.size() / channels;
+    mic_buffer_.resize(frames * mic_channels);
+    int samples = Read(mic_buffer_.data(), mic_buffer_.size());
+    if (samples <= 0) {
+        return false;
+    }
+    frames = samples / mic_channels;
+
+    portENTER_CRITICAL(&dma_spinlock_);
+    int64_t capture_end = last_input_dma_time_;
+    portEXIT_CRITICAL(&dma_spinlock_);
+    reference_buffer_.resize(frames);
+    playback_reference_->Read(mic_buffer_.data(), mic_channels, reference_buffer_.data(), frames, capture_end);
+
+    data.resize(frames * channels);
+    for (size_t i = 0; i < frames; i++) {
+        for (int c = 0; c < mic_channels; c++) {
+            data[i * channels + c] = mic_buffer_[i * mic_channels + c];
+        }
+        data[i * channels + mic_channels] = reference_buffer_[i];
+    }
+    return true;
+}
+
+void AudioCodec::EnablePlaybackReference() {
+    if (input_reference_ || playback_reference_ != nullptr) {
+        return;
+    }
+    playback_reference_ = std::make_unique<PlaybackReference>(output_sample_rate_, input_sample_rate_);
+}
+
+void AudioCodec::EnableEchoDelayEstimator() {
+    if (!input_reference_ || echo_delay_estimator_ != nullptr) {
+        return;
+    }
+    echo_delay_estimator_ = std::make_unique<EchoDelayEstimator>(input_sample_rate_);
 }
 
 void AudioCodec::Start() {
@@ -34,6 +110,14 @@ void AudioCodec::Start() {
         output_volume_ = 10;
     }
 
+    // DMA event callbacks must be registered before the channels are enabled
+    i2s_event_callbacks_t rx_callbacks = {};
+    rx_callbacks.on_recv = OnInputDmaDone;
+    ESP_ERROR_CHECK(i2s_channel_register_event_callback(rx_handle_, &rx_callbacks, this));
+    i2s_event_callbacks_t tx_callbacks = {};
+    tx_callbacks.on_sent = OnOutputDmaDone;
+    ESP_ERROR_CHECK(i2s_channel_register_event_callback(tx_handle_, &tx_callbacks, this));
+
     ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
     ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
 
@@ -48,6 +132,12 @@ void AudioCodec::SetOutputVolume(int volume) {
     
     Settings settings("audio", true);
     settings.SetInt("output_volume", output_volume_);
+
+    // Update the mute icon without waiting for the next status poll
+    auto display = Board::GetInstance().GetDisplay();
+    if (display != nullptr) {
+        display->RefreshStatusIcons();
+    }
 }
 
 void AudioCodec::EnableInput(bool enable) {
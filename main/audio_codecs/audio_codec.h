@@ -8,8 +8,10 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include <memory>
 
 #include "board.h"
+#include "playback_reference.h"
 
 #define AUDIO_CODEC_DMA_DESC_NUM 6
 #define AUDIO_CODEC_DMA_FRAME_NUM 240
@@ -26,12 +28,16 @@ public:
     void Start();
     void OutputData(std::vector<int16_t>& data);
     bool InputData(std::vector<int16_t>& data);
+    // Append a software echo reference channel to the input, must be called before Start()
+    void EnablePlaybackReference();
+    // Measure and log the echo delay against the hardware reference channel, must be called before Start()
+    void EnableEchoDelayEstimator();
 
     inline bool duplex() const { return duplex_; }
-    inline bool input_reference() const { return input_reference_; }
+    inline bool input_reference() const { return input_reference_ || playback_reference_ != nullptr; }
     inline int input_sample_rate() const { return input_sample_rate_; }
     inline int output_sample_rate() const { return output_sample_rate_; }
-    inline int input_channels() const { return input_channels_; }
+    inline int input_channels() const { return input_channels_ + (playback_reference_ != nullptr ? 1 : 0); }
     inline int output_channels() const { return output_channels_; }
     inline int output_volume() const { return output_volume_; }
     inline bool input_enabled() const { return input_enabled_; }
@@ -53,6 +59,20 @@ protected:
 
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
+
+private:
+    // Timestamps of the last completed DMA descriptors, updated from the I2S ISR
+    portMUX_TYPE dma_spinlock_ = portMUX_INITIALIZER_UNLOCKED;
+    int64_t last_input_dma_time_ = 0;
+    int64_t last_output_dma_time_ = 0;
+
+    std::unique_ptr<PlaybackReference> playback_reference_;
+    std::unique_ptr<EchoDelayEstimator> echo_delay_estimator_;
+    std::vector<int16_t> mic_buffer_;
+    std::vector<int16_t> reference_buffer_;
+
+    static bool OnInputDmaDone(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    static bool OnOutputDmaDone(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
 };
 
 #endif // _AUDIO_CODEC_H
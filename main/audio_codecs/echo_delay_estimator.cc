@@ -0,0 +1,128 @@
+#include "echo_delay_estimator.h"
+
+#include <esp_log.h>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#define TAG "EchoDelayEstimator"
+
+// Cross-correlation is computed at about 4kHz over a 256ms window
+#define ESTIMATE_SAMPLE_RATE 4000
+#define ESTIMATE_WINDOW 1024
+#define ESTIMATE_MIN_LAG_MS -20
+#define ESTIMATE_MAX_LAG_MS 120
+#define ESTIMATE_INTERVAL_MS 500
+#define ESTIMATE_MIN_CORRELATION 0.3f
+
+EchoDelayEstimator::EchoDelayEstimator(int sample_rate) : sample_rate_(sample_rate) {
+    decimation_ = std::max(1, sample_rate_ / ESTIMATE_SAMPLE_RATE);
+    const int estimate_rate = sample_rate_ / decimation_;
+    min_lag_ = ESTIMATE_MIN_LAG_MS * estimate_rate / 1000;
+    max_lag_ = ESTIMATE_MAX_LAG_MS * estimate_rate / 1000;
+    // The microphone window ends -min_lag_ samples before the newest one, so the reference
+    // around it is already known for every lag
+    history_size_ = ESTIMATE_WINDOW + max_lag_ - min_lag_;
+    mic_history_.resize(history_size_ * 2);
+    reference_history_.resize(history_size_ * 2);
+}
+
+void EchoDelayEstimator::Reset() {
+    history_filled_ = 0;
+    sum_count_ = 0;
+    mic_sum_ = 0;
+    reference_sum_ = 0;
+    has_candidate_ = false;
+}
+
+void EchoDelayEstimator::Process(const int16_t* mic, int mic_stride, const int16_t* reference, int reference_stride, size_t samples) {
+    const size_t interval = ESTIMATE_INTERVAL_MS * (sample_rate_ / decimation_) / 1000;
+    for (size_t i = 0; i < samples; i++) {
+        mic_sum_ += mic[i * mic_stride];
+        reference_sum_ += reference[i * reference_stride];
+        if (++sum_count_ < decimation_) {
+            continue;
+        }
+        int16_t mic_value = mic_sum_ / decimation_;
+        int16_t reference_value = reference_sum_ / decimation_;
+        mic_history_[history_pos_] = mic_history_[history_pos_ + history_size_] = mic_value;
+        reference_history_[history_pos_] = reference_history_[history_pos_ + history_size_] = reference_value;
+        history_pos_ = (history_pos_ + 1) % history_size_;
+        history_filled_ = std::min(history_filled_ + 1, history_size_);
+        mic_sum_ = 0;
+        reference_sum_ = 0;
+        sum_count_ = 0;
+
+        if (++since_estimate_ >= interval && history_filled_ == history_size_) {
+            since_estimate_ = 0;
+            Estimate();
+        }
+    }
+}
+
+void EchoDelayEstimator::Estimate() {
+    const int window = ESTIMATE_WINDOW;
+    const int ref_length = history_size_;
+    // Oldest sample first. ref[k] pairs with mic[j] at lag L when k == j + max_lag_ - L
+    const int16_t* mic = mic_history_.data() + history_pos_ + max_lag_;
+    const int16_t* ref = reference_history_.data() + history_pos_;
+
+    int64_t mic_energy = 0;
+    for (int j = 0; j < window; j++) {
+        mic_energy += (int64_t)mic[j] * mic[j];
+    }
+    int64_t total_ref_energy = 0;
+    int64_t ref_energy = 0;
+    for (int k = 0; k < ref_length; k++) {
+        total_ref_energy += (int64_t)ref[k] * ref[k];
+        if (k < window) {
+            ref_energy = total_ref_energy;
+        }
+    }
+    // Nothing is playing or the microphone is silent
+    if (mic_energy < (int64_t)window * 16 || total_ref_energy < (int64_t)window * 16) {
+        has_candidate_ = false;
+        return;
+    }
+
+    float best = 0;
+    int best_lag = 0;
+    for (int offset = 0; offset <= max_lag_ - min_lag_; offset++) {
+        if (offset > 0) {
+            // Slide the reference energy window by one sample
+            ref_energy += (int64_t)ref[offset + window - 1] * ref[offset + window - 1]
+                - (int64_t)ref[offset - 1] * ref[offset - 1];
+        }
+        if (ref_energy <= 0) {
+            continue;
+        }
+        const int16_t* shifted = ref + offset;
+        int64_t corr = 0;
+        for (int j = 0; j < window; j++) {
+            corr += (int32_t)mic[j] * shifted[j];
+        }
+        float norm = corr / sqrtf((float)mic_energy * (float)ref_energy);
+        if (norm > best) {
+            best = norm;
+            best_lag = max_lag_ - offset;
+        }
+    }
+
+    if (best < ESTIMATE_MIN_CORRELATION) {
+        has_candidate_ = false;
+        return;
+    }
+
+    // Require two consecutive estimates to agree before moving the alignment
+    if (has_candidate_ && std::abs(best_lag - candidate_lag_) <= 1) {
+        int delay = best_lag * decimation_;
+        int previous = delay_samples_;
+        delay_samples_ = delay_locked_ ? (3 * previous + delay) / 4 : delay;
+        delay_locked_ = true;
+        if (std::abs(delay_samples_ - previous) * 1000 / sample_rate_ >= 2) {
+            ESP_LOGI(TAG, "Echo delay %d ms (correlation %.2f)", delay_ms(), best);
+        }
+    }
+    candidate_lag_ = best_lag;
+    has_candidate_ = true;
+}
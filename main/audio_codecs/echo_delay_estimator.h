@@ -0,0 +1,51 @@
+#ifndef _ECHO_DELAY_ESTIMATOR_H
+#define _ECHO_DELAY_ESTIMATOR_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Measures how far the echo in the microphone lags the reference signal by cross-correlating
+// decimated copies of both. Fed from a single task with time aligned blocks of both streams,
+// works the same for a hardware loopback channel and for the software playback reference.
+class EchoDelayEstimator {
+public:
+    EchoDelayEstimator(int sample_rate);
+
+    // mic and reference hold samples captured at the same time, every *_stride-th sample is used
+    void Process(const int16_t* mic, int mic_stride, const int16_t* reference, int reference_stride, size_t samples);
+    // Call when either stream was interrupted, the measured delay is kept
+    void Reset();
+
+    inline int delay_samples() const { return delay_samples_; }
+    inline int delay_ms() const { return delay_samples_ * 1000 / sample_rate_; }
+
+private:
+    int sample_rate_;
+    int decimation_ = 1;
+    int min_lag_ = 0;
+    int max_lag_ = 0;
+
+    // Decimated histories, every sample is stored twice so the last history_size_ samples are
+    // always contiguous at history_pos_
+    std::vector<int16_t> mic_history_;
+    std::vector<int16_t> reference_history_;
+    size_t history_size_ = 0;
+    size_t history_pos_ = 0;
+    size_t history_filled_ = 0;
+    int32_t mic_sum_ = 0;
+    int32_t reference_sum_ = 0;
+    int sum_count_ = 0;
+    size_t since_estimate_ = 0;
+
+    // Read from other tasks through delay_ms()
+    std::atomic<int> delay_samples_{0};
+    int candidate_lag_ = 0;
+    bool has_candidate_ = false;
+    bool delay_locked_ = false;
+
+    void Estimate();
+};
+
+#endif // _ECHO_DELAY_ESTIMATOR_H
@@ -0,0 +1,127 @@
+#include "playback_reference.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#define TAG "PlaybackReference"
+
+// Keep 1 second of played audio, enough for the DMA latency plus the delay search range
+#define REFERENCE_RING_MS 1000
+
+PlaybackReference::PlaybackReference(int output_sample_rate, int reference_sample_rate)
+    : sample_rate_(reference_sample_rate), estimator_(reference_sample_rate) {
+    if (output_sample_rate != reference_sample_rate) {
+        resampler_.Configure(output_sample_rate, reference_sample_rate);
+        resample_ = true;
+    }
+
+    ring_size_ = sample_rate_ * REFERENCE_RING_MS / 1000;
+    ring_ = (int16_t*)heap_caps_malloc(ring_size_ * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (ring_ == nullptr) {
+        ring_ = (int16_t*)heap_caps_malloc(ring_size_ * sizeof(int16_t), MALLOC_CAP_8BIT);
+    }
+    assert(ring_ != nullptr);
+    memset(ring_, 0, ring_size_ * sizeof(int16_t));
+
+    ESP_LOGI(TAG, "Software playback reference enabled, %d Hz, ring %zu samples", sample_rate_, ring_size_);
+}
+
+PlaybackReference::~PlaybackReference() {
+    if (ring_ != nullptr) {
+        heap_caps_free(ring_);
+    }
+}
+
+int64_t PlaybackReference::TimeToIndex(int64_t time_us) const {
+    return anchor_index_ + (time_us - anchor_time_us_) * sample_rate_ / 1000000;
+}
+
+void PlaybackReference::AppendRing(const int16_t* data, size_t samples) {
+    if (samples > ring_size_) {
+        write_index_ += samples - ring_size_;
+        data += samples - ring_size_;
+        samples = ring_size_;
+    }
+    size_t pos = write_index_ % ring_size_;
+    size_t first = std::min(samples, ring_size_ - pos);
+    memcpy(ring_ + pos, data, first * sizeof(int16_t));
+    memcpy(ring_, data + first, (samples - first) * sizeof(int16_t));
+    write_index_ += samples;
+}
+
+void PlaybackReference::ZeroRing(size_t samples) {
+    samples = std::min(samples, ring_size_);
+    size_t pos = write_index_ % ring_size_;
+    size_t first = std::min(samples, ring_size_ - pos);
+    memset(ring_ + pos, 0, first * sizeof(int16_t));
+    memset(ring_, 0, (samples - first) * sizeof(int16_t));
+    write_index_ += samples;
+}
+
+int16_t PlaybackReference::RingAt(int64_t index) const {
+    if (index < 0 || index >= write_index_ || index < write_index_ - (int64_t)ring_size_) {
+        return 0;
+    }
+    return ring_[index % ring_size_];
+}
+
+void PlaybackReference::Write(const int16_t* data, size_t samples, int64_t play_time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (resample_) {
+        resample_buffer_.resize(resampler_.GetOutputSamples(samples));
+        resampler_.Process(data, samples, resample_buffer_.data());
+        data = resample_buffer_.data();
+        samples = resample_buffer_.size();
+    }
+
+    if (anchor_time_us_ != 0) {
+        // Playback was paused since the last block, pad with silence so the ring stays continuous in time
+        int64_t gap = TimeToIndex(play_time_us) - write_index_;
+        if (gap > sample_rate_ / 50) {
+            if (gap > (int64_t)ring_size_) {
+                memset(ring_, 0, ring_size_ * sizeof(int16_t));
+                write_index_ += gap;
+            } else {
+                ZeroRing(gap);
+            }
+        }
+    }
+
+    anchor_index_ = write_index_;
+    anchor_time_us_ = play_time_us;
+    AppendRing(data, samples);
+}
+
+void PlaybackReference::Read(const int16_t* mic, int mic_stride, int16_t* reference, size_t samples, int64_t capture_end_us) {
+    bool interrupted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (anchor_time_us_ == 0) {
+            memset(reference, 0, samples * sizeof(int16_t));
+            return;
+        }
+
+        // The echo in a microphone sample captured at time t was played at t - delay. The estimator
+        // gets the unshifted samples and measures the remaining delay
+        int64_t end_index = TimeToIndex(capture_end_us);
+        int64_t start_index = end_index - samples;
+        int delay = estimator_.delay_samples();
+        estimate_reference_.resize(samples);
+        for (size_t i = 0; i < samples; i++) {
+            reference[i] = RingAt(start_index - delay + i);
+            estimate_reference_[i] = RingAt(start_index + i);
+        }
+        // Capture was interrupted, the microphone history is no longer continuous
+        interrupted = std::abs(start_index - last_end_index_) > sample_rate_ / 100;
+        last_end_index_ = end_index;
+    }
+
+    // Only this task touches the estimator, the correlation runs without holding up Write
+    if (interrupted) {
+        estimator_.Reset();
+    }
+    estimator_.Process(mic, mic_stride, estimate_reference_.data(), 1, samples);
+}
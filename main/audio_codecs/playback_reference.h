@@ -0,0 +1,52 @@
+#ifndef _PLAYBACK_REFERENCE_H
+#define _PLAYBACK_REFERENCE_H
+
+#include <opus_resampler.h>
+
+#include <mutex>
+#include <vector>
+
+#include "echo_delay_estimator.h"
+
+// Software echo reference for boards without a hardware loopback channel.
+// Keeps a ring of the PCM actually handed to the I2S DMA, stamped with the time it reaches
+// the DAC, and serves the samples that were playing while a microphone block was captured.
+// An EchoDelayEstimator tracks the residual (acoustic + pipeline) delay.
+class PlaybackReference {
+public:
+    PlaybackReference(int output_sample_rate, int reference_sample_rate);
+    ~PlaybackReference();
+
+    // play_time_us: when the first sample of data reaches the DAC
+    void Write(const int16_t* data, size_t samples, int64_t play_time_us);
+    // Fill reference with the samples played while mic was captured, capture_end_us is when the
+    // last sample of the block was captured, mic_stride is the channel count of mic
+    void Read(const int16_t* mic, int mic_stride, int16_t* reference, size_t samples, int64_t capture_end_us);
+
+    inline int delay_ms() const { return estimator_.delay_ms(); }
+
+private:
+    std::mutex mutex_;
+    int sample_rate_;
+    OpusResampler resampler_;
+    bool resample_ = false;
+    std::vector<int16_t> resample_buffer_;
+
+    int16_t* ring_ = nullptr;
+    size_t ring_size_ = 0;
+    int64_t write_index_ = 0;
+    int64_t anchor_index_ = 0;
+    int64_t anchor_time_us_ = 0;
+
+    // Only touched by the reading task
+    EchoDelayEstimator estimator_;
+    std::vector<int16_t> estimate_reference_;
+    int64_t last_end_index_ = 0;
+
+    int64_t TimeToIndex(int64_t time_us) const;
+    void AppendRing(const int16_t* data, size_t samples);
+    void ZeroRing(size_t samples);
+    int16_t RingAt(int64_t index) const;
+};
+
+#endif // _PLAYBACK_REFERENCE_H
@@ -0,0 +1,179 @@
+#include "afe_front_end.h"
+
+#include <esp_log.h>
+#include <model_path.h>
+#include <esp_nsn_models.h>
+#include <esp_heap_caps.h>
+
+#include "settings.h"
+
+#define ALL_CONSUMERS ((1 << AFE_MAX_CONSUMERS) - 1)
+#define FETCH_TASK_EXIT_EVENT (1 << AFE_MAX_CONSUMERS)
+#define FETCH_TASK_EXITED_EVENT (1 << (AFE_MAX_CONSUMERS + 1))
+
+static const char* TAG = "AfeFrontEnd";
+
+AfeFrontEnd::AfeFrontEnd(const char* name) : name_(name) {
+    event_group_ = xEventGroupCreate();
+}
+
+AfeFrontEnd::~AfeFrontEnd() {
+    Deinitialize();
+    vEventGroupDelete(event_group_);
+}
+
+std::string AfeFrontEnd::GetInputFormat(AudioCodec* codec) {
+    int ref_num = codec->input_reference() ? 1 : 0;
+    std::string input_format;
+    for (int i = 0; i < codec->input_channels() - ref_num; i++) {
+        input_format.push_back('M');
+    }
+    for (int i = 0; i < ref_num; i++) {
+        input_format.push_back('R');
+    }
+    return input_format;
+}
+
+void AfeFrontEnd::Initialize(AudioCodec* codec, afe_config_t* afe_config) {
+    if (afe_data_ != nullptr) {
+        return;
+    }
+    codec_ = codec;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        afe_iface_ = esp_afe_handle_from_config(afe_config);
+        afe_data_ = afe_iface_->create_from_config(afe_config);
+    }
+
+    xTaskCreate([](void* arg) {
+        auto this_ = (AfeFrontEnd*)arg;
+        this_->FetchTask();
+        vTaskDelete(NULL);
+    }, name_.c_str(), 4096, this, 3, nullptr);
+}
+
+void AfeFrontEnd::Deinitialize() {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    // Consumers stay disabled, the owner enables them again once the AFE is recreated
+    xEventGroupClearBits(event_group_, ALL_CONSUMERS);
+    xEventGroupSetBits(event_group_, FETCH_TASK_EXIT_EVENT);
+    xEventGroupWaitBits(event_group_, FETCH_TASK_EXITED_EVENT, pdTRUE, pdTRUE, portMAX_DELAY);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    afe_iface_->destroy(afe_data_);
+    afe_data_ = nullptr;
+    ESP_LOGI(TAG, "%s released, free PSRAM: %u", name_.c_str(), heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+}
+
+srmodel_list_t* AfeFrontEnd::GetModels() {
+    static srmodel_list_t* models = esp_srmodel_init("model");
+    return models;
+}
+
+#if CONFIG_USE_SHARED_AFE
+void AfeFrontEnd::InitializeShared(AudioCodec* codec, srmodel_list_t* models) {
+    if (afe_data_ != nullptr) {
+        return;
+    }
+
+    // WakeNet, VAD, AEC and NS in one SR pipeline, the consumers toggle the stages they need
+    char* ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
+    afe_config_t* afe_config = afe_config_init(GetInputFormat(codec).c_str(), models, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
+    Settings settings("wake_word");
+    auto wakenet_model = settings.GetString("model");
+    for (int i = 0; i < models->num; i++) {
+        if (wakenet_model == models->model_name[i]) {
+            afe_config->wakenet_model_name = models->model_name[i];
+        }
+    }
+    afe_config->aec_init = codec->input_reference();
+    afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
+    afe_config->ns_init = ns_model_name != NULL;
+    afe_config->ns_model_name = ns_model_name;
+    afe_config->afe_ns_mode = AFE_NS_MODE_NET;
+    afe_config->vad_init = true;
+    afe_config->vad_mode = VAD_MODE_0;
+    afe_config->vad_min_noise_ms = 100;
+    afe_config->agc_init = false;
+    afe_config->afe_perferred_core = 1;
+    afe_config->afe_perferred_priority = 1;
+    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+    Initialize(codec, afe_config);
+}
+#endif
+
+int AfeFrontEnd::AddConsumer(std::function<void(afe_fetch_result_t* result)> callback) {
+    assert(consumer_count_ < AFE_MAX_CONSUMERS);
+    consumers_[consumer_count_] = callback;
+    return consumer_count_++;
+}
+
+void AfeFrontEnd::EnableConsumer(int id, bool enable) {
+    if (enable) {
+        xEventGroupSetBits(event_group_, 1 << id);
+        return;
+    }
+    xEventGroupClearBits(event_group_, 1 << id);
+    // Drop stale audio only when nobody is using the pipeline any more. The lock keeps
+    // Deinitialize from destroying the AFE under us, it only waits for the fetch task before taking it
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (afe_data_ != nullptr && (xEventGroupGetBits(event_group_) & ALL_CONSUMERS) == 0) {
+        afe_iface_->reset_buffer(afe_data_);
+    }
+}
+
+bool AfeFrontEnd::IsConsumerEnabled(int id) {
+    return xEventGroupGetBits(event_group_) & (1 << id);
+}
+
+void AfeFrontEnd::Feed(const std::vector<int16_t>& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    afe_iface_->feed(afe_data_, data.data());
+}
+
+size_t AfeFrontEnd::GetFeedSize() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (afe_data_ == nullptr) {
+        return 0;
+    }
+    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
+}
+
+void AfeFrontEnd::FetchTask() {
+    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
+    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
+    ESP_LOGI(TAG, "%s task started, feed size: %d fetch size: %d", name_.c_str(), feed_size, fetch_size);
+
+    while (true) {
+        auto bits = xEventGroupWaitBits(event_group_, ALL_CONSUMERS | FETCH_TASK_EXIT_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+        if (bits & FETCH_TASK_EXIT_EVENT) {
+            break;
+        }
+
+        // Bounded wait so Deinitialize is noticed even when nothing is fed
+        auto res = afe_iface_->fetch_with_delay(afe_data_, pdMS_TO_TICKS(100));
+        bits = xEventGroupGetBits(event_group_);
+        if ((bits & ALL_CONSUMERS) == 0 || (bits & FETCH_TASK_EXIT_EVENT)) {
+            continue;
+        }
+        if (res == nullptr || res->ret_value == ESP_FAIL) {
+            if (res != nullptr) {
+                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < consumer_count_; i++) {
+            if (bits & (1 << i)) {
+                consumers_[i](res);
+            }
+        }
+    }
+    xEventGroupClearBits(event_group_, FETCH_TASK_EXIT_EVENT);
+    xEventGroupSetBits(event_group_, FETCH_TASK_EXITED_EVENT);
+}
@@ -0,0 +1,68 @@
+#ifndef AFE_FRONT_END_H
+#define AFE_FRONT_END_H
+
+#include <esp_afe_sr_models.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+
+#include "audio_codec.h"
+
+#define AFE_MAX_CONSUMERS 4
+
+// Owns an AFE instance and its fetch task. Every fetched frame is handed to each enabled
+// consumer, so one AEC/NS pipeline can serve wake word detection, VAD and the uplink at once.
+class AfeFrontEnd {
+public:
+    AfeFrontEnd(const char* name);
+    ~AfeFrontEnd();
+
+    void Initialize(AudioCodec* codec, afe_config_t* afe_config);
+    // Stop the fetch task and destroy the AFE to release its models and buffers. Consumers stay
+    // registered but are disabled, Initialize can be called again
+    void Deinitialize();
+    bool initialized() const { return afe_data_ != nullptr; }
+    void Feed(const std::vector<int16_t>& data);
+    size_t GetFeedSize();
+
+    // Consumers must be added before they are enabled, callbacks run on the fetch task
+    int AddConsumer(std::function<void(afe_fetch_result_t* result)> callback);
+    void EnableConsumer(int id, bool enable);
+    bool IsConsumerEnabled(int id);
+
+    inline esp_afe_sr_iface_t* afe_iface() const { return afe_iface_; }
+    inline esp_afe_sr_data_t* afe_data() const { return afe_data_; }
+
+    static std::string GetInputFormat(AudioCodec* codec);
+    // The model partition is only parsed once, every front end shares the list
+    static srmodel_list_t* GetModels();
+
+#if CONFIG_USE_SHARED_AFE
+    // The single front end shared by WakeWordDetect and AudioProcessor
+    static AfeFrontEnd& GetShared() {
+        static AfeFrontEnd instance("audio_front_end");
+        return instance;
+    }
+    // The wakenet model selected in the "wake_word" settings is used if present
+    void InitializeShared(AudioCodec* codec, srmodel_list_t* models);
+#endif
+
+private:
+    std::string name_;
+    std::mutex mutex_;
+    EventGroupHandle_t event_group_ = nullptr;
+    esp_afe_sr_iface_t* afe_iface_ = nullptr;
+    esp_afe_sr_data_t* afe_data_ = nullptr;
+    AudioCodec* codec_ = nullptr;
+    std::function<void(afe_fetch_result_t* result)> consumers_[AFE_MAX_CONSUMERS];
+    int consumer_count_ = 0;
+
+    void FetchTask();
+};
+
+#endif
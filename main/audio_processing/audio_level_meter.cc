@@ -0,0 +1,133 @@
+#include "audio_level_meter.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <cmath>
+
+#define TAG "AudioLevelMeter"
+
+// Frames are decimated to about this rate before the analysis, the bands stay below its Nyquist
+#define AUDIO_LEVEL_ANALYSIS_RATE 8000
+// Goertzel coefficients are Q14
+#define AUDIO_LEVEL_COEFF_SHIFT 14
+// log2 in Q4 of the quietest (about -54dBFS) and loudest RMS amplitude
+#define AUDIO_LEVEL_FLOOR_Q4 (6 * 16)
+#define AUDIO_LEVEL_TOP_Q4 (15 * 16)
+// Instant attack, the level falls by this much per frame
+#define AUDIO_LEVEL_RELEASE 24
+// Consumers see silence when no frame arrived for this long
+#define AUDIO_LEVEL_HOLD_US (200 * 1000)
+// Report the CPU share of the analysis after this much audio
+#define AUDIO_LEVEL_STATS_US (60 * 1000 * 1000LL)
+
+static const int kBandFrequencies[AUDIO_LEVEL_BANDS] = { 200, 600, 1500, 3000 };
+
+static int Log2Q4(uint64_t x) {
+    if (x == 0) {
+        return 0;
+    }
+    int msb = 63 - __builtin_clzll(x);
+    int frac = msb >= 4 ? (x >> (msb - 4)) & 0xF : (x << (4 - msb)) & 0xF;
+    return msb * 16 + frac;
+}
+
+static uint8_t ToLevel(int log2_q4) {
+    int level = (log2_q4 - AUDIO_LEVEL_FLOOR_Q4) * 255 / (AUDIO_LEVEL_TOP_Q4 - AUDIO_LEVEL_FLOOR_Q4);
+    return std::clamp(level, 0, 255);
+}
+
+static uint8_t Smooth(uint8_t previous, uint8_t current) {
+    return std::max<int>(current, previous - AUDIO_LEVEL_RELEASE);
+}
+
+AudioLevelMeter::AudioLevelMeter(const char* name) : name_(name) {
+}
+
+void AudioLevelMeter::SetupBands(int sample_rate) {
+    sample_rate_ = sample_rate;
+    stride_ = std::max(1, sample_rate / AUDIO_LEVEL_ANALYSIS_RATE);
+    float analysis_rate = (float)sample_rate / stride_;
+    for (int b = 0; b < AUDIO_LEVEL_BANDS; b++) {
+        coeffs_[b] = lroundf(2.0f * cosf(2.0f * (float)M_PI * kBandFrequencies[b] / analysis_rate) * (1 << AUDIO_LEVEL_COEFF_SHIFT));
+    }
+}
+
+void AudioLevelMeter::Reset() {
+    published_.store(0, std::memory_order_relaxed);
+    update_time_.store(0, std::memory_order_relaxed);
+}
+
+void AudioLevelMeter::Process(const int16_t* data, size_t samples, int sample_rate, int channels) {
+    int64_t start_time = esp_timer_get_time();
+    if (sample_rate != sample_rate_) {
+        SetupBands(sample_rate);
+    }
+    if (start_time - update_time_.load(std::memory_order_relaxed) > AUDIO_LEVEL_HOLD_US) {
+        smoothed_ = AudioLevel();
+    }
+
+    // s1 / s2 stay below n * 32768 / 2, only the coefficient product needs 64 bits
+    uint64_t energy = 0;
+    int32_t s1[AUDIO_LEVEL_BANDS] = {};
+    int32_t s2[AUDIO_LEVEL_BANDS] = {};
+    size_t step = stride_ * channels;
+    uint32_t n = 0;
+    for (size_t i = 0; i < samples; i += step) {
+        int32_t x = data[i];
+        energy += (uint32_t)(x * x);
+        for (int b = 0; b < AUDIO_LEVEL_BANDS; b++) {
+            int32_t s0 = x + (int32_t)(((int64_t)coeffs_[b] * s1[b]) >> AUDIO_LEVEL_COEFF_SHIFT) - s2[b];
+            s2[b] = s1[b];
+            s1[b] = s0;
+        }
+        n++;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    AudioLevel current;
+    current.level = ToLevel(Log2Q4(energy / n) / 2);
+    int log2_half_n = Log2Q4(n) - 16;
+    for (int b = 0; b < AUDIO_LEVEL_BANDS; b++) {
+        // |X|^2 of the bin, a sine of amplitude A peaks at (A * n / 2)^2
+        int64_t power = (int64_t)s1[b] * s1[b] + (int64_t)s2[b] * s2[b]
+            - (((int64_t)coeffs_[b] * s1[b]) >> AUDIO_LEVEL_COEFF_SHIFT) * s2[b];
+        current.bands[b] = ToLevel(Log2Q4(std::max<int64_t>(power, 0)) / 2 - log2_half_n);
+    }
+
+    smoothed_.level = Smooth(smoothed_.level, current.level);
+    uint64_t packed = smoothed_.level;
+    for (int b = 0; b < AUDIO_LEVEL_BANDS; b++) {
+        smoothed_.bands[b] = Smooth(smoothed_.bands[b], current.bands[b]);
+        packed |= (uint64_t)smoothed_.bands[b] << (8 * (b + 1));
+    }
+    published_.store(packed, std::memory_order_relaxed);
+
+    int64_t end_time = esp_timer_get_time();
+    update_time_.store(end_time, std::memory_order_relaxed);
+
+    busy_us_ += end_time - start_time;
+    audio_us_ += (int64_t)(samples / channels) * 1000000 / sample_rate;
+    if (audio_us_ >= AUDIO_LEVEL_STATS_US) {
+        ESP_LOGI(TAG, "%s: %d us per %d ms of audio (%.3f%% CPU)", name_, (int)busy_us_, (int)(audio_us_ / 1000),
+            busy_us_ * 100.0 / audio_us_);
+        busy_us_ = 0;
+        audio_us_ = 0;
+    }
+}
+
+AudioLevel AudioLevelMeter::level() const {
+    AudioLevel level;
+    if (esp_timer_get_time() - update_time_.load(std::memory_order_relaxed) > AUDIO_LEVEL_HOLD_US) {
+        return level;
+    }
+    uint64_t packed = published_.load(std::memory_order_relaxed);
+    level.level = packed & 0xFF;
+    for (int b = 0; b < AUDIO_LEVEL_BANDS; b++) {
+        level.bands[b] = (packed >> (8 * (b + 1))) & 0xFF;
+    }
+    return level;
+}
@@ -0,0 +1,44 @@
+#ifndef AUDIO_LEVEL_METER_H
+#define AUDIO_LEVEL_METER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#define AUDIO_LEVEL_BANDS 4
+
+// Loudness and a coarse spectrum, 0 is silence and 255 is full scale on a log scale
+struct AudioLevel {
+    uint8_t level = 0;
+    uint8_t bands[AUDIO_LEVEL_BANDS] = {};
+};
+
+// Tap on PCM frames that are already in flight. Computes the RMS and a few Goertzel bands on a
+// decimated copy of the frame without allocating, integer only, so it can run in the audio tasks.
+// The result is published lock free for consumers polling at their own rate (e.g. LEDs).
+class AudioLevelMeter {
+public:
+    AudioLevelMeter(const char* name);
+
+    // Interleaved frames are analyzed on the first channel only
+    void Process(const int16_t* data, size_t samples, int sample_rate, int channels = 1);
+    // The level falls to zero when no frame was processed recently
+    AudioLevel level() const;
+    void Reset();
+
+private:
+    const char* name_;
+    int sample_rate_ = 0;
+    int stride_ = 1;
+    int32_t coeffs_[AUDIO_LEVEL_BANDS] = {};
+    AudioLevel smoothed_;
+    std::atomic<uint64_t> published_{0};
+    std::atomic<int64_t> update_time_{0};
+
+    int64_t busy_us_ = 0;
+    int64_t audio_us_ = 0;
+
+    void SetupBands(int sample_rate);
+};
+
+#endif
@@ -1,31 +1,26 @@
 #include "audio_processor.h"
 #include <esp_log.h>
-
-#define PROCESSOR_RUNNING 0x01
+#include <model_path.h>
+#include <esp_nsn_models.h>
 
 static const char* TAG = "AudioProcessor";
 
-AudioProcessor::AudioProcessor()
-    : afe_data_(nullptr) {
-    event_group_ = xEventGroupCreate();
+AudioProcessor::AudioProcessor() {
 }
 
-void AudioProcessor::Initialize(AudioCodec* codec, bool realtime_chat) {
+void AudioProcessor::Initialize(AudioCodec* codec, bool realtime_chat, int frame_duration_ms) {
     codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
-
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
-    }
-
-    srmodel_list_t *models = esp_srmodel_init("model");
+    frame_pool_ = std::make_unique<PcmFramePool>(16000 * frame_duration_ms / 1000, AUDIO_PROCESSOR_FRAME_POOL_SIZE);
+    accumulator_ = std::make_unique<PcmFrameAccumulator>(*frame_pool_);
+
+#if CONFIG_USE_SHARED_AFE
+    front_end_ = &AfeFrontEnd::GetShared();
+    front_end_->InitializeShared(codec_, AfeFrontEnd::GetModels());
+#else
+    srmodel_list_t *models = AfeFrontEnd::GetModels();
     char* ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
 
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
+    afe_config_t* afe_config = afe_config_init(AfeFrontEnd::GetInputFormat(codec_).c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
     if (realtime_chat) {
         afe_config->aec_init = true;
         afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
@@ -47,53 +42,55 @@ void AudioProcessor::Initialize(AudioCodec* codec, bool realtime_chat) {
     afe_config->agc_init = false;
     afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
 
-    afe_iface_ = esp_afe_handle_from_config(afe_config);
-    afe_data_ = afe_iface_->create_from_config(afe_config);
-    
-    xTaskCreate([](void* arg) {
-        auto this_ = (AudioProcessor*)arg;
-        this_->AudioProcessorTask();
-        vTaskDelete(NULL);
-    }, "audio_communication", 4096, this, 3, NULL);
+    own_front_end_ = std::make_unique<AfeFrontEnd>("audio_communication");
+    front_end_ = own_front_end_.get();
+    front_end_->Initialize(codec_, afe_config);
+#endif
+
+    consumer_id_ = front_end_->AddConsumer([this](afe_fetch_result_t* res) {
+        OnFetch(res);
+    });
+    ESP_LOGI(TAG, "Audio processor attached to the front end as consumer %d", consumer_id_);
 }
 
 AudioProcessor::~AudioProcessor() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
-    }
-    vEventGroupDelete(event_group_);
 }
 
 size_t AudioProcessor::GetFeedSize() {
-    if (afe_data_ == nullptr) {
+    if (front_end_ == nullptr) {
         return 0;
     }
-    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
+    return front_end_->GetFeedSize();
 }
 
 void AudioProcessor::Feed(const std::vector<int16_t>& data) {
-    if (afe_data_ == nullptr) {
+    if (front_end_ == nullptr) {
         return;
     }
-    afe_iface_->feed(afe_data_, data.data());
+    front_end_->Feed(data);
 }
 
 void AudioProcessor::Start() {
-    xEventGroupSetBits(event_group_, PROCESSOR_RUNNING);
+    if (front_end_ == nullptr) {
+        return;
+    }
+    is_speaking_ = false;
+    accumulator_->Reset();
+    front_end_->EnableConsumer(consumer_id_, true);
 }
 
 void AudioProcessor::Stop() {
-    xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
-    if (afe_data_ != nullptr) {
-        afe_iface_->reset_buffer(afe_data_);
+    if (front_end_ == nullptr) {
+        return;
     }
+    front_end_->EnableConsumer(consumer_id_, false);
 }
 
 bool AudioProcessor::IsRunning() {
-    return xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING;
+    return front_end_ != nullptr && front_end_->IsConsumerEnabled(consumer_id_);
 }
 
-void AudioProcessor::OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) {
+void AudioProcessor::OnOutput(std::function<void(PcmFrame&& frame)> callback) {
     output_callback_ = callback;
 }
 
@@ -101,39 +98,22 @@ void AudioProcessor::OnVadStateChange(std::function<void(bool speaking)> callbac
     vad_state_change_callback_ = callback;
 }
 
-void AudioProcessor::AudioProcessorTask() {
-    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
-    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
-    ESP_LOGI(TAG, "Audio communication task started, feed size: %d fetch size: %d",
-        feed_size, fetch_size);
-
-    while (true) {
-        xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING, pdFALSE, pdTRUE, portMAX_DELAY);
-
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if ((xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING) == 0) {
-            continue;
-        }
-        if (res == nullptr || res->ret_value == ESP_FAIL) {
-            if (res != nullptr) {
-                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
-            }
-            continue;
-        }
-
-        // VAD state change
-        if (vad_state_change_callback_) {
-            if (res->vad_state == VAD_SPEECH && !is_speaking_) {
-                is_speaking_ = true;
-                vad_state_change_callback_(true);
-            } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
-                is_speaking_ = false;
-                vad_state_change_callback_(false);
-            }
+void AudioProcessor::OnFetch(afe_fetch_result_t* res) {
+    // VAD state change
+    if (vad_state_change_callback_) {
+        if (res->vad_state == VAD_SPEECH && !is_speaking_) {
+            is_speaking_ = true;
+            vad_state_change_callback_(true);
+        } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
+            is_speaking_ = false;
+            vad_state_change_callback_(false);
         }
+    }
 
-        if (output_callback_) {
-            output_callback_(std::vector<int16_t>(res->data, res->data + res->data_size / sizeof(int16_t)));
-        }
+    if (output_callback_) {
+        // The fetch buffer is reused by the AFE, so this is the only copy on the way to the encoder
+        accumulator_->Append(res->data, res->data_size / sizeof(int16_t), [this](PcmFrame&& frame) {
+            output_callback_(std::move(frame));
+        });
     }
 }
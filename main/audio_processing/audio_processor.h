@@ -9,33 +9,44 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
 
 #include "audio_codec.h"
+#include "afe_front_end.h"
+#include "pcm_frame_pool.h"
+
+// Frames in flight between the fetch task and the encoder
+#define AUDIO_PROCESSOR_FRAME_POOL_SIZE 8
 
 class AudioProcessor {
 public:
     AudioProcessor();
     ~AudioProcessor();
 
-    void Initialize(AudioCodec* codec, bool realtime_chat);
+    void Initialize(AudioCodec* codec, bool realtime_chat, int frame_duration_ms);
     void Feed(const std::vector<int16_t>& data);
     void Start();
     void Stop();
     bool IsRunning();
-    void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback);
+    // Called on the fetch task with frames of exactly frame_duration_ms
+    void OnOutput(std::function<void(PcmFrame&& frame)> callback);
     void OnVadStateChange(std::function<void(bool speaking)> callback);
     size_t GetFeedSize();
 
 private:
-    EventGroupHandle_t event_group_ = nullptr;
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
-    std::function<void(std::vector<int16_t>&& data)> output_callback_;
+    AfeFrontEnd* front_end_ = nullptr;
+#if !CONFIG_USE_SHARED_AFE
+    std::unique_ptr<AfeFrontEnd> own_front_end_;
+#endif
+    int consumer_id_ = -1;
+    std::unique_ptr<PcmFramePool> frame_pool_;
+    std::unique_ptr<PcmFrameAccumulator> accumulator_;
+    std::function<void(PcmFrame&& frame)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
     AudioCodec* codec_ = nullptr;
     bool is_speaking_ = false;
 
-    void AudioProcessorTask();
+    void OnFetch(afe_fetch_result_t* res);
 };
 
 #endif
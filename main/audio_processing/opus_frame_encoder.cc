@@ -0,0 +1,94 @@
+#include "opus_frame_encoder.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+
+#define TAG "OpusFrameEncoder"
+
+OpusFrameEncoder::OpusFrameEncoder(int sample_rate, int channels, int duration_ms)
+    : frame_samples_(sample_rate / 1000 * channels * duration_ms) {
+    int error;
+    encoder_ = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_VOIP, &error);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
+        return;
+    }
+    // Same defaults as OpusEncoderWrapper
+    SetDtx(true);
+    SetComplexity(5);
+    remainder_.reserve(frame_samples_);
+}
+
+OpusFrameEncoder::~OpusFrameEncoder() {
+    if (encoder_ != nullptr) {
+        opus_encoder_destroy(encoder_);
+    }
+}
+
+void OpusFrameEncoder::SetDtx(bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_DTX(enable ? 1 : 0));
+    }
+}
+
+void OpusFrameEncoder::SetComplexity(int complexity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(complexity));
+    }
+}
+
+void OpusFrameEncoder::ResetState() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_RESET_STATE);
+    }
+    remainder_.clear();
+}
+
+int OpusFrameEncoder::EncodeLocked(const int16_t* pcm, uint8_t* packet, size_t packet_size) {
+    if (encoder_ == nullptr) {
+        return -1;
+    }
+    int ret = opus_encode(encoder_, pcm, frame_samples_, packet, packet_size);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+        return -1;
+    }
+    return ret;
+}
+
+int OpusFrameEncoder::EncodeFrame(const int16_t* pcm, uint8_t* packet, size_t packet_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return EncodeLocked(pcm, packet, packet_size);
+}
+
+void OpusFrameEncoder::Encode(const int16_t* pcm, size_t samples, std::function<void(std::vector<uint8_t>&& opus)> handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Complete the frame started by the previous call
+    if (!remainder_.empty()) {
+        size_t n = std::min(samples, frame_samples_ - remainder_.size());
+        remainder_.insert(remainder_.end(), pcm, pcm + n);
+        pcm += n;
+        samples -= n;
+        if (remainder_.size() < frame_samples_) {
+            return;
+        }
+        int ret = EncodeLocked(remainder_.data(), packet_, sizeof(packet_));
+        remainder_.clear();
+        if (ret > 0 && handler) {
+            handler(std::vector<uint8_t>(packet_, packet_ + ret));
+        }
+    }
+    while (samples >= frame_samples_) {
+        int ret = EncodeLocked(pcm, packet_, sizeof(packet_));
+        if (ret > 0 && handler) {
+            handler(std::vector<uint8_t>(packet_, packet_ + ret));
+        }
+        pcm += frame_samples_;
+        samples -= frame_samples_;
+    }
+    remainder_.insert(remainder_.end(), pcm, pcm + samples);
+}
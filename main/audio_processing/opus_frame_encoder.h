@@ -0,0 +1,42 @@
+#ifndef OPUS_FRAME_ENCODER_H
+#define OPUS_FRAME_ENCODER_H
+
+#include <opus.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#define OPUS_FRAME_MAX_PACKET_SIZE 1500
+
+// Encodes straight from the caller's samples. OpusEncoderWrapper adopts the vector it is given,
+// which costs an allocation per frame for producers that recycle their buffers; here whole frames
+// are read in place and only a partial tail is copied into a buffer allocated once.
+class OpusFrameEncoder {
+public:
+    OpusFrameEncoder(int sample_rate, int channels, int duration_ms);
+    ~OpusFrameEncoder();
+
+    size_t frame_samples() const { return frame_samples_; }
+    void SetDtx(bool enable);
+    void SetComplexity(int complexity);
+    void ResetState();
+
+    // Encodes every complete frame, a remainder is kept for the next call
+    void Encode(const int16_t* pcm, size_t samples, std::function<void(std::vector<uint8_t>&& opus)> handler);
+    // Encodes exactly one frame into packet, returns the packet size or -1
+    int EncodeFrame(const int16_t* pcm, uint8_t* packet, size_t packet_size);
+
+private:
+    std::mutex mutex_;
+    OpusEncoder* encoder_ = nullptr;
+    size_t frame_samples_;
+    std::vector<int16_t> remainder_;
+    uint8_t packet_[OPUS_FRAME_MAX_PACKET_SIZE];
+
+    int EncodeLocked(const int16_t* pcm, uint8_t* packet, size_t packet_size);
+};
+
+#endif
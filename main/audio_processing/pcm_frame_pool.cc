@@ -0,0 +1,101 @@
+#include "pcm_frame_pool.h"
+
+#include <esp_log.h>
+
+#define TAG "PcmFramePool"
+
+PcmFrame::PcmFrame(const PcmFrame& other) : slot_(other.slot_) {
+    if (slot_ != nullptr) {
+        slot_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+PcmFrame::PcmFrame(PcmFrame&& other) noexcept : slot_(other.slot_) {
+    other.slot_ = nullptr;
+}
+
+PcmFrame& PcmFrame::operator=(const PcmFrame& other) {
+    if (this != &other) {
+        Release();
+        slot_ = other.slot_;
+        if (slot_ != nullptr) {
+            slot_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return *this;
+}
+
+PcmFrame& PcmFrame::operator=(PcmFrame&& other) noexcept {
+    if (this != &other) {
+        Release();
+        slot_ = other.slot_;
+        other.slot_ = nullptr;
+    }
+    return *this;
+}
+
+PcmFrame::~PcmFrame() {
+    Release();
+}
+
+void PcmFrame::Release() {
+    if (slot_ != nullptr && slot_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        slot_->pool->Recycle(slot_);
+    }
+    slot_ = nullptr;
+}
+
+int16_t* PcmFrame::data() {
+    return slot_->samples.data();
+}
+
+const int16_t* PcmFrame::data() const {
+    return slot_->samples.data();
+}
+
+size_t PcmFrame::size() const {
+    return slot_ != nullptr ? slot_->samples.size() : 0;
+}
+
+size_t PcmFrame::capacity() const {
+    return slot_ != nullptr ? slot_->pool->frame_samples() : 0;
+}
+
+PcmFramePool::PcmFramePool(size_t frame_samples, size_t frame_count) : frame_samples_(frame_samples) {
+    slots_.reserve(frame_count);
+    free_slots_.reserve(frame_count);
+    for (size_t i = 0; i < frame_count; i++) {
+        auto slot = new PcmFrame::Slot{this, {0}, {}};
+        slot->samples.reserve(frame_samples_);
+        slots_.push_back(slot);
+        free_slots_.push_back(slot);
+    }
+    ESP_LOGI(TAG, "%u frames of %u samples", (unsigned)frame_count, (unsigned)frame_samples_);
+}
+
+PcmFramePool::~PcmFramePool() {
+    for (auto slot : slots_) {
+        delete slot;
+    }
+}
+
+PcmFrame PcmFramePool::Acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_slots_.empty()) {
+        if (exhausted_count_++ % 50 == 0) {
+            ESP_LOGW(TAG, "No free frame, dropped %u chunks so far", (unsigned)exhausted_count_);
+        }
+        return PcmFrame();
+    }
+    auto slot = free_slots_.back();
+    free_slots_.pop_back();
+    slot->refs.store(1, std::memory_order_relaxed);
+    return PcmFrame(slot);
+}
+
+void PcmFramePool::Recycle(PcmFrame::Slot* slot) {
+    // Keeps the capacity, consumers only read the samples in place
+    slot->samples.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_slots_.push_back(slot);
+}
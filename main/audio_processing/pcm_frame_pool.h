@@ -0,0 +1,105 @@
+#ifndef PCM_FRAME_POOL_H
+#define PCM_FRAME_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class PcmFramePool;
+
+// Reference-counted handle to a pooled PCM frame, the slot goes back to the pool when the
+// last handle is dropped. Copying a handle never copies samples.
+class PcmFrame {
+public:
+    PcmFrame() = default;
+    PcmFrame(const PcmFrame& other);
+    PcmFrame(PcmFrame&& other) noexcept;
+    PcmFrame& operator=(const PcmFrame& other);
+    PcmFrame& operator=(PcmFrame&& other) noexcept;
+    ~PcmFrame();
+
+    explicit operator bool() const { return slot_ != nullptr; }
+    int16_t* data();
+    const int16_t* data() const;
+    size_t size() const;
+    size_t capacity() const;
+
+private:
+    friend class PcmFramePool;
+    friend class PcmFrameAccumulator;
+
+    struct Slot {
+        PcmFramePool* pool;
+        std::atomic<int> refs;
+        std::vector<int16_t> samples;
+    };
+    explicit PcmFrame(Slot* slot) : slot_(slot) {}
+    void Release();
+
+    Slot* slot_ = nullptr;
+};
+
+// Fixed number of frames allocated up front, so the producer never touches the heap
+class PcmFramePool {
+public:
+    PcmFramePool(size_t frame_samples, size_t frame_count);
+    ~PcmFramePool();
+
+    // Returns an empty handle when every frame is still in flight
+    PcmFrame Acquire();
+
+    inline size_t frame_samples() const { return frame_samples_; }
+    inline size_t exhausted_count() const { return exhausted_count_; }
+
+private:
+    friend class PcmFrame;
+
+    size_t frame_samples_;
+    std::vector<PcmFrame::Slot*> slots_;
+    std::vector<PcmFrame::Slot*> free_slots_;
+    std::mutex mutex_;
+    size_t exhausted_count_ = 0;
+
+    void Recycle(PcmFrame::Slot* slot);
+};
+
+// Batches AFE fetch chunks into pooled frames of exactly one Opus frame
+class PcmFrameAccumulator {
+public:
+    PcmFrameAccumulator(PcmFramePool& pool) : pool_(pool) {}
+
+    // Calls on_frame for every completed frame
+    template <typename Callback>
+    void Append(const int16_t* data, size_t samples, Callback&& on_frame) {
+        while (samples > 0) {
+            if (!current_) {
+                current_ = pool_.Acquire();
+                if (!current_) {
+                    // The consumer is too far behind, drop this chunk
+                    return;
+                }
+            }
+            auto& buffer = current_.slot_->samples;
+            size_t n = std::min(samples, pool_.frame_samples() - buffer.size());
+            buffer.insert(buffer.end(), data, data + n);
+            data += n;
+            samples -= n;
+            if (buffer.size() == pool_.frame_samples()) {
+                on_frame(std::move(current_));
+                current_ = PcmFrame();
+            }
+        }
+    }
+
+    // Drop the partially filled frame
+    void Reset() { current_ = PcmFrame(); }
+
+private:
+    PcmFramePool& pool_;
+    PcmFrame current_;
+};
+
+#endif
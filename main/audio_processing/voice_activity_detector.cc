@@ -0,0 +1,76 @@
+#include "voice_activity_detector.h"
+
+// Speech must be 6dB above the noise floor and above an absolute minimum level
+#define VAD_ENERGY_RATIO 4
+#define VAD_MIN_ENERGY 1600
+// Hiss and broadband noise have a high zero-crossing rate (per mille)
+#define VAD_MAX_ZCR 400
+// Minimum first-difference to signal energy ratio (1/64), rejects hum below ~300Hz
+#define VAD_MIN_DIFF_RATIO_SHIFT 6
+// Fraction of the gap the noise floor closes per voiced frame
+#define VAD_VOICED_FLOOR_RISE 1024
+
+VoiceActivityDetector::VoiceActivityDetector(int onset_frames, int hangover_frames)
+    : onset_frames_(onset_frames), hangover_frames_(hangover_frames) {
+}
+
+void VoiceActivityDetector::Reset() {
+    speaking_ = false;
+    speech_frames_ = 0;
+    silence_frames_ = 0;
+}
+
+bool VoiceActivityDetector::Process(const int16_t* data, size_t samples) {
+    if (samples == 0) {
+        return speaking_;
+    }
+
+    uint64_t energy_sum = 0;
+    uint64_t diff_sum = 0;
+    uint32_t zero_crossings = 0;
+    int32_t previous = last_sample_;
+    for (size_t i = 0; i < samples; i++) {
+        int32_t x = data[i];
+        energy_sum += (uint64_t)(x * x);
+        int32_t d = x - previous;
+        diff_sum += (uint64_t)((int64_t)d * d);
+        if ((x ^ previous) < 0) {
+            zero_crossings++;
+        }
+        previous = x;
+    }
+    last_sample_ = previous;
+
+    uint32_t energy = energy_sum / samples;
+    uint32_t zcr = zero_crossings * 1000 / samples;
+    last_energy_ = energy;
+
+    bool voiced = energy > (uint64_t)noise_floor_ * VAD_ENERGY_RATIO
+        && energy > VAD_MIN_ENERGY
+        && zcr < VAD_MAX_ZCR
+        && (diff_sum << VAD_MIN_DIFF_RATIO_SHIFT) > energy_sum;
+
+    if (voiced) {
+        // Creep up even while voiced, otherwise a lasting rise in background noise (fan, TV, car)
+        // would count as speech forever. Slow enough that a few seconds of speech barely move it
+        noise_floor_ += (energy - noise_floor_) / VAD_VOICED_FLOOR_RISE + 1;
+        speech_frames_++;
+        silence_frames_ = 0;
+        if (!speaking_ && speech_frames_ >= onset_frames_) {
+            speaking_ = true;
+        }
+    } else {
+        speech_frames_ = 0;
+        silence_frames_++;
+        if (speaking_ && silence_frames_ > hangover_frames_) {
+            speaking_ = false;
+        }
+        // Track the noise floor on non-speech frames: fast down, slow up
+        if (energy < noise_floor_) {
+            noise_floor_ = (noise_floor_ * 3 + energy) / 4;
+        } else {
+            noise_floor_ += (energy - noise_floor_) / 32 + 1;
+        }
+    }
+    return speaking_;
+}
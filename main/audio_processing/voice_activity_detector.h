@@ -0,0 +1,34 @@
+#ifndef VOICE_ACTIVITY_DETECTOR_H
+#define VOICE_ACTIVITY_DETECTOR_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Lightweight integer-only VAD for boards that can't run the esp-sr AFE (e.g. ESP32-C3).
+// Combines frame energy against an adaptive noise floor with zero-crossing rate and
+// a first-difference energy ratio (rejects low frequency hum), plus onset and hangover.
+class VoiceActivityDetector {
+public:
+    VoiceActivityDetector(int onset_frames = 2, int hangover_frames = 20);
+
+    // Process one frame of 16-bit mono PCM, returns true while speech (including hangover) is active
+    bool Process(const int16_t* data, size_t samples);
+    // Clear the speech state, the noise floor is kept
+    void Reset();
+
+    inline bool speaking() const { return speaking_; }
+    inline uint32_t noise_floor() const { return noise_floor_; }
+    inline uint32_t last_energy() const { return last_energy_; }
+
+private:
+    int onset_frames_;
+    int hangover_frames_;
+    bool speaking_ = false;
+    int speech_frames_ = 0;
+    int silence_frames_ = 0;
+    uint32_t noise_floor_ = 10000;
+    uint32_t last_energy_ = 0;
+    int16_t last_sample_ = 0;
+};
+
+#endif
@@ -1,76 +1,293 @@
 #include "wake_word_detect.h"
 #include "application.h"
+#include "settings.h"
+#include "fnv_hash.h"
 
 #include <esp_log.h>
 #include <model_path.h>
 #include <arpa/inet.h>
 #include <sstream>
+#include <cstring>
+#include <algorithm>
 
-#define DETECTION_RUNNING_EVENT 1
+// Keep about 2 seconds of audio before the wake word for voice recognition
+#define WAKE_WORD_HISTORY_MS 2000
+// Detection stops on every hit and between turns, keep the model that long before freeing it
+#define WAKE_WORD_UNLOAD_DELAY_MS 1000
+// Slot size of the background packet ring, opus lowers the bitrate of a frame to fit
+#define WAKE_WORD_PACKET_SLOT_SIZE 512
 
 static const char* TAG = "WakeWordDetect";
 
-WakeWordDetect::WakeWordDetect()
-    : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
-
-    event_group_ = xEventGroupCreate();
+// NVS keys are limited to 15 characters, so per-word settings are keyed by a hash of the word
+static std::string GetWordKey(const char* prefix, const std::string& word) {
+    char key[16];
+    snprintf(key, sizeof(key), "%s%08lx", prefix, (unsigned long)FnvHash(word));
+    return key;
 }
 
-WakeWordDetect::~WakeWordDetect() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
+static bool ParseAction(const std::string& name, WakeWordAction& action) {
+    if (name == "chat") {
+        action = kWakeWordActionChat;
+    } else if (name == "stop") {
+        action = kWakeWordActionStop;
+    } else if (name == "volume_up") {
+        action = kWakeWordActionVolumeUp;
+    } else if (name == "volume_down") {
+        action = kWakeWordActionVolumeDown;
+    } else {
+        return false;
     }
+    return true;
+}
+
+WakeWordDetect::WakeWordDetect()
+    : wake_word_opus_() {
+}
 
+WakeWordDetect::~WakeWordDetect() {
     if (wake_word_encode_task_stack_ != nullptr) {
         heap_caps_free(wake_word_encode_task_stack_);
     }
 
-    vEventGroupDelete(event_group_);
+    if (wake_word_pcm_ != nullptr) {
+        heap_caps_free(wake_word_pcm_);
+    }
+#if CONFIG_WAKE_WORD_ENCODE_IN_BACKGROUND
+    if (background_pcm_ != nullptr) {
+        heap_caps_free(background_pcm_);
+    }
+    if (history_packets_ != nullptr) {
+        heap_caps_free(history_packets_);
+    }
+#endif
 }
 
 void WakeWordDetect::Initialize(AudioCodec* codec) {
     codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
-
-    srmodel_list_t *models = esp_srmodel_init("model");
-    for (int i = 0; i < models->num; i++) {
-        ESP_LOGI(TAG, "Model %d: %s", i, models->model_name[i]);
-        if (strstr(models->model_name[i], ESP_WN_PREFIX) != NULL) {
-            wakenet_model_ = models->model_name[i];
-            auto words = esp_srmodel_get_wake_words(models, wakenet_model_);
-            // split by ";" to get all wake words
-            std::stringstream ss(words);
-            std::string word;
-            while (std::getline(ss, word, ';')) {
-                wake_words_.push_back(word);
-            }
+
+    models_ = AfeFrontEnd::GetModels();
+    for (int i = 0; i < models_->num; i++) {
+        ESP_LOGI(TAG, "Model %d: %s", i, models_->model_name[i]);
+        if (strstr(models_->model_name[i], ESP_WN_PREFIX) != NULL) {
+            wakenet_models_.push_back(models_->model_name[i]);
+        }
+    }
+    if (wakenet_models_.empty()) {
+        ESP_LOGE(TAG, "No wakenet model found");
+    } else {
+        Settings settings("wake_word");
+        wakenet_model_ = settings.GetString("model");
+        if (std::find(wakenet_models_.begin(), wakenet_models_.end(), wakenet_model_) == wakenet_models_.end()) {
+            wakenet_model_ = wakenet_models_.front();
+        }
+    }
+    selected_model_ = wakenet_model_;
+    LoadWakeWordSettings();
+
+#if CONFIG_USE_SHARED_AFE
+    front_end_ = &AfeFrontEnd::GetShared();
+    front_end_->InitializeShared(codec_, models_);
+    // WakeNet only runs while detection is enabled
+    front_end_->afe_iface()->disable_wakenet(front_end_->afe_data());
+    ApplyThresholds();
+#else
+    // The AFE and the wakenet model are loaded by the first StartDetection
+    own_front_end_ = std::make_unique<AfeFrontEnd>("audio_detection");
+    front_end_ = own_front_end_.get();
+    // Internal stack, loading the word settings reads NVS
+    xTaskCreate([](void* arg) {
+        auto this_ = (WakeWordDetect*)arg;
+        this_->LoadTask();
+        vTaskDelete(NULL);
+    }, "wake_word_load", 4096 * 2, this, 2, &load_task_);
+#endif
+
+    wake_word_pcm_size_ = 16000 * WAKE_WORD_HISTORY_MS / 1000;
+    wake_word_pcm_ = (int16_t*)heap_caps_malloc(wake_word_pcm_size_ * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    assert(wake_word_pcm_ != nullptr);
+
+#if CONFIG_WAKE_WORD_ENCODE_IN_BACKGROUND
+    background_encoder_ = std::make_unique<OpusFrameEncoder>(16000, 1, OPUS_FRAME_DURATION_MS);
+    background_encoder_->SetComplexity(0);
+    background_pcm_ = (int16_t*)heap_caps_malloc(background_encoder_->frame_samples() * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    history_sizes_.resize(WAKE_WORD_HISTORY_MS / OPUS_FRAME_DURATION_MS);
+    history_packets_ = (uint8_t*)heap_caps_malloc(history_sizes_.size() * WAKE_WORD_PACKET_SLOT_SIZE, MALLOC_CAP_SPIRAM);
+    assert(background_pcm_ != nullptr && history_packets_ != nullptr);
+    wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
+    // Lowest priority on core 1, it only uses cycles the AFE and audio tasks leave over
+    wake_word_encode_task_ = xTaskCreateStaticPinnedToCore([](void* arg) {
+        auto this_ = (WakeWordDetect*)arg;
+        this_->BackgroundEncodeTask();
+        vTaskDelete(NULL);
+    }, "wake_word_encode", 4096 * 8, this, 1, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_, 1);
+#endif
+
+    consumer_id_ = front_end_->AddConsumer([this](afe_fetch_result_t* res) {
+        OnFetch(res);
+    });
+}
+
+void WakeWordDetect::LoadWakeWordSettings() {
+    wake_words_.clear();
+    wake_word_actions_.clear();
+    wake_word_threshold_ = 0;
+    if (wakenet_model_.empty()) {
+        return;
+    }
+
+    // split by ";" to get all wake words
+    std::stringstream ss(esp_srmodel_get_wake_words(models_, (char*)wakenet_model_.c_str()));
+    std::string word;
+    while (std::getline(ss, word, ';')) {
+        wake_words_.push_back(word);
+    }
+
+    // Defaults from CONFIG_WAKE_WORD_ACTIONS, formatted as "word=action;word=action"
+    std::stringstream defaults(CONFIG_WAKE_WORD_ACTIONS);
+    std::string entry;
+    while (std::getline(defaults, entry, ';')) {
+        auto pos = entry.find('=');
+        WakeWordAction action;
+        if (pos != std::string::npos && ParseAction(entry.substr(pos + 1), action)) {
+            wake_word_actions_[entry.substr(0, pos)] = action;
         }
     }
 
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
+    Settings settings("wake_word");
+    for (auto& word : wake_words_) {
+        WakeWordAction action;
+        if (ParseAction(settings.GetString(GetWordKey("act_", word)), action)) {
+            wake_word_actions_[word] = action;
+        }
+        ESP_LOGI(TAG, "Wake word %s, action %d", word.c_str(), GetAction(word));
     }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
+    // WakeNet has a single threshold per model, shared by all of its words
+    wake_word_threshold_ = settings.GetInt(GetWordKey("thr_", wakenet_model_));
+}
+
+void WakeWordDetect::ApplyThresholds() {
+    if (wake_word_threshold_ <= 0) {
+        return;
+    }
+    // Index 1 selects the first (and only) wakenet of the AFE, esp-sr accepts 0.4 to 0.9999
+    float threshold = std::clamp(wake_word_threshold_ / 100.0f, 0.4f, 0.9999f);
+    if (front_end_->afe_iface()->set_wakenet_threshold(front_end_->afe_data(), 1, threshold) == 0) {
+        ESP_LOGW(TAG, "Failed to set the threshold of %s to %.4f", wakenet_model_.c_str(), threshold);
+        return;
+    }
+    ESP_LOGI(TAG, "Wakenet %s threshold %.4f", wakenet_model_.c_str(), threshold);
+}
+
+WakeWordAction WakeWordDetect::GetAction(const std::string& wake_word) const {
+    auto it = wake_word_actions_.find(wake_word);
+    return it != wake_word_actions_.end() ? it->second : kWakeWordActionChat;
+}
+
+// Called on the load task with load_mutex_ held
+void WakeWordDetect::LoadModel() {
+#if !CONFIG_USE_SHARED_AFE
+    if (front_end_->initialized() || wakenet_model_.empty()) {
+        return;
+    }
+
+    auto start_time = esp_timer_get_time();
+    afe_config_t* afe_config = afe_config_init(AfeFrontEnd::GetInputFormat(codec_).c_str(), models_, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
+    for (int i = 0; i < models_->num; i++) {
+        if (wakenet_model_ == models_->model_name[i]) {
+            afe_config->wakenet_model_name = models_->model_name[i];
+        }
     }
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
     afe_config->aec_init = codec_->input_reference();
     afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
     afe_config->afe_perferred_core = 1;
     afe_config->afe_perferred_priority = 1;
     afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
-    
-    afe_iface_ = esp_afe_handle_from_config(afe_config);
-    afe_data_ = afe_iface_->create_from_config(afe_config);
+    front_end_->Initialize(codec_, afe_config);
+    ApplyThresholds();
+    ESP_LOGI(TAG, "Loaded %s in %lld ms, free PSRAM: %u", wakenet_model_.c_str(),
+        (esp_timer_get_time() - start_time) / 1000, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+#endif
+}
 
-    xTaskCreate([](void* arg) {
-        auto this_ = (WakeWordDetect*)arg;
-        this_->AudioDetectionTask();
-        vTaskDelete(NULL);
-    }, "audio_detection", 4096, this, 3, nullptr);
+#if !CONFIG_USE_SHARED_AFE
+// Brings the AFE in line with the latest request. Requests only set a flag and notify, so
+// StopDetection can be called from the fetch task that Deinitialize waits for.
+void WakeWordDetect::LoadTask() {
+    TickType_t wait = portMAX_DELAY;
+    while (true) {
+        bool notified = ulTaskNotifyTake(pdTRUE, wait) > 0;
+        wait = portMAX_DELAY;
+
+        std::string model;
+        bool detection;
+        {
+            std::lock_guard<std::mutex> lock(request_mutex_);
+            model.swap(requested_model_);
+            detection = detection_requested_;
+        }
+
+        std::lock_guard<std::mutex> lock(load_mutex_);
+        if (!model.empty() && model != wakenet_model_) {
+            front_end_->Deinitialize();
+            wakenet_model_ = model;
+            LoadWakeWordSettings();
+        }
+
+        if (!detection) {
+            if (notified && front_end_->initialized()) {
+                // Check again after the delay, a restart in between keeps the model loaded
+                wait = pdMS_TO_TICKS(WAKE_WORD_UNLOAD_DELAY_MS);
+            } else {
+                // Nothing listens for the wake word, give the PSRAM back to the conversation
+                front_end_->Deinitialize();
+            }
+            continue;
+        }
+
+        LoadModel();
+        std::lock_guard<std::mutex> request_lock(request_mutex_);
+        if (detection_requested_ && front_end_->initialized()) {
+            front_end_->EnableConsumer(consumer_id_, true);
+        }
+    }
+}
+#endif
+
+void WakeWordDetect::Unload() {
+    StopDetection();
+#if !CONFIG_USE_SHARED_AFE
+    std::lock_guard<std::mutex> lock(load_mutex_);
+    front_end_->Deinitialize();
+#endif
+}
+
+bool WakeWordDetect::SetModel(const std::string& model) {
+    if (std::find(wakenet_models_.begin(), wakenet_models_.end(), model) == wakenet_models_.end()) {
+        ESP_LOGE(TAG, "Unknown wakenet model: %s", model.c_str());
+        return false;
+    }
+    if (model == selected_model_) {
+        return true;
+    }
+    {
+        Settings settings("wake_word", true);
+        settings.SetString("model", model);
+    }
+    selected_model_ = model;
+
+#if CONFIG_USE_SHARED_AFE
+    // The shared AFE also carries the uplink, it is only rebuilt at the next boot
+    ESP_LOGI(TAG, "Wakenet model %s takes effect after restart", model.c_str());
+#else
+    ESP_LOGI(TAG, "Switching wakenet model to %s", model.c_str());
+    {
+        std::lock_guard<std::mutex> lock(request_mutex_);
+        requested_model_ = model;
+    }
+    xTaskNotifyGive(load_task_);
+#endif
+    return true;
 }
 
 void WakeWordDetect::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
@@ -78,72 +295,124 @@ void WakeWordDetect::OnWakeWordDetected(std::function<void(const std::string& wa
 }
 
 void WakeWordDetect::StartDetection() {
-    xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
+    if (front_end_ == nullptr || IsDetectionRunning()) {
+        return;
+    }
+#if CONFIG_USE_SHARED_AFE
+    front_end_->afe_iface()->enable_wakenet(front_end_->afe_data());
+    front_end_->EnableConsumer(consumer_id_, true);
+#else
+    // The load task enables the consumer once the model is loaded
+    {
+        std::lock_guard<std::mutex> lock(request_mutex_);
+        detection_requested_ = true;
+    }
+    xTaskNotifyGive(load_task_);
+#endif
 }
 
 void WakeWordDetect::StopDetection() {
-    xEventGroupClearBits(event_group_, DETECTION_RUNNING_EVENT);
-    if (afe_data_ != nullptr) {
-        afe_iface_->reset_buffer(afe_data_);
+    if (front_end_ == nullptr) {
+        return;
     }
+#if CONFIG_USE_SHARED_AFE
+    front_end_->EnableConsumer(consumer_id_, false);
+    front_end_->afe_iface()->disable_wakenet(front_end_->afe_data());
+#else
+    {
+        std::lock_guard<std::mutex> lock(request_mutex_);
+        detection_requested_ = false;
+        front_end_->EnableConsumer(consumer_id_, false);
+    }
+    xTaskNotifyGive(load_task_);
+#endif
 }
 
 bool WakeWordDetect::IsDetectionRunning() {
-    return xEventGroupGetBits(event_group_) & DETECTION_RUNNING_EVENT;
+    return front_end_ != nullptr && front_end_->IsConsumerEnabled(consumer_id_);
 }
 
 void WakeWordDetect::Feed(const std::vector<int16_t>& data) {
-    if (afe_data_ == nullptr) {
+    if (front_end_ == nullptr) {
         return;
     }
-    afe_iface_->feed(afe_data_, data.data());
+    front_end_->Feed(data);
 }
 
 size_t WakeWordDetect::GetFeedSize() {
-    if (afe_data_ == nullptr) {
+    if (front_end_ == nullptr) {
         return 0;
     }
-    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
+    return front_end_->GetFeedSize();
 }
 
-void WakeWordDetect::AudioDetectionTask() {
-    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
-    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
-    ESP_LOGI(TAG, "Audio detection task started, feed size: %d fetch size: %d",
-        feed_size, fetch_size);
+void WakeWordDetect::OnFetch(afe_fetch_result_t* res) {
+    // Store the wake word data for voice recognition, like who is speaking
+    StoreWakeWordData(res->data, res->data_size / sizeof(int16_t));
 
-    while (true) {
-        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+    if (res->wakeup_state == WAKENET_DETECTED) {
+        StopDetection();
+        last_detected_wake_word_ = wake_words_[res->wake_word_index - 1];
 
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if (res == nullptr || res->ret_value == ESP_FAIL) {
-            continue;;
+        if (wake_word_detected_callback_) {
+            wake_word_detected_callback_(last_detected_wake_word_);
         }
+    }
+}
 
-        // Store the wake word data for voice recognition, like who is speaking
-        StoreWakeWordData((uint16_t*)res->data, res->data_size / sizeof(uint16_t));
+void WakeWordDetect::StoreWakeWordData(const int16_t* data, size_t samples) {
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    if (samples > wake_word_pcm_size_) {
+        data += samples - wake_word_pcm_size_;
+        wake_word_pcm_total_ += samples - wake_word_pcm_size_;
+        samples = wake_word_pcm_size_;
+    }
+    size_t write = wake_word_pcm_total_ % wake_word_pcm_size_;
+    size_t first = std::min(samples, wake_word_pcm_size_ - write);
+    memcpy(wake_word_pcm_ + write, data, first * sizeof(int16_t));
+    memcpy(wake_word_pcm_, data + first, (samples - first) * sizeof(int16_t));
+    wake_word_pcm_total_ += samples;
+#if CONFIG_WAKE_WORD_ENCODE_IN_BACKGROUND
+    xTaskNotifyGive(wake_word_encode_task_);
+#endif
+}
 
-        if (res->wakeup_state == WAKENET_DETECTED) {
-            StopDetection();
-            last_detected_wake_word_ = wake_words_[res->wake_word_index - 1];
+// Position of the first sample of the current history, the caller must hold wake_word_mutex_
+uint64_t WakeWordDetect::OldestWakeWordSample() const {
+    uint64_t oldest = wake_word_pcm_total_ > wake_word_pcm_size_ ? wake_word_pcm_total_ - wake_word_pcm_size_ : 0;
+    return std::max(oldest, wake_word_pcm_start_);
+}
 
-            if (wake_word_detected_callback_) {
-                wake_word_detected_callback_(last_detected_wake_word_);
-            }
-        }
-    }
+// Copy samples starting at an absolute position, returns the number copied. Nothing is copied
+// once the position has been overwritten, so a reader never gets samples from the wrong place
+size_t WakeWordDetect::ReadWakeWordData(uint64_t position, int16_t* dest, size_t samples) {
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    return CopyWakeWordData(position, dest, samples);
 }
 
-void WakeWordDetect::StoreWakeWordData(uint16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 32ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 32) {
-        wake_word_pcm_.pop_front();
+// Same as ReadWakeWordData, the caller must hold wake_word_mutex_
+size_t WakeWordDetect::CopyWakeWordData(uint64_t position, int16_t* dest, size_t samples) {
+    if (position >= wake_word_pcm_total_ || wake_word_pcm_total_ - position > wake_word_pcm_size_) {
+        return 0;
     }
+    samples = std::min<uint64_t>(samples, wake_word_pcm_total_ - position);
+    size_t start = position % wake_word_pcm_size_;
+    size_t first = std::min(samples, wake_word_pcm_size_ - start);
+    memcpy(dest, wake_word_pcm_ + start, first * sizeof(int16_t));
+    memcpy(dest + first, wake_word_pcm_, (samples - first) * sizeof(int16_t));
+    return samples;
 }
 
 void WakeWordDetect::EncodeWakeWordData() {
+#if CONFIG_WAKE_WORD_ENCODE_IN_BACKGROUND
+    {
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        wake_word_opus_.clear();
+        wake_word_flush_requested_ = true;
+        flush_request_time_ = esp_timer_get_time();
+    }
+    xTaskNotifyGive(wake_word_encode_task_);
+#else
     wake_word_opus_.clear();
     if (wake_word_encode_task_stack_ == nullptr) {
         wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
@@ -152,18 +421,34 @@ void WakeWordDetect::EncodeWakeWordData() {
         auto this_ = (WakeWordDetect*)arg;
         {
             auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+            auto encoder = std::make_unique<OpusFrameEncoder>(16000, 1, OPUS_FRAME_DURATION_MS);
             encoder->SetComplexity(0); // 0 is the fastest
 
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
+            // Hand over the history up to the detection. Later samples stay in the ring and
+            // belong to the next wake word, even if detection restarts while this encodes
+            uint64_t position, end;
+            {
+                std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
+                position = this_->OldestWakeWordSample();
+                end = this_->wake_word_pcm_total_;
+                this_->wake_word_pcm_start_ = end;
+            }
+
+            // Feed the encoder one opus frame at a time from the ring through a single buffer
+            const size_t frame_samples = encoder->frame_samples();
+            std::vector<int16_t> pcm(frame_samples);
+            while (position < end) {
+                size_t samples = this_->ReadWakeWordData(position, pcm.data(), std::min<uint64_t>(frame_samples, end - position));
+                if (samples == 0) {
+                    break;
+                }
+                position += samples;
+                encoder->Encode(pcm.data(), samples, [this_](std::vector<uint8_t>&& opus) {
                     std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
                     this_->wake_word_opus_.emplace_back(std::move(opus));
                     this_->wake_word_cv_.notify_all();
                 });
             }
-            this_->wake_word_pcm_.clear();
-
             auto end_time = esp_timer_get_time();
             ESP_LOGI(TAG, "Encode wake word opus %zu packets in %lld ms",
                 this_->wake_word_opus_.size(), (end_time - start_time) / 1000);
@@ -174,7 +459,80 @@ void WakeWordDetect::EncodeWakeWordData() {
         }
         vTaskDelete(NULL);
     }, "encode_detect_packets", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+#endif
+}
+
+#if CONFIG_WAKE_WORD_ENCODE_IN_BACKGROUND
+void WakeWordDetect::BackgroundEncodeTask() {
+    const size_t frame_samples = background_encoder_->frame_samples();
+    const size_t slots = history_sizes_.size();
+    const int64_t stats_interval_packets = 30000 / OPUS_FRAME_DURATION_MS;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(wake_word_mutex_);
+                // Skip what was overwritten if we fell behind the ring
+                uint64_t oldest = OldestWakeWordSample();
+                if (wake_word_encoded_total_ < oldest) {
+                    wake_word_encoded_total_ = oldest;
+                }
+                if (wake_word_pcm_total_ - wake_word_encoded_total_ < frame_samples) {
+                    if (wake_word_flush_requested_) {
+                        wake_word_flush_requested_ = false;
+                        // Packets handed to the protocol are copied out, this happens once per wake word
+                        size_t packets = history_count_;
+                        for (size_t i = 0; i < history_count_; i++) {
+                            size_t slot = (history_head_ + i) % slots;
+                            auto packet = history_packets_ + slot * WAKE_WORD_PACKET_SLOT_SIZE;
+                            wake_word_opus_.emplace_back(packet, packet + history_sizes_[slot]);
+                        }
+                        history_count_ = 0;
+                        wake_word_opus_.push_back(std::vector<uint8_t>());
+                        wake_word_cv_.notify_all();
+                        // The history has been handed over, start a new one after the current position
+                        wake_word_pcm_start_ = wake_word_pcm_total_;
+                        wake_word_encoded_total_ = wake_word_pcm_total_;
+
+                        int64_t per_packet_us = background_encoded_packets_ > 0 ? background_encode_time_us_ / background_encoded_packets_ : 0;
+                        ESP_LOGI(TAG, "Wake word opus %zu packets ready in %lld ms, encoding on demand would take ~%lld ms",
+                            packets, (esp_timer_get_time() - flush_request_time_) / 1000, per_packet_us * packets / 1000);
+                    }
+                    break;
+                }
+                CopyWakeWordData(wake_word_encoded_total_, background_pcm_, frame_samples);
+                wake_word_encoded_total_ += frame_samples;
+            }
+
+            // Encode into the slot after the newest packet, overwriting the oldest once the ring is full
+            auto start_time = esp_timer_get_time();
+            size_t slot = (history_head_ + history_count_) % slots;
+            int size = background_encoder_->EncodeFrame(background_pcm_,
+                history_packets_ + slot * WAKE_WORD_PACKET_SLOT_SIZE, WAKE_WORD_PACKET_SLOT_SIZE);
+            if (size > 0) {
+                history_sizes_[slot] = size;
+                if (history_count_ < slots) {
+                    history_count_++;
+                } else {
+                    history_head_ = (history_head_ + 1) % slots;
+                }
+            }
+            background_encode_time_us_ += esp_timer_get_time() - start_time;
+            background_encoded_packets_++;
+
+            // Report the CPU cost of keeping the history encoded
+            if (background_encoded_packets_ % stats_interval_packets == 0) {
+                int64_t audio_us = background_encoded_packets_ * OPUS_FRAME_DURATION_MS * 1000;
+                ESP_LOGI(TAG, "Background wake word encoding: %lld us per packet, %.1f%% of one core",
+                    background_encode_time_us_ / background_encoded_packets_,
+                    background_encode_time_us_ * 100.0 / audio_us);
+            }
+        }
+    }
 }
+#endif
 
 bool WakeWordDetect::GetWakeWordOpus(std::vector<uint8_t>& opus) {
     std::unique_lock<std::mutex> lock(wake_word_mutex_);
@@ -9,13 +9,24 @@
 #include <esp_nsn_models.h>
 
 #include <list>
+#include <map>
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 
 #include "audio_codec.h"
+#include "afe_front_end.h"
+#include "opus_frame_encoder.h"
+
+enum WakeWordAction {
+    kWakeWordActionChat,
+    kWakeWordActionStop,
+    kWakeWordActionVolumeUp,
+    kWakeWordActionVolumeDown,
+};
 
 class WakeWordDetect {
 public:
@@ -33,12 +44,42 @@ public:
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
 
+    // Wakenet models found in the model partition
+    const std::vector<std::string>& GetModels() const { return wakenet_models_; }
+    // The selected model, call from the main loop like SetModel
+    const std::string& GetModel() const { return selected_model_; }
+    // Persist the selection and reload the AFE with the new model in the background
+    bool SetModel(const std::string& model);
+    // Free the AFE and the wakenet model now, the next StartDetection loads them again
+    void Unload();
+    WakeWordAction GetAction(const std::string& wake_word) const;
+
 private:
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
-    char* wakenet_model_ = NULL;
+    AfeFrontEnd* front_end_ = nullptr;
+#if !CONFIG_USE_SHARED_AFE
+    std::unique_ptr<AfeFrontEnd> own_front_end_;
+#endif
+    int consumer_id_ = -1;
+    srmodel_list_t* models_ = nullptr;
+    // wakenet_model_ is the loaded one, owned by the load task once Initialize returns
+    std::string wakenet_model_;
+    std::string selected_model_;
+    std::vector<std::string> wakenet_models_;
     std::vector<std::string> wake_words_;
-    EventGroupHandle_t event_group_;
+    std::map<std::string, WakeWordAction> wake_word_actions_;
+    // Detection threshold of the loaded model in percent, 0 keeps the model default
+    int wake_word_threshold_ = 0;
+    std::mutex load_mutex_;
+#if !CONFIG_USE_SHARED_AFE
+    // The AFE and the model are only kept while detection runs, the load task creates and frees
+    // them so the main loop never waits for a model to load
+    TaskHandle_t load_task_ = nullptr;
+    std::mutex request_mutex_;
+    bool detection_requested_ = false;
+    std::string requested_model_;
+
+    void LoadTask();
+#endif
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
@@ -46,13 +87,43 @@ private:
     TaskHandle_t wake_word_encode_task_ = nullptr;
     StaticTask_t wake_word_encode_task_buffer_;
     StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::list<std::vector<int16_t>> wake_word_pcm_;
+    // Fixed ring holding the last WAKE_WORD_HISTORY_MS of PCM, allocated once in PSRAM.
+    // Samples are addressed by their absolute position, wake_word_pcm_total_ is the next one to be
+    // written and the history handed out for a wake word starts at wake_word_pcm_start_
+    int16_t* wake_word_pcm_ = nullptr;
+    size_t wake_word_pcm_size_ = 0;
+    uint64_t wake_word_pcm_total_ = 0;
+    uint64_t wake_word_pcm_start_ = 0;
     std::list<std::vector<uint8_t>> wake_word_opus_;
     std::mutex wake_word_mutex_;
     std::condition_variable wake_word_cv_;
 
-    void StoreWakeWordData(uint16_t* data, size_t size);
-    void AudioDetectionTask();
+#if CONFIG_WAKE_WORD_ENCODE_IN_BACKGROUND
+    // The rolling history is kept encoded so it is ready as soon as the wake word fires. The PCM
+    // frame and the packet ring are allocated once and only touched by the encode task
+    std::unique_ptr<OpusFrameEncoder> background_encoder_;
+    int16_t* background_pcm_ = nullptr;
+    uint8_t* history_packets_ = nullptr;
+    std::vector<uint16_t> history_sizes_;
+    size_t history_head_ = 0;
+    size_t history_count_ = 0;
+    uint64_t wake_word_encoded_total_ = 0;
+    bool wake_word_flush_requested_ = false;
+    int64_t flush_request_time_ = 0;
+    int64_t background_encode_time_us_ = 0;
+    int64_t background_encoded_packets_ = 0;
+
+    void BackgroundEncodeTask();
+#endif
+
+    void StoreWakeWordData(const int16_t* data, size_t samples);
+    uint64_t OldestWakeWordSample() const;
+    size_t ReadWakeWordData(uint64_t position, int16_t* dest, size_t samples);
+    size_t CopyWakeWordData(uint64_t position, int16_t* dest, size_t samples);
+    void OnFetch(afe_fetch_result_t* res);
+    void LoadModel();
+    void LoadWakeWordSettings();
+    void ApplyThresholds();
 };
 
 #endif
@@ -61,7 +61,7 @@ private:
                 .dc_low_on_data = 0,
                 .disable_control_phase = 0,
             },
-            .scl_speed_hz = 400 * 1000,
+            .scl_speed_hz = CONFIG_OLED_I2C_SPEED_KHZ * 1000,
         };
 
         ESP_ERROR_CHECK(esp_lcd_new_panel_io_i2c_v2(display_i2c_bus_, &io_config, &panel_io_));
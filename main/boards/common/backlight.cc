@@ -82,40 +82,19 @@ void Backlight::OnTransitionTimer() {
 }
 
 PwmBacklight::PwmBacklight(gpio_num_t pin, bool output_invert) : Backlight() {
-    const ledc_timer_config_t backlight_timer = {
-        .speed_mode = LEDC_LOW_SPEED_MODE,
-        .duty_resolution = LEDC_TIMER_10_BIT,
-        .timer_num = LEDC_TIMER_0,
-        .freq_hz = 25000, //背光pwm频率需要高一点，防止电感啸叫
-        .clk_cfg = LEDC_AUTO_CLK,
-        .deconfigure = false
-    };
-    ESP_ERROR_CHECK(ledc_timer_config(&backlight_timer));
-
-    // Setup LEDC peripheral for PWM backlight control
-    const ledc_channel_config_t backlight_channel = {
-        .gpio_num = pin,
-        .speed_mode = LEDC_LOW_SPEED_MODE,
-        .channel = LEDC_CHANNEL_0,
-        .intr_type = LEDC_INTR_DISABLE,
-        .timer_sel = LEDC_TIMER_0,
-        .duty = 0,
-        .hpoint = 0,
-        .flags = {
-            .output_invert = output_invert,
-        }
-    };
-    ESP_ERROR_CHECK(ledc_channel_config(&backlight_channel));
+    //背光pwm频率需要高一点，防止电感啸叫
+    ledc_ = LedcAllocator::GetInstance().Allocate(pin, 25000, LEDC_TIMER_10_BIT, output_invert);
 }
 
 PwmBacklight::~PwmBacklight() {
-    ledc_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, 0);
+    LedcAllocator::GetInstance().Free(ledc_);
 }
 
 void PwmBacklight::SetBrightnessImpl(uint8_t brightness) {
-    // LEDC resolution set to 10bits, thus: 100% = 1023
-    uint32_t duty_cycle = (1023 * brightness) / 100;
-    ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty_cycle);
-    ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
+    if (!ledc_.valid()) {
+        return;
+    }
+    uint32_t duty_cycle = (ledc_.max_duty * brightness) / 100;
+    ledc_set_duty(ledc_.speed_mode, ledc_.channel, duty_cycle);
+    ledc_update_duty(ledc_.speed_mode, ledc_.channel);
 }
-
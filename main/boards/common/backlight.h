@@ -6,6 +6,8 @@
 #include <driver/gpio.h>
 #include <esp_timer.h>
 
+#include "ledc_allocator.h"
+
 
 class Backlight {
 public:
@@ -33,4 +35,7 @@ public:
     ~PwmBacklight();
 
     void SetBrightnessImpl(uint8_t brightness) override;
+
+private:
+    LedcChannel ledc_;
 };
@@ -0,0 +1,106 @@
+#include "ledc_allocator.h"
+
+#include <esp_log.h>
+
+#define TAG "LedcAllocator"
+
+LedcChannel LedcAllocator::Allocate(gpio_num_t gpio, uint32_t freq_hz, ledc_timer_bit_t resolution, bool output_invert) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LedcChannel result;
+
+    int channel = -1;
+    for (int i = 0; i < LEDC_CHANNEL_MAX; i++) {
+        if (!channels_[i]) {
+            channel = i;
+            break;
+        }
+    }
+    if (channel < 0) {
+        ESP_LOGE(TAG, "No free LEDC channel for GPIO %d", gpio);
+        return result;
+    }
+
+    // Share a timer with the same configuration, otherwise take a free one
+    int timer = -1;
+    for (int i = 0; i < LEDC_TIMER_MAX; i++) {
+        if (timers_[i].users > 0 && timers_[i].freq_hz == freq_hz && timers_[i].resolution == resolution) {
+            timer = i;
+            break;
+        }
+    }
+    if (timer < 0) {
+        for (int i = 0; i < LEDC_TIMER_MAX; i++) {
+            if (timers_[i].users == 0) {
+                timer = i;
+                break;
+            }
+        }
+        if (timer < 0) {
+            ESP_LOGE(TAG, "No free LEDC timer for %luHz / %d bits", freq_hz, resolution);
+            return result;
+        }
+
+        ledc_timer_config_t timer_config = {};
+        timer_config.speed_mode = LEDC_LOW_SPEED_MODE;
+        timer_config.duty_resolution = resolution;
+        timer_config.timer_num = (ledc_timer_t)timer;
+        timer_config.freq_hz = freq_hz;
+        timer_config.clk_cfg = LEDC_AUTO_CLK;
+        if (ledc_timer_config(&timer_config) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to configure LEDC timer %d", timer);
+            return result;
+        }
+        timers_[timer].freq_hz = freq_hz;
+        timers_[timer].resolution = resolution;
+    }
+
+    ledc_channel_config_t channel_config = {};
+    channel_config.gpio_num = gpio;
+    channel_config.speed_mode = LEDC_LOW_SPEED_MODE;
+    channel_config.channel = (ledc_channel_t)channel;
+    channel_config.intr_type = LEDC_INTR_DISABLE;
+    channel_config.timer_sel = (ledc_timer_t)timer;
+    channel_config.duty = 0;
+    channel_config.hpoint = 0;
+    channel_config.flags.output_invert = output_invert;
+    if (ledc_channel_config(&channel_config) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure LEDC channel %d", channel);
+        return result;
+    }
+
+    timers_[timer].users++;
+    channels_[channel] = true;
+    result.channel = (ledc_channel_t)channel;
+    result.timer = (ledc_timer_t)timer;
+    result.max_duty = (1u << resolution) - 1;
+    ESP_LOGI(TAG, "GPIO %d uses LEDC channel %d, timer %d (%luHz)", gpio, channel, timer, freq_hz);
+    return result;
+}
+
+void LedcAllocator::Free(LedcChannel& channel) {
+    if (!channel.valid()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ledc_stop(channel.speed_mode, channel.channel, 0);
+    channels_[channel.channel] = false;
+    auto& timer = timers_[channel.timer];
+    if (--timer.users == 0) {
+        ledc_timer_pause(channel.speed_mode, channel.timer);
+    }
+    channel = LedcChannel();
+}
+
+void LedcAllocator::AcquireFadeService() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fade_users_++ == 0) {
+        ESP_ERROR_CHECK(ledc_fade_func_install(0));
+    }
+}
+
+void LedcAllocator::ReleaseFadeService() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--fade_users_ == 0) {
+        ledc_fade_func_uninstall();
+    }
+}
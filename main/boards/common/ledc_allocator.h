@@ -0,0 +1,50 @@
+#pragma once
+
+#include <driver/gpio.h>
+#include <driver/ledc.h>
+
+#include <mutex>
+
+// A configured LEDC output, speed_mode / channel are passed to the ledc_* functions
+struct LedcChannel {
+    ledc_mode_t speed_mode = LEDC_LOW_SPEED_MODE;
+    ledc_channel_t channel = LEDC_CHANNEL_MAX;
+    ledc_timer_t timer = LEDC_TIMER_MAX;
+    uint32_t max_duty = 0;
+
+    inline bool valid() const { return channel != LEDC_CHANNEL_MAX; }
+};
+
+// Hands out LEDC channels and timers so the backlight, LEDs and servos never collide.
+// Channels running at the same frequency and resolution share a timer.
+class LedcAllocator {
+public:
+    static LedcAllocator& GetInstance() {
+        static LedcAllocator instance;
+        return instance;
+    }
+    LedcAllocator(const LedcAllocator&) = delete;
+    LedcAllocator& operator=(const LedcAllocator&) = delete;
+
+    // Returns an invalid channel when all channels or timers are in use
+    LedcChannel Allocate(gpio_num_t gpio, uint32_t freq_hz, ledc_timer_bit_t resolution, bool output_invert = false);
+    void Free(LedcChannel& channel);
+
+    // The fade service is shared by all channels, it is installed by the first user
+    void AcquireFadeService();
+    void ReleaseFadeService();
+
+private:
+    LedcAllocator() = default;
+
+    struct Timer {
+        uint32_t freq_hz = 0;
+        ledc_timer_bit_t resolution = LEDC_TIMER_BIT_MAX;
+        int users = 0;
+    };
+
+    std::mutex mutex_;
+    Timer timers_[LEDC_TIMER_MAX];
+    bool channels_[LEDC_CHANNEL_MAX] = {};
+    int fade_users_ = 0;
+};
@@ -133,7 +133,7 @@ private:
                 .dc_low_on_data = 0, // 数据位为低电平
                 .disable_control_phase = 0, // 禁用控制阶段
             },
-            .scl_speed_hz = 400 * 1000, // SCL速度
+            .scl_speed_hz = CONFIG_OLED_I2C_SPEED_KHZ * 1000, // SCL速度
         };
 
         // 创建新的I2C接口
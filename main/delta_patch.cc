@@ -0,0 +1,276 @@
+#include "delta_patch.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <rom/miniz.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "DeltaPatch"
+
+#define DELTA_WINDOW_SIZE TINFL_LZ_DICT_SIZE
+#define DELTA_SOURCE_BUFFER_SIZE 1024
+#define DELTA_OUTPUT_BUFFER_SIZE 4096
+
+static void* AllocateBuffer(size_t size) {
+    void* buffer = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (buffer == nullptr) {
+        buffer = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    return buffer;
+}
+
+DeltaPatcher::DeltaPatcher() {
+    inflator_ = (tinfl_decompressor*)AllocateBuffer(sizeof(tinfl_decompressor));
+    window_ = (uint8_t*)AllocateBuffer(DELTA_WINDOW_SIZE);
+    source_buffer_ = (uint8_t*)AllocateBuffer(DELTA_SOURCE_BUFFER_SIZE);
+    output_ = (uint8_t*)AllocateBuffer(DELTA_OUTPUT_BUFFER_SIZE);
+    if (inflator_ != nullptr) {
+        tinfl_init(inflator_);
+    }
+    mbedtls_sha256_init(&sha256_);
+}
+
+DeltaPatcher::~DeltaPatcher() {
+    mbedtls_sha256_free(&sha256_);
+    heap_caps_free(inflator_);
+    heap_caps_free(window_);
+    heap_caps_free(source_buffer_);
+    heap_caps_free(output_);
+}
+
+bool DeltaPatcher::Begin(const uint8_t* header, esp_ota_handle_t handle) {
+    if (inflator_ == nullptr || window_ == nullptr || source_buffer_ == nullptr || output_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate patch buffers");
+        return false;
+    }
+    memcpy(&header_, header, sizeof(header_));
+    if (memcmp(header_.magic, DELTA_PATCH_MAGIC, sizeof(header_.magic)) != 0 || header_.version != DELTA_PATCH_VERSION
+            || header_.compression != DELTA_PATCH_COMPRESSION_ZLIB) {
+        ESP_LOGE(TAG, "Unsupported patch format");
+        return false;
+    }
+
+    source_ = esp_ota_get_running_partition();
+    if (header_.source_size > source_->size) {
+        ESP_LOGE(TAG, "Patch source is larger than partition %s", source_->label);
+        return false;
+    }
+    if (!VerifySource()) {
+        ESP_LOGE(TAG, "Patch was made for another firmware");
+        return false;
+    }
+
+    handle_ = handle;
+    mbedtls_sha256_starts(&sha256_, 0);
+    if (header_.source_size == 0) {
+        ESP_LOGI(TAG, "Inflating compressed image of %lu bytes", header_.target_size);
+    } else {
+        ESP_LOGI(TAG, "Patching %lu bytes from %s into %lu bytes", header_.source_size, source_->label, header_.target_size);
+    }
+    return true;
+}
+
+// Hashes the running image, a patch applied to anything else would produce garbage
+bool DeltaPatcher::VerifySource() {
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts(&sha256, 0);
+    for (uint32_t offset = 0; offset < header_.source_size; offset += DELTA_SOURCE_BUFFER_SIZE) {
+        size_t size = std::min<size_t>(DELTA_SOURCE_BUFFER_SIZE, header_.source_size - offset);
+        if (esp_partition_read(source_, offset, source_buffer_, size) != ESP_OK) {
+            mbedtls_sha256_free(&sha256);
+            return false;
+        }
+        mbedtls_sha256_update(&sha256, source_buffer_, size);
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha256, digest);
+    mbedtls_sha256_free(&sha256);
+    return memcmp(digest, header_.source_sha256, sizeof(digest)) == 0;
+}
+
+bool DeltaPatcher::Feed(const uint8_t* data, size_t size) {
+    if (failed_) {
+        return false;
+    }
+    // The header was already checked by Begin
+    size_t skip = std::min(header_left_, size);
+    header_left_ -= skip;
+    int64_t start_time = esp_timer_get_time();
+    int64_t write_time_us = write_time_us_;
+    if (!Inflate(data + skip, size - skip)) {
+        failed_ = true;
+    }
+    // Everything but the flash writes is decoding
+    decode_time_us_ += esp_timer_get_time() - start_time - (write_time_us_ - write_time_us);
+    return !failed_;
+}
+
+// Inflates into the window and parses every piece as it comes out, the window is also the
+// dictionary of the inflater so nothing is copied
+bool DeltaPatcher::Inflate(const uint8_t* data, size_t size) {
+    while (size > 0 && !stream_done_) {
+        size_t in_size = size;
+        size_t out_size = DELTA_WINDOW_SIZE - window_pos_;
+        auto status = tinfl_decompress(inflator_, data, &in_size, window_, window_ + window_pos_, &out_size,
+            TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Corrupted patch stream: %d", (int)status);
+            return false;
+        }
+        if (!Apply(window_ + window_pos_, out_size)) {
+            return false;
+        }
+        window_pos_ = (window_pos_ + out_size) & (DELTA_WINDOW_SIZE - 1);
+        data += in_size;
+        size -= in_size;
+        if (status == TINFL_STATUS_DONE) {
+            stream_done_ = true;
+        } else if (in_size == 0 && out_size == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool DeltaPatcher::Apply(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        switch (state_) {
+        case kStateControl: {
+            // Three LEB128 varints, the seek is zigzag encoded
+            uint8_t byte = *data++;
+            size--;
+            control_[control_index_] |= (uint64_t)(byte & 0x7F) << control_shift_;
+            control_shift_ += 7;
+            if (byte & 0x80) {
+                if (control_shift_ >= 64) {
+                    ESP_LOGE(TAG, "Invalid patch command");
+                    return false;
+                }
+                break;
+            }
+            control_shift_ = 0;
+            if (++control_index_ < 3) {
+                break;
+            }
+            diff_left_ = control_[0];
+            extra_left_ = control_[1];
+            uint64_t seek = control_[2];
+            control_[0] = control_[1] = control_[2] = 0;
+            control_index_ = 0;
+            if (written_ + output_size_ + diff_left_ + extra_left_ > header_.target_size) {
+                ESP_LOGE(TAG, "Patch writes past the end of the image");
+                return false;
+            }
+            // The seek moves the source cursor after the diff and extra bytes of this command
+            pending_seek_ = (int64_t)(seek >> 1) ^ -(int64_t)(seek & 1);
+            state_ = diff_left_ > 0 ? kStateDiff : kStateExtra;
+            break;
+        }
+        case kStateDiff: {
+            size_t n = std::min<size_t>({diff_left_, size, DELTA_SOURCE_BUFFER_SIZE});
+            if (source_pos_ < 0 || source_pos_ + n > header_.source_size) {
+                ESP_LOGE(TAG, "Patch reads outside the source image");
+                return false;
+            }
+            if (esp_partition_read(source_, source_pos_, source_buffer_, n) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to read the running partition");
+                return false;
+            }
+            for (size_t i = 0; i < n; i++) {
+                source_buffer_[i] += data[i];
+            }
+            if (!Output(source_buffer_, n)) {
+                return false;
+            }
+            source_pos_ += n;
+            diff_left_ -= n;
+            data += n;
+            size -= n;
+            if (diff_left_ == 0) {
+                state_ = kStateExtra;
+            }
+            break;
+        }
+        case kStateExtra: {
+            size_t n = std::min<size_t>(extra_left_, size);
+            if (!Output(data, n)) {
+                return false;
+            }
+            extra_left_ -= n;
+            data += n;
+            size -= n;
+            break;
+        }
+        case kStateDone:
+            ESP_LOGE(TAG, "Unexpected data after the end of the patch");
+            return false;
+        }
+
+        if (state_ == kStateExtra && extra_left_ == 0) {
+            source_pos_ += pending_seek_;
+            pending_seek_ = 0;
+            state_ = written_ + output_size_ == header_.target_size ? kStateDone : kStateControl;
+        }
+    }
+    return true;
+}
+
+bool DeltaPatcher::Output(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        size_t n = std::min(size, DELTA_OUTPUT_BUFFER_SIZE - output_size_);
+        memcpy(output_ + output_size_, data, n);
+        output_size_ += n;
+        data += n;
+        size -= n;
+        if (output_size_ == DELTA_OUTPUT_BUFFER_SIZE && !FlushOutput()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DeltaPatcher::FlushOutput() {
+    if (output_size_ == 0) {
+        return true;
+    }
+    if (written_ == 0 && image_check_ && !image_check_(output_, output_size_)) {
+        return false;
+    }
+    mbedtls_sha256_update(&sha256_, output_, output_size_);
+    int64_t start_time = esp_timer_get_time();
+    auto err = esp_ota_write(handle_, output_, output_size_);
+    write_time_us_ += esp_timer_get_time() - start_time;
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+        return false;
+    }
+    written_ += output_size_;
+    output_size_ = 0;
+    return true;
+}
+
+bool DeltaPatcher::Finish() {
+    if (failed_ || !FlushOutput()) {
+        return false;
+    }
+    if (state_ != kStateDone || written_ != header_.target_size) {
+        ESP_LOGE(TAG, "Patch ended early, %zu of %lu bytes", written_, header_.target_size);
+        return false;
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha256_, digest);
+    if (memcmp(digest, header_.target_sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "Patched image does not match its SHA-256");
+        return false;
+    }
+    // Decoding should stay well below the flash write time, otherwise it slows the download. These
+    // are the device numbers scripts/ota_delta.py bench asks for
+    ESP_LOGI(TAG, "Patched image verified, decoding took %lld ms (%lld KB/s), flash writes %lld ms (%lld KB/s)",
+        decode_time_us_ / 1000, written_ * 1000000LL / 1024 / std::max<int64_t>(decode_time_us_, 1),
+        write_time_us_ / 1000, written_ * 1000000LL / 1024 / std::max<int64_t>(write_time_us_, 1));
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef _DELTA_PATCH_H_
+#define _DELTA_PATCH_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+
+// Patch produced by scripts/ota_delta.py. The header is followed by a zlib stream of bsdiff style
+// commands: varint diff length, varint extra length, zigzag varint seek, then the diff bytes (added
+// to the source image at the cursor) and the extra bytes (copied as is). A patch with an empty
+// source is a compressed full image: one command whose extra bytes are the whole image.
+#define DELTA_PATCH_MAGIC "XZDP"
+#define DELTA_PATCH_VERSION 1
+#define DELTA_PATCH_COMPRESSION_ZLIB 1
+
+struct __attribute__((packed)) DeltaPatchHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t compression;
+    uint16_t reserved;
+    uint32_t source_size;
+    uint32_t target_size;
+    uint8_t source_sha256[32];
+    uint8_t target_sha256[32];
+};
+
+struct tinfl_decompressor_tag;
+
+// Rebuilds the next image from the running partition and a streamed patch. Memory stays bounded
+// by the 32 KB inflate window plus a few small buffers, whatever the image size.
+class DeltaPatcher {
+public:
+    DeltaPatcher();
+    ~DeltaPatcher();
+
+    // Checks the header against the running partition, false if the patch was made for another build
+    bool Begin(const uint8_t* header, esp_ota_handle_t handle);
+    // Consumes the next patch bytes, starting with the header, and writes the rebuilt image
+    bool Feed(const uint8_t* data, size_t size);
+    // True when the whole image was written and its SHA-256 matches the header
+    bool Finish();
+    // Called with the first rebuilt bytes before anything is written to flash, returning false
+    // stops the patch. Lets the caller check the app description like a plain image download.
+    void set_image_check(std::function<bool(const uint8_t* image, size_t size)> check) { image_check_ = std::move(check); }
+
+private:
+    enum State {
+        kStateControl,
+        kStateDiff,
+        kStateExtra,
+        kStateDone,
+    };
+
+    DeltaPatchHeader header_ = {};
+    const esp_partition_t* source_ = nullptr;
+    esp_ota_handle_t handle_ = 0;
+    size_t header_left_ = sizeof(DeltaPatchHeader);
+    bool failed_ = false;
+    bool stream_done_ = false;
+
+    tinfl_decompressor_tag* inflator_ = nullptr;
+    uint8_t* window_ = nullptr;
+    size_t window_pos_ = 0;
+
+    State state_ = kStateControl;
+    uint64_t control_[3] = {};
+    int control_index_ = 0;
+    int control_shift_ = 0;
+    uint32_t diff_left_ = 0;
+    uint32_t extra_left_ = 0;
+    int64_t source_pos_ = 0;
+    int64_t pending_seek_ = 0;
+
+    uint8_t* source_buffer_ = nullptr;
+    uint8_t* output_ = nullptr;
+    size_t output_size_ = 0;
+    size_t written_ = 0;
+    std::function<bool(const uint8_t* image, size_t size)> image_check_;
+    mbedtls_sha256_context sha256_;
+    int64_t decode_time_us_ = 0;
+    int64_t write_time_us_ = 0;
+
+    bool VerifySource();
+    bool Inflate(const uint8_t* data, size_t size);
+    bool Apply(const uint8_t* data, size_t size);
+    bool Output(const uint8_t* data, size_t size);
+    bool FlushOutput();
+};
+
+#endif // _DELTA_PATCH_H_
@@ -1,8 +1,10 @@
 #include <esp_log.h>
 #include <esp_err.h>
+#include <esp_lvgl_port.h>
 #include <string>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 
 #include "display.h"
 #include "board.h"
@@ -34,6 +36,13 @@ Display::Display() {
     };
     ESP_ERROR_CHECK(esp_timer_create(&notification_timer_args, &notification_timer_));
 
+    // Applies everything the setters recorded during one window. Text layout and LVGL work run on
+    // this low-priority task, so they never hold up the esp_timer task that the audio timers share
+    xTaskCreate([](void* arg) {
+        Display* display = static_cast<Display*>(arg);
+        display->ApplyTask();
+    }, "display_apply", 4096 * 2, this, 1, &apply_task_);
+
     // Update display timer
     esp_timer_create_args_t update_display_timer_args = {
         .callback = [](void *arg) {
@@ -46,7 +55,20 @@ Display::Display() {
         .skip_unhandled_events = true,
     };
     ESP_ERROR_CHECK(esp_timer_create(&update_display_timer_args, &update_timer_));
-    ESP_ERROR_CHECK(esp_timer_start_periodic(update_timer_, 1000000));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(update_timer_, DISPLAY_STATUS_POLL_MS * 1000));
+
+    // Status refresh requested by an event source
+    esp_timer_create_args_t refresh_timer_args = {
+        .callback = [](void *arg) {
+            Display *display = static_cast<Display*>(arg);
+            display->Update();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "display_refresh",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&refresh_timer_args, &refresh_timer_));
 
     // Create a power management lock
     auto ret = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "display_update", &pm_lock_);
@@ -62,10 +84,22 @@ Display::~Display() {
         esp_timer_stop(notification_timer_);
         esp_timer_delete(notification_timer_);
     }
+    if (refresh_timer_ != nullptr) {
+        esp_timer_stop(refresh_timer_);
+        esp_timer_delete(refresh_timer_);
+    }
     if (update_timer_ != nullptr) {
         esp_timer_stop(update_timer_);
         esp_timer_delete(update_timer_);
     }
+    if (apply_task_ != nullptr) {
+        // Let a running transaction finish, the task may hold the display lock
+        apply_task_exit_ = true;
+        xTaskNotifyGive(apply_task_);
+        while (apply_task_ != nullptr) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
 
     if (network_label_ != nullptr) {
         lv_obj_del(network_label_);
@@ -86,14 +120,127 @@ Display::~Display() {
     }
 }
 
-void Display::SetStatus(const char* status) {
+// Must be called with pending_mutex_ held
+void Display::ScheduleUpdate() {
+    stats_mutations_++;
+    if (!coalesce_scheduled_) {
+        coalesce_scheduled_ = true;
+        xTaskNotifyGive(apply_task_);
+    }
+}
+
+void Display::ApplyTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (apply_task_exit_) {
+            break;
+        }
+        // Collect the mutations that follow the first one into the same transaction
+        vTaskDelay(pdMS_TO_TICKS(DISPLAY_COALESCE_WINDOW_MS));
+        if (apply_task_exit_) {
+            break;
+        }
+        ApplyPendingUpdates();
+    }
+    apply_task_ = nullptr;
+    vTaskDelete(NULL);
+}
+
+void Display::ApplyPendingUpdates() {
+    PendingText status, notification, emotion;
+    bool emotion_is_icon;
+    int notification_duration_ms;
+    std::vector<PendingMessage> messages;
+    bool reveal_set;
+    float reveal;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        status = std::move(pending_status_);
+        notification = std::move(pending_notification_);
+        emotion = std::move(pending_emotion_);
+        pending_status_ = PendingText();
+        pending_notification_ = PendingText();
+        pending_emotion_ = PendingText();
+        emotion_is_icon = pending_emotion_is_icon_;
+        notification_duration_ms = pending_notification_duration_ms_;
+        messages.swap(pending_messages_);
+        reveal_set = pending_reveal_set_;
+        reveal = pending_reveal_;
+        pending_reveal_set_ = false;
+        coalesce_scheduled_ = false;
+        stats_transactions_++;
+    }
+
+    for (auto& message : messages) {
+        PrepareChatMessage(message.content);
+    }
+
     DisplayLockGuard lock(this);
+    // Status and notification share the status bar, keep the order they were issued in
+    if (notification.set && status.set && notification.seq < status.seq) {
+        ApplyNotification(notification.text.c_str(), notification_duration_ms);
+        ApplyStatus(status.text.c_str());
+    } else {
+        if (status.set) {
+            ApplyStatus(status.text.c_str());
+        }
+        if (notification.set) {
+            ApplyNotification(notification.text.c_str(), notification_duration_ms);
+        }
+    }
+
+    if (emotion.set) {
+        std::string key = (emotion_is_icon ? "i:" : "e:") + emotion.text;
+        if (key != applied_emotion_) {
+            applied_emotion_ = key;
+            if (emotion_is_icon) {
+                ApplyIcon(emotion.text.c_str());
+            } else {
+                ApplyEmotion(emotion.text.c_str());
+            }
+        }
+    }
+
+    for (auto& message : messages) {
+        if (!KeepsChatHistory()) {
+            std::string key = message.role + "\n" + message.content;
+            // A streaming message starts hidden again, so it is applied even if the text is the same
+            if (key == applied_message_ && !message.streaming) {
+                continue;
+            }
+            applied_message_ = key;
+        }
+        if (message.streaming) {
+            ApplyStreamingMessage(message.role.c_str(), message.content.c_str());
+        } else {
+            ApplyChatMessage(message.role.c_str(), message.content.c_str());
+        }
+    }
+    if (reveal_set) {
+        ApplyStreamingReveal(reveal);
+    }
+}
+
+void Display::SetStatus(const char* status) {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_status_ = {true, ++pending_seq_, status};
+    ScheduleUpdate();
+}
+
+void Display::ApplyStatus(const char* status) {
     if (status_label_ == nullptr) {
         return;
     }
-    lv_label_set_text(status_label_, status);
-    lv_obj_clear_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
-    lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
+    if (applied_status_ != status) {
+        applied_status_ = status;
+        lv_label_set_text(status_label_, status);
+    }
+    if (lv_obj_has_flag(status_label_, LV_OBJ_FLAG_HIDDEN)) {
+        lv_obj_clear_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
+    }
+    if (!lv_obj_has_flag(notification_label_, LV_OBJ_FLAG_HIDDEN)) {
+        lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
+    }
 }
 
 void Display::ShowNotification(const std::string &notification, int duration_ms) {
@@ -101,7 +248,13 @@ void Display::ShowNotification(const std::string &notification, int duration_ms)
 }
 
 void Display::ShowNotification(const char* notification, int duration_ms) {
-    DisplayLockGuard lock(this);
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_notification_ = {true, ++pending_seq_, notification};
+    pending_notification_duration_ms_ = duration_ms;
+    ScheduleUpdate();
+}
+
+void Display::ApplyNotification(const char* notification, int duration_ms) {
     if (notification_label_ == nullptr) {
         return;
     }
@@ -113,24 +266,124 @@ void Display::ShowNotification(const char* notification, int duration_ms) {
     ESP_ERROR_CHECK(esp_timer_start_once(notification_timer_, duration_ms * 1000));
 }
 
+void Display::InitializeLvglPort() {
+    lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
+    port_cfg.task_priority = 1;
+    port_cfg.timer_period_ms = DISPLAY_PORT_TICK_PERIOD_MS;
+    port_cfg.task_max_sleep_ms = DISPLAY_MAX_SLEEP_MS;
+    lvgl_port_init(&port_cfg);
+    // Animations and timers keep exact time without a periodic tick interrupt
+    lv_tick_set_cb([]() -> uint32_t {
+        return esp_timer_get_time() / 1000;
+    });
+}
+
+// Render statistics and refresh scheduling, both driven by display events
+void Display::AttachRenderStats() {
+    lv_display_add_event_cb(display_, [](lv_event_t* e) {
+        auto display = static_cast<Display*>(lv_event_get_user_data(e));
+        switch (lv_event_get_code(e)) {
+            case LV_EVENT_REFR_START:
+                display->refresh_start_time_ = esp_timer_get_time();
+                display->refresh_flushed_pixels_ = 0;
+                break;
+            case LV_EVENT_FLUSH_START: {
+                auto area = static_cast<const lv_area_t*>(lv_event_get_param(e));
+                if (area != nullptr) {
+                    display->refresh_flushed_pixels_ += lv_area_get_size(area);
+                }
+                break;
+            }
+            case LV_EVENT_FLUSH_WAIT_START:
+                display->flush_wait_start_time_ = esp_timer_get_time();
+                break;
+            case LV_EVENT_FLUSH_WAIT_FINISH:
+                // Time the CPU spent blocked on the panel transfer instead of rendering
+                display->stats_flush_wait_us_ += esp_timer_get_time() - display->flush_wait_start_time_;
+                break;
+            case LV_EVENT_REFR_READY:
+                // Refreshes without invalidated areas don't count as frames
+                if (display->refresh_flushed_pixels_ > 0) {
+                    auto render_time = esp_timer_get_time() - display->refresh_start_time_;
+                    display->stats_frames_++;
+                    display->stats_render_time_us_ += render_time;
+                    display->stats_max_render_time_us_ = std::max(display->stats_max_render_time_us_, render_time);
+                    display->stats_flushed_pixels_ += display->refresh_flushed_pixels_;
+                }
+                // Nothing left to draw, stop waking up for refreshes until something is invalidated
+                if (!display->benchmark_running_ && lv_anim_count_running() == 0) {
+                    lv_timer_pause(lv_display_get_refr_timer(display->display_));
+                    display->refresh_paused_ = true;
+                }
+                break;
+            case LV_EVENT_INVALIDATE_AREA:
+                if (display->refresh_paused_) {
+                    display->refresh_paused_ = false;
+                    lv_timer_resume(lv_display_get_refr_timer(display->display_));
+                    // The LVGL task may be sleeping for up to DISPLAY_MAX_SLEEP_MS or blocked on the lock
+                    // this task holds. The port wake is a notification: it ends the sleep early, and a
+                    // pending lock attempt still succeeds and sees it on the next loop.
+                    lvgl_port_task_wake(LVGL_PORT_EVENT_DISPLAY, nullptr);
+                }
+                break;
+            default:
+                break;
+        }
+    }, LV_EVENT_ALL, this);
+    render_stats_attached_ = true;
+}
+
+// Must be called with the display locked
+void Display::ReportRenderStats() {
+    if (benchmark_running_) {
+        return;
+    }
+    uint32_t mutations, transactions;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        mutations = stats_mutations_;
+        transactions = stats_transactions_;
+        stats_mutations_ = 0;
+        stats_transactions_ = 0;
+    }
+    if (stats_frames_ > 0) {
+        ESP_LOGI(TAG, "%lu frames, render avg %lld us max %lld us, flush wait avg %lld us, %llu px flushed, %lu updates in %lu transactions",
+            stats_frames_, stats_render_time_us_ / stats_frames_, stats_max_render_time_us_,
+            stats_flush_wait_us_ / stats_frames_, stats_flushed_pixels_, mutations, transactions);
+    }
+    stats_frames_ = 0;
+    stats_flush_wait_us_ = 0;
+    stats_render_time_us_ = 0;
+    stats_max_render_time_us_ = 0;
+    stats_flushed_pixels_ = 0;
+}
+
 void Display::Update() {
     auto& board = Board::GetInstance();
     auto codec = board.GetAudioCodec();
 
-    {
+    int64_t now = esp_timer_get_time();
+    if (display_ != nullptr && !render_stats_attached_) {
         DisplayLockGuard lock(this);
-        if (mute_label_ == nullptr) {
-            return;
-        }
+        AttachRenderStats();
+        last_stats_time_ = now;
+    }
+    if (now - last_stats_time_ >= DISPLAY_STATS_INTERVAL_MS * 1000LL) {
+        DisplayLockGuard lock(this);
+        last_stats_time_ = now;
+        ReportRenderStats();
+    }
 
-        // 如果静音状态改变，则更新图标
-        if (codec->output_volume() == 0 && !muted_) {
-            muted_ = true;
-            lv_label_set_text(mute_label_, FONT_AWESOME_VOLUME_MUTE);
-        } else if (codec->output_volume() > 0 && muted_) {
-            muted_ = false;
-            lv_label_set_text(mute_label_, "");
-        }
+    if (mute_label_ == nullptr) {
+        return;
+    }
+
+    // The display is only locked for icons that actually changed, so a static screen is not invalidated
+    bool muted = codec->output_volume() == 0;
+    if (muted != muted_) {
+        DisplayLockGuard lock(this);
+        muted_ = muted;
+        lv_label_set_text(mute_label_, muted_ ? FONT_AWESOME_VOLUME_MUTE : "");
     }
 
     esp_pm_lock_acquire(pm_lock_);
@@ -153,8 +406,8 @@ void Display::Update() {
             };
             icon = levels[battery_level / 20];
         }
-        DisplayLockGuard lock(this);
         if (battery_label_ != nullptr && battery_icon_ != icon) {
+            DisplayLockGuard lock(this);
             battery_icon_ = icon;
             lv_label_set_text(battery_label_, battery_icon_);
         }
@@ -163,18 +416,23 @@ void Display::Update() {
     if (board.GetESP32Temp(chip_temp)){
         // 更新温度过高提示框
         if (high_temp_popup_ != nullptr) {
-            if (chip_temp >= 65.0f) {
-                if (lv_obj_has_flag(high_temp_popup_, LV_OBJ_FLAG_HIDDEN)) {
-                    // 显示温度过高提示框
-                    lv_obj_clear_flag(high_temp_popup_, LV_OBJ_FLAG_HIDDEN);
+            bool high_temp = chip_temp >= 65.0f;
+            if (high_temp != high_temp_shown_) {
+                high_temp_shown_ = high_temp;
+                {
+                    DisplayLockGuard lock(this);
+                    if (high_temp) {
+                        // 显示温度过高提示框
+                        lv_obj_clear_flag(high_temp_popup_, LV_OBJ_FLAG_HIDDEN);
+                    } else {
+                        // 隐藏温度过高提示框
+                        lv_obj_add_flag(high_temp_popup_, LV_OBJ_FLAG_HIDDEN);
+                    }
+                }
+                if (high_temp) {
                     auto& app = Application::GetInstance();
                     app.PlaySound(Lang::Sounds::P3_LOW_BATTERY);
                 }
-            } else {
-                // 隐藏温度过高提示框
-                if (!lv_obj_has_flag(high_temp_popup_, LV_OBJ_FLAG_HIDDEN)) {
-                    lv_obj_add_flag(high_temp_popup_, LV_OBJ_FLAG_HIDDEN);
-                }
             }
         } else {
             ESP_LOGW("PowerManager", "high_temp_popup_ is null!");
@@ -202,8 +460,31 @@ void Display::Update() {
     esp_pm_lock_release(pm_lock_);
 }
 
+void Display::SetIdle(bool idle) {
+    if (idle == idle_) {
+        return;
+    }
+    idle_ = idle;
+    esp_timer_stop(update_timer_);
+    esp_timer_start_periodic(update_timer_, (idle ? DISPLAY_IDLE_STATUS_POLL_MS : DISPLAY_STATUS_POLL_MS) * 1000);
+    RefreshStatusIcons();
+}
+
+void Display::RefreshStatusIcons() {
+    // Runs Update on the esp_timer task like the periodic poll, so the two never overlap
+    if (refresh_timer_ != nullptr && !esp_timer_is_active(refresh_timer_)) {
+        esp_timer_start_once(refresh_timer_, 0);
+    }
+}
 
 void Display::SetEmotion(const char* emotion) {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_emotion_ = {true, ++pending_seq_, emotion};
+    pending_emotion_is_icon_ = false;
+    ScheduleUpdate();
+}
+
+void Display::ApplyEmotion(const char* emotion) {
     struct Emotion {
         const char* icon;
         const char* text;
@@ -238,7 +519,6 @@ void Display::SetEmotion(const char* emotion) {
     auto it = std::find_if(emotions.begin(), emotions.end(),
         [&emotion_view](const Emotion& e) { return e.text == emotion_view; });
     
-    DisplayLockGuard lock(this);
     if (emotion_label_ == nullptr) {
         return;
     }
@@ -252,7 +532,13 @@ void Display::SetEmotion(const char* emotion) {
 }
 
 void Display::SetIcon(const char* icon) {
-    DisplayLockGuard lock(this);
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_emotion_ = {true, ++pending_seq_, icon};
+    pending_emotion_is_icon_ = true;
+    ScheduleUpdate();
+}
+
+void Display::ApplyIcon(const char* icon) {
     if (emotion_label_ == nullptr) {
         return;
     }
@@ -260,7 +546,35 @@ void Display::SetIcon(const char* icon) {
 }
 
 void Display::SetChatMessage(const char* role, const char* content) {
-    DisplayLockGuard lock(this);
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    // Only the last message matters when the UI shows a single label
+    if (!KeepsChatHistory()) {
+        pending_messages_.clear();
+    }
+    pending_messages_.push_back({role, content != nullptr ? content : "", false});
+    // A reveal recorded before this message belongs to the previous one
+    pending_reveal_set_ = false;
+    ScheduleUpdate();
+}
+
+void Display::SetStreamingMessage(const char* role, const char* content) {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    if (!KeepsChatHistory()) {
+        pending_messages_.clear();
+    }
+    pending_messages_.push_back({role, content != nullptr ? content : "", true});
+    pending_reveal_set_ = false;
+    ScheduleUpdate();
+}
+
+void Display::RevealStreamingMessage(float progress) {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_reveal_set_ = true;
+    pending_reveal_ = progress;
+    ScheduleUpdate();
+}
+
+void Display::ApplyChatMessage(const char* role, const char* content) {
     if (chat_message_label_ == nullptr) {
         return;
     }
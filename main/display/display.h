@@ -5,8 +5,28 @@
 #include <esp_timer.h>
 #include <esp_log.h>
 #include <esp_pm.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include <string>
+#include <vector>
+#include <mutex>
+
+#include "text_layout.h"
+
+// UI mutations issued within this window are applied in one locked transaction
+#define DISPLAY_COALESCE_WINDOW_MS 30
+
+// Battery level, chip temperature and signal strength are polled at these intervals, changes
+// that have an event (volume, network, device state) are pushed through RefreshStatusIcons()
+#define DISPLAY_STATUS_POLL_MS 5000
+#define DISPLAY_IDLE_STATUS_POLL_MS 30000
+#define DISPLAY_STATS_INTERVAL_MS 30000
+
+// The LVGL tick is read from esp_timer, so the port timer that feeds lv_tick_inc can run slowly.
+// While nothing is invalidated the refresh timer is paused and the LVGL task sleeps this long.
+#define DISPLAY_PORT_TICK_PERIOD_MS 1000
+#define DISPLAY_MAX_SLEEP_MS 1000
 
 struct DisplayFonts {
     const lv_font_t* text_font = nullptr;
@@ -19,15 +39,24 @@ public:
     Display();
     virtual ~Display();
 
+    // The setters only record the new state, the apply task applies it with the display locked
     virtual void SetStatus(const char* status);
     virtual void ShowNotification(const char* notification, int duration_ms = 3000);
     virtual void ShowNotification(const std::string &notification, int duration_ms = 3000);
     virtual void SetEmotion(const char* emotion);
     virtual void SetChatMessage(const char* role, const char* content);
+    // A message that starts hidden and is revealed as it is spoken, progress goes from 0 to 1
+    virtual void SetStreamingMessage(const char* role, const char* content);
+    virtual void RevealStreamingMessage(float progress);
     virtual void SetIcon(const char* icon);
     virtual void SetTheme(const std::string& theme_name);
     virtual std::string GetTheme() { return current_theme_name_; }
 
+    // The status icons are polled less often while the device is idle
+    void SetIdle(bool idle);
+    // Updates the status icons now instead of at the next poll
+    void RefreshStatusIcons();
+
     inline int width() const { return width_; }
     inline int height() const { return height_; }
     esp_timer_handle_t update_timer_ = nullptr;
@@ -56,7 +85,80 @@ protected:
     std::string current_theme_name_;
 
     esp_timer_handle_t notification_timer_ = nullptr;
-    
+    esp_timer_handle_t refresh_timer_ = nullptr;
+    bool idle_ = false;
+    bool high_temp_shown_ = false;
+
+    // Refresh scheduling, the refresh timer is paused while the screen is static
+    bool refresh_paused_ = false;
+
+    // Pending UI state, written by the setters and consumed by ApplyPendingUpdates
+    struct PendingText {
+        bool set = false;
+        uint32_t seq = 0;
+        std::string text;
+    };
+    struct PendingMessage {
+        std::string role;
+        std::string content;
+        bool streaming;
+    };
+    std::mutex pending_mutex_;
+    uint32_t pending_seq_ = 0;
+    PendingText pending_status_;
+    PendingText pending_notification_;
+    int pending_notification_duration_ms_ = 0;
+    PendingText pending_emotion_;
+    bool pending_emotion_is_icon_ = false;
+    std::vector<PendingMessage> pending_messages_;
+    bool pending_reveal_set_ = false;
+    float pending_reveal_ = 0;
+    bool coalesce_scheduled_ = false;
+    TaskHandle_t apply_task_ = nullptr;
+    volatile bool apply_task_exit_ = false;
+
+    // What is on screen, identical updates are skipped so they don't invalidate anything
+    std::string applied_status_;
+    std::string applied_emotion_;
+    std::string applied_message_;
+    TextLayoutCache text_layout_cache_;
+
+    // Render statistics, updated from LVGL display events
+    bool render_stats_attached_ = false;
+    int64_t refresh_start_time_ = 0;
+    uint32_t refresh_flushed_pixels_ = 0;
+    uint32_t stats_frames_ = 0;
+    int64_t stats_render_time_us_ = 0;
+    int64_t stats_max_render_time_us_ = 0;
+    uint64_t stats_flushed_pixels_ = 0;
+    int64_t flush_wait_start_time_ = 0;
+    int64_t stats_flush_wait_us_ = 0;
+    bool benchmark_running_ = false;
+    uint32_t stats_mutations_ = 0;
+    uint32_t stats_transactions_ = 0;
+    int64_t last_stats_time_ = 0;
+
+    // Called with the display locked, subclasses override these instead of the setters
+    virtual void ApplyStatus(const char* status);
+    virtual void ApplyNotification(const char* notification, int duration_ms);
+    virtual void ApplyEmotion(const char* emotion);
+    virtual void ApplyIcon(const char* icon);
+    virtual void ApplyChatMessage(const char* role, const char* content);
+    // Displays that cannot reveal text gradually show streaming messages at once
+    virtual void ApplyStreamingMessage(const char* role, const char* content) { ApplyChatMessage(role, content); }
+    virtual void ApplyStreamingReveal(float progress) {}
+    // Called on the apply task before the display is locked, so text is measured and wrapped at low
+    // priority and without blocking rendering
+    virtual void PrepareChatMessage(const std::string& content) {}
+    // Every message creates a new bubble, so none of the pending ones may be collapsed
+    virtual bool KeepsChatHistory() const { return false; }
+
+    void InitializeLvglPort();
+    void ScheduleUpdate();
+    void ApplyTask();
+    void ApplyPendingUpdates();
+    void AttachRenderStats();
+    void ReportRenderStats();
 
     friend class DisplayLockGuard;
     virtual bool Lock(int timeout_ms = 0) = 0;
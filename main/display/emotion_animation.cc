@@ -0,0 +1,253 @@
+#include "emotion_animation.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <libs/gif/gifdec.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "EmotionAnimation"
+
+EmotionAnimation::EmotionAnimation(lv_obj_t* parent, const std::vector<Clip>& clips, lv_color_t background)
+    : background_(lv_color_to_u16(background)) {
+    std::vector<const lv_image_dsc_t*> gifs;
+    for (auto& clip : clips) {
+        auto it = std::find(gifs.begin(), gifs.end(), clip.gif);
+        if (it == gifs.end()) {
+            gifs.push_back(clip.gif);
+            it = gifs.end() - 1;
+        }
+        names_.emplace_back(clip.name, it - gifs.begin());
+    }
+    clips_ = std::vector<CachedClip>(gifs.size());
+    for (size_t i = 0; i < gifs.size(); i++) {
+        clips_[i].gif = gifs[i];
+    }
+
+    // The parent may not be laid out yet, size the canvases for the whole screen
+    auto display = lv_obj_get_display(parent);
+    width_ = lv_display_get_horizontal_resolution(display);
+    height_ = lv_display_get_vertical_resolution(display);
+    for (auto& layer : layers_) {
+        layer.dsc.header.magic = LV_IMAGE_HEADER_MAGIC;
+        layer.dsc.header.cf = LV_COLOR_FORMAT_RGB565;
+        layer.dsc.data_size = width_ * height_ * sizeof(uint16_t);
+        layer.dsc.data = (const uint8_t*)heap_caps_malloc(layer.dsc.data_size, MALLOC_CAP_SPIRAM);
+        assert(layer.dsc.data != nullptr);
+        layer.image = lv_image_create(parent);
+        lv_obj_align(layer.image, LV_ALIGN_CENTER, 0, 0);
+        lv_obj_add_flag(layer.image, LV_OBJ_FLAG_HIDDEN);
+    }
+
+    timer_ = lv_timer_create([](lv_timer_t* timer) {
+        static_cast<EmotionAnimation*>(lv_timer_get_user_data(timer))->OnTick();
+    }, EMOTION_TICK_MS, this);
+
+    xTaskCreate([](void* arg) {
+        auto this_ = (EmotionAnimation*)arg;
+        this_->CacheTask();
+        this_->cache_done_ = true;
+        vTaskDelete(NULL);
+    }, "emotion_cache", 4096, this, 1, &cache_task_);
+}
+
+EmotionAnimation::~EmotionAnimation() {
+    // Deleting the task mid-decode would leak the gifdec state, let it stop between frames instead
+    stop_ = true;
+    while (!cache_done_) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    lv_anim_delete(this, nullptr);
+    lv_timer_delete(timer_);
+    for (auto& layer : layers_) {
+        lv_obj_delete(layer.image);
+        heap_caps_free((void*)layer.dsc.data);
+    }
+    for (auto& clip : clips_) {
+        for (auto& frame : clip.frames) {
+            heap_caps_free(frame.runs);
+        }
+    }
+}
+
+void EmotionAnimation::SetEmotion(const char* name) {
+    auto it = std::find_if(names_.begin(), names_.end(), [name](const std::pair<std::string, int>& entry) {
+        return entry.first == name;
+    });
+    requested_clip_ = it != names_.end() ? it->second : names_.front().second;
+}
+
+void EmotionAnimation::CacheTask() {
+    while (!stop_) {
+        // The clip the UI is waiting for goes first
+        int next = requested_clip_;
+        if (clips_[next].ready) {
+            auto it = std::find_if(clips_.begin(), clips_.end(), [](const CachedClip& clip) {
+                return !clip.ready;
+            });
+            if (it == clips_.end()) {
+                break;
+            }
+            next = it - clips_.begin();
+        }
+        if (!DecodeClip(clips_[next]) && !stop_) {
+            ESP_LOGE(TAG, "Failed to decode clip %d", next);
+        }
+        clips_[next].ready = true;
+    }
+    if (stop_) {
+        return;
+    }
+    ESP_LOGI(TAG, "All %u clips cached, free PSRAM: %u", (unsigned)clips_.size(),
+        heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+}
+
+bool EmotionAnimation::DecodeClip(CachedClip& cached) {
+    auto start_time = esp_timer_get_time();
+    gd_GIF* gif = gd_open_gif_data(cached.gif->data);
+    if (gif == nullptr) {
+        return false;
+    }
+    if (gif->width > width_ || gif->height > height_) {
+        ESP_LOGE(TAG, "Clip %dx%d is larger than the screen", gif->width, gif->height);
+        gd_close_gif(gif);
+        return false;
+    }
+    cached.width = gif->width;
+    cached.height = gif->height;
+
+    std::vector<uint16_t> runs;
+    size_t pixels = gif->width * gif->height;
+    size_t cached_bytes = 0;
+    uint32_t time_ms = 0;
+    while (!stop_ && gd_get_frame(gif) == 1) {
+        // Compose the frame with gifdec, then run-length encode the RGB565 result
+        gd_render_frame(gif, gif->canvas);
+        const uint8_t* argb = gif->canvas;
+        runs.clear();
+        uint16_t run_color = 0;
+        uint16_t run_length = 0;
+        for (size_t i = 0; i < pixels; i++, argb += 4) {
+            uint16_t color = argb[3] < 0x80 ? background_ : lv_color_to_u16(lv_color_make(argb[2], argb[1], argb[0]));
+            if (run_length > 0 && (color != run_color || run_length == UINT16_MAX)) {
+                runs.push_back(run_length);
+                runs.push_back(run_color);
+                run_length = 0;
+            }
+            run_color = color;
+            run_length++;
+        }
+        runs.push_back(run_length);
+        runs.push_back(run_color);
+
+        Frame frame;
+        frame.run_count = runs.size() / 2;
+        frame.runs = (uint16_t*)heap_caps_malloc(runs.size() * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+        if (frame.runs == nullptr) {
+            ESP_LOGE(TAG, "Out of PSRAM after %u frames", (unsigned)cached.frames.size());
+            break;
+        }
+        memcpy(frame.runs, runs.data(), runs.size() * sizeof(uint16_t));
+        frame.start_ms = time_ms;
+        time_ms += std::max(gif->gce.delay * 10, EMOTION_TICK_MS);
+        cached.frames.push_back(frame);
+        cached_bytes += runs.size() * sizeof(uint16_t);
+        // Lowest priority, but give the idle task on this core a chance to run
+        vTaskDelay(1);
+    }
+    gd_close_gif(gif);
+    cached.duration_ms = time_ms;
+
+    ESP_LOGI(TAG, "Cached clip %dx%d, %u frames, %u KB (%u KB raw), %lld ms", cached.width, cached.height,
+        (unsigned)cached.frames.size(), (unsigned)(cached_bytes / 1024),
+        (unsigned)(pixels * 2 * cached.frames.size() / 1024), (esp_timer_get_time() - start_time) / 1000);
+    return !cached.frames.empty();
+}
+
+void EmotionAnimation::RenderFrame(Layer& layer, int frame) {
+    auto& cached = clips_[layer.clip].frames[frame];
+    uint16_t* dest = (uint16_t*)layer.dsc.data;
+    const uint16_t* runs = cached.runs;
+    for (uint32_t i = 0; i < cached.run_count; i++, runs += 2) {
+        std::fill_n(dest, runs[0], runs[1]);
+        dest += runs[0];
+    }
+    layer.frame = frame;
+    lv_image_cache_drop(&layer.dsc);
+    lv_obj_invalidate(layer.image);
+}
+
+void EmotionAnimation::StartClip(int clip) {
+    auto& cached = clips_[clip];
+    // Cross-fade only when something is already on screen
+    int next = (EMOTION_CROSSFADE_MS > 0 && layers_[front_].clip >= 0) ? 1 - front_ : front_;
+    auto& layer = layers_[next];
+    layer.clip = clip;
+    layer.dsc.header.w = cached.width;
+    layer.dsc.header.h = cached.height;
+    layer.dsc.header.stride = cached.width * sizeof(uint16_t);
+    RenderFrame(layer, 0);
+    lv_image_set_src(layer.image, nullptr);
+    lv_image_set_src(layer.image, &layer.dsc);
+    lv_obj_clear_flag(layer.image, LV_OBJ_FLAG_HIDDEN);
+    clip_start_tick_ = lv_tick_get();
+
+    if (next != front_) {
+        lv_obj_set_style_opa(layer.image, LV_OPA_TRANSP, 0);
+        lv_obj_move_foreground(layer.image);
+        lv_anim_t anim;
+        lv_anim_init(&anim);
+        lv_anim_set_var(&anim, this);
+        lv_anim_set_values(&anim, LV_OPA_TRANSP, LV_OPA_COVER);
+        lv_anim_set_duration(&anim, EMOTION_CROSSFADE_MS);
+        lv_anim_set_exec_cb(&anim, [](void* var, int32_t value) {
+            auto this_ = static_cast<EmotionAnimation*>(var);
+            lv_obj_set_style_opa(this_->layers_[this_->front_].image, value, 0);
+        });
+        lv_anim_set_completed_cb(&anim, [](lv_anim_t* anim) {
+            auto this_ = static_cast<EmotionAnimation*>(anim->var);
+            auto& back = this_->layers_[1 - this_->front_];
+            lv_obj_add_flag(back.image, LV_OBJ_FLAG_HIDDEN);
+            back.clip = -1;
+            this_->fading_ = false;
+        });
+        fading_ = true;
+        lv_anim_start(&anim);
+    }
+    front_ = next;
+}
+
+void EmotionAnimation::OnTick() {
+    int requested = requested_clip_;
+    if (!fading_ && requested != layers_[front_].clip && clips_[requested].ready && !clips_[requested].frames.empty()) {
+        StartClip(requested);
+        return;
+    }
+
+    auto& layer = layers_[front_];
+    if (layer.clip < 0) {
+        return;
+    }
+    auto& frames = clips_[layer.clip].frames;
+    if (frames.size() < 2) {
+        return;
+    }
+
+    // Show the frame that is due now, frames that were missed are skipped instead of delaying the clip
+    uint32_t elapsed = lv_tick_elaps(clip_start_tick_) % clips_[layer.clip].duration_ms;
+    auto it = std::upper_bound(frames.begin(), frames.end(), elapsed, [](uint32_t time, const Frame& frame) {
+        return time < frame.start_ms;
+    });
+    int target = (it - frames.begin()) - 1;
+    if (target == layer.frame) {
+        return;
+    }
+    int expected = (layer.frame + 1) % frames.size();
+    frames_skipped_ += (target - expected + frames.size()) % frames.size();
+    RenderFrame(layer, target);
+
+    if (++frames_shown_ % 500 == 0) {
+        ESP_LOGI(TAG, "%lu frames shown, %lu skipped", frames_shown_, frames_skipped_);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef EMOTION_ANIMATION_H
+#define EMOTION_ANIMATION_H
+
+#include <lvgl.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define EMOTION_CROSSFADE_MS 200
+// The playback timer only wakes up this often, frames due in between are shown at the next tick
+#define EMOTION_TICK_MS 20
+
+// Plays emotion GIFs from a frame cache instead of decoding them with lv_gif on every switch.
+// Every clip is decoded once by a low priority task into run-length encoded RGB565 frames in PSRAM.
+// Playback is time based, so frames are skipped rather than delayed when rendering falls behind,
+// and switching emotions cross-fades between two image layers.
+class EmotionAnimation {
+public:
+    struct Clip {
+        const char* name;
+        const lv_image_dsc_t* gif;
+    };
+
+    // clips[0] is shown for unknown names, background is used for transparent pixels
+    EmotionAnimation(lv_obj_t* parent, const std::vector<Clip>& clips, lv_color_t background);
+    ~EmotionAnimation();
+
+    // Thread safe, the switch happens on the LVGL task once the clip is decoded
+    void SetEmotion(const char* name);
+
+private:
+    struct Frame {
+        uint16_t* runs = nullptr;   // (count, color) pairs
+        uint32_t run_count = 0;
+        uint32_t start_ms = 0;      // Offset of the frame in the clip
+    };
+    struct CachedClip {
+        const lv_image_dsc_t* gif = nullptr;
+        uint16_t width = 0;
+        uint16_t height = 0;
+        std::vector<Frame> frames;
+        uint32_t duration_ms = 0;
+        std::atomic<bool> ready{false};
+    };
+    struct Layer {
+        lv_obj_t* image = nullptr;
+        lv_image_dsc_t dsc = {};
+        int clip = -1;
+        int frame = -1;
+    };
+
+    // Several names may share one clip, each GIF is only cached once
+    std::vector<std::pair<std::string, int>> names_;
+    std::vector<CachedClip> clips_;
+    uint16_t width_ = 0;
+    uint16_t height_ = 0;
+    uint16_t background_;
+    Layer layers_[2];
+    int front_ = 0;
+    bool fading_ = false;
+    uint32_t clip_start_tick_ = 0;
+    std::atomic<int> requested_clip_{0};
+    lv_timer_t* timer_ = nullptr;
+    TaskHandle_t cache_task_ = nullptr;
+    std::atomic<bool> cache_done_{false};
+    std::atomic<bool> stop_{false};
+
+    uint32_t frames_shown_ = 0;
+    uint32_t frames_skipped_ = 0;
+
+    void CacheTask();
+    bool DecodeClip(CachedClip& cached);
+    void OnTick();
+    void StartClip(int clip);
+    void RenderFrame(Layer& layer, int frame);
+};
+
+#endif // EMOTION_ANIMATION_H
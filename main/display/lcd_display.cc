@@ -4,12 +4,13 @@
 #include <esp_log.h>
 #include <esp_lvgl_port.h>
 #include <font_awesome_symbols.h>
-#include <libs/gif/lv_gif.h>
 #include <cstring>
 #include <vector>
+#include <algorithm>
 #include "assets/lang_config.h"
 #include "board.h"
 #include "settings.h"
+#include "streaming_text.h"
 
 #define TAG "LcdDisplay"
 
@@ -91,6 +92,33 @@ static ThemeColors current_theme = LIGHT_THEME;
 
 LV_FONT_DECLARE(font_awesome_30_4);
 
+// Draw buffer layout for panels that LVGL flushes area by area, see the LCD_* options in Kconfig
+static void ConfigureRenderBuffers(lvgl_port_display_cfg_t& cfg, int width, int height) {
+#if CONFIG_LCD_FULL_FRAME_BUFFER
+    cfg.buffer_size = width * height;
+#else
+    cfg.buffer_size = width * CONFIG_LCD_BUFFER_LINES;
+#endif
+#if CONFIG_LCD_DOUBLE_BUFFER
+    // LVGL renders into one buffer while the DMA sends the other
+    cfg.double_buffer = true;
+#else
+    cfg.double_buffer = false;
+#endif
+#if CONFIG_LCD_BUFFER_IN_PSRAM
+    // The panel DMA reads from internal bounce buffers that the port refills from PSRAM
+    cfg.flags.buff_dma = 0;
+    cfg.flags.buff_spiram = 1;
+    cfg.trans_size = width * CONFIG_LCD_BOUNCE_BUFFER_LINES;
+#else
+    cfg.flags.buff_dma = 1;
+    cfg.flags.buff_spiram = 0;
+    cfg.trans_size = 0;
+#endif
+    ESP_LOGI(TAG, "Draw buffer %lu px x%d, %s, bounce %lu px", cfg.buffer_size, cfg.double_buffer ? 2 : 1,
+        cfg.flags.buff_spiram ? "PSRAM" : "internal", cfg.trans_size);
+}
+
 SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                            int width, int height, int offset_x, int offset_y, bool mirror_x, bool mirror_y, bool swap_xy,
                            DisplayFonts fonts)
@@ -112,13 +140,10 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
     lv_init();
 
     ESP_LOGI(TAG, "Initialize LVGL port");
-    lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
-    port_cfg.timer_period_ms = 50;
-    lvgl_port_init(&port_cfg);
+    InitializeLvglPort();
 
     ESP_LOGI(TAG, "Adding LCD screen");
-    const lvgl_port_display_cfg_t display_cfg = {
+    lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
         .panel_handle = panel_,
         .control_handle = nullptr,
@@ -143,6 +168,7 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
             .direct_mode = 0,
         },
     };
+    ConfigureRenderBuffers(display_cfg, width_, height_);
 
     display_ = lvgl_port_add_disp(&display_cfg);
     if (display_ == nullptr) {
@@ -162,6 +188,9 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
     }
 
     SetupUI();
+#if CONFIG_LCD_BENCHMARK
+    RunBenchmark("SPI");
+#endif
 }
 
 // RGB LCD实现
@@ -183,10 +212,7 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
     lv_init();
 
     ESP_LOGI(TAG, "Initialize LVGL port");
-    lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
-    port_cfg.timer_period_ms = 50;
-    lvgl_port_init(&port_cfg);
+    InitializeLvglPort();
 
     ESP_LOGI(TAG, "Adding LCD screen");
     const lvgl_port_display_cfg_t display_cfg = {
@@ -234,6 +260,9 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
     }
 
     SetupUI();
+#if CONFIG_LCD_BENCHMARK
+    RunBenchmark("RGB");
+#endif
 }
 
 LcdDisplay::~LcdDisplay() {
@@ -393,12 +422,51 @@ void LcdDisplay::SetupUI() {
     lv_obj_add_flag(high_temp_popup_, LV_OBJ_FLAG_HIDDEN);
 }
 
+void LcdDisplay::TrackStreamingText(lv_obj_t* text) {
+    streaming_text_ = text;
+    lv_obj_add_event_cb(text, [](lv_event_t* e) {
+        auto display = static_cast<LcdDisplay*>(lv_event_get_user_data(e));
+        if (display->streaming_text_ == lv_event_get_target(e)) {
+            display->streaming_text_ = nullptr;
+        }
+    }, LV_EVENT_DELETE, this);
+}
+
+void LcdDisplay::ApplyStreamingReveal(float progress) {
+    if (streaming_text_ != nullptr) {
+        StreamingText::Reveal(streaming_text_, progress);
+    }
+}
+
+int LcdDisplay::ChatMessageWidth() const {
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+    return width_ * 85 / 100 - 16;  // 屏幕宽度的85%
+#else
+    return width_ * 9 / 10;  // 与 chat_message_label_ 宽度一致
+#endif
+}
+
+void LcdDisplay::PrepareChatMessage(const std::string& content) {
+    if (!content.empty()) {
+        text_layout_cache_.Get(content, fonts_.text_font, ChatMessageWidth());
+    }
+}
+
 #define  MAX_MESSAGES 20
-void LcdDisplay::SetChatMessage(const char* role, const char* content) {
-    DisplayLockGuard lock(this);
+void LcdDisplay::ApplyChatMessage(const char* role, const char* content) {
+    AddMessageBubble(role, content, false);
+}
+
+void LcdDisplay::ApplyStreamingMessage(const char* role, const char* content) {
+    AddMessageBubble(role, content, true);
+}
+
+void LcdDisplay::AddMessageBubble(const char* role, const char* content, bool streaming) {
     if (content_ == nullptr) {
         return;
     }
+    // 新消息出现后，之前的流式消息不再继续显示
+    streaming_text_ = nullptr;
     
     //避免出现空的消息框
     if(strlen(content) == 0) return;
@@ -426,33 +494,28 @@ void LcdDisplay::SetChatMessage(const char* role, const char* content) {
     lv_obj_set_style_border_color(msg_bubble, current_theme.border, 0);
     lv_obj_set_style_pad_all(msg_bubble, 8, 0);
 
-    // Create the message text
-    lv_obj_t* msg_text = lv_label_create(msg_bubble);
-    lv_label_set_text(msg_text, content);
-    
-    // 计算文本实际宽度
-    lv_coord_t text_width = lv_txt_get_width(content, strlen(content), fonts_.text_font, 0);
+    // 文本已按气泡最大宽度换行，排版结果同时用于气泡尺寸和显示
+    auto layout = text_layout_cache_.Get(content, fonts_.text_font, ChatMessageWidth());
 
-    // 计算气泡宽度
-    lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;  // 屏幕宽度的85%
-    lv_coord_t min_width = 20;  
-    lv_coord_t bubble_width;
-    
-    // 确保文本宽度不小于最小宽度
-    if (text_width < min_width) {
-        text_width = min_width;
-    }
-
-    // 如果文本宽度小于最大宽度，使用文本宽度
-    if (text_width < max_width) {
-        bubble_width = text_width; 
+    // Create the message text, a streaming message is revealed while it is spoken
+    lv_obj_t* msg_text;
+    if (streaming) {
+        msg_text = StreamingText::Create(msg_bubble, layout);
+        TrackStreamingText(msg_text);
     } else {
-        bubble_width = max_width;
+        msg_text = lv_label_create(msg_bubble);
+        lv_label_set_text(msg_text, layout->text.c_str());
     }
+
+    // 计算气泡宽度，换行后的文本宽度不会超过最大宽度
+    lv_coord_t min_width = 20;  
+    lv_coord_t bubble_width = std::max<lv_coord_t>(layout->width, min_width);
     
     // 设置消息文本的宽度
     lv_obj_set_width(msg_text, bubble_width);  // 减去padding
-    lv_label_set_long_mode(msg_text, LV_LABEL_LONG_WRAP);
+    if (!streaming) {
+        lv_label_set_long_mode(msg_text, LV_LABEL_LONG_WRAP);
+    }
     lv_obj_set_style_text_font(msg_text, fonts_.text_font, 0);
 
     // 设置气泡宽度
@@ -593,11 +656,12 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_style_bg_opa(overlay_container, LV_OPA_TRANSP, 0);  // 透明背景
     lv_obj_align(overlay_container, LV_ALIGN_TOP_LEFT, 0, 0);  // 对齐到左上角
 
-    // 创建 GIF 对象（全屏横屏显示）
-    emotion_gif = lv_gif_create(overlay_container);
-    lv_obj_set_size(emotion_gif, LV_HOR_RES, LV_VER_RES);  // 与屏幕同尺寸
-    lv_obj_align(emotion_gif, LV_ALIGN_CENTER, 0, 0);  // 居中显示
-    lv_gif_set_src(emotion_gif, &daxiaoyan);  // 设置 GIF 源
+    // 表情动画（全屏横屏显示），第一个为未知表情时的默认动画
+    emotion_animation_ = std::make_unique<EmotionAnimation>(overlay_container, std::vector<EmotionAnimation::Clip>{
+        {"neutral", &staticstate}, {"happy", &happy},      {"laughing", &happy},
+        {"funny", &daxiaoyan},     {"sad", &sad},          {"angry", &anger},
+        {"surprised", &scare},     {"confused", &buxue}}, current_theme.background);
+    emotion_animation_->SetEmotion("funny");
 #else
     
     /* Content */
@@ -685,34 +749,44 @@ void LcdDisplay::SetupUI() {
     lv_obj_center(high_temp_label);
     lv_obj_add_flag(high_temp_popup_, LV_OBJ_FLAG_HIDDEN);
 }
+
+void LcdDisplay::ApplyChatMessage(const char* role, const char* content) {
+    if (chat_message_label_ == nullptr) {
+        return;
+    }
+    if (streaming_text_ != nullptr) {
+        lv_obj_del(streaming_text_);
+        lv_obj_clear_flag(chat_message_label_, LV_OBJ_FLAG_HIDDEN);
+    }
+    // 使用预先换行的文本，标签只需按换行符分行
+    auto layout = text_layout_cache_.Get(content, fonts_.text_font, ChatMessageWidth());
+    lv_label_set_text(chat_message_label_, layout->text.c_str());
+}
+
+void LcdDisplay::ApplyStreamingMessage(const char* role, const char* content) {
+    if (chat_message_label_ == nullptr) {
+        return;
+    }
+    if (streaming_text_ != nullptr) {
+        lv_obj_del(streaming_text_);
+    }
+    // 流式消息替代聊天标签显示，位置和对齐方式与标签一致
+    auto layout = text_layout_cache_.Get(content, fonts_.text_font, ChatMessageWidth());
+    lv_obj_t* text = StreamingText::Create(content_, layout);
+    lv_obj_set_width(text, ChatMessageWidth());
+    lv_obj_set_style_text_align(text, LV_TEXT_ALIGN_CENTER, 0);
+    lv_obj_set_style_text_color(text, current_theme.text, 0);
+    lv_obj_add_flag(chat_message_label_, LV_OBJ_FLAG_HIDDEN);
+    TrackStreamingText(text);
+}
 #endif
 
-void LcdDisplay::SetEmotion(const char* emotion) {
+void LcdDisplay::ApplyEmotion(const char* emotion) {
 #if CONFIG_USE_GIF_EMOTION_STYLE
-        struct Emotion {
-            const lv_img_dsc_t* gif;
-            const char* text;
-        };
-    
-        static const std::vector<Emotion> emotions = {
-            {&staticstate, "neutral"}, {&happy, "happy"},   {&happy, "laughing"},
-            {&daxiaoyan, "funny"},         {&sad, "sad"},       {&anger, "angry"},
-            {&scare, "surprised"},     {&buxue, "confused"}};
-    
-        std::string_view emotion_view(emotion);
-        auto it = std::find_if(emotions.begin(), emotions.end(),
-                               [&emotion_view](const Emotion& e) { return e.text == emotion_view; });
-    
-        DisplayLockGuard lock(this);
-        if (emotion_gif == nullptr) {
-            return;
-        }
-    
-        if (it != emotions.end()) {
-            lv_gif_set_src(emotion_gif, it->gif);
-        } else {
-            lv_gif_set_src(emotion_gif, &staticstate);
-        } 
+    if (emotion_animation_ == nullptr) {
+        return;
+    }
+    emotion_animation_->SetEmotion(emotion);
 #else
     struct Emotion {
         const char* icon;
@@ -727,7 +801,6 @@ void LcdDisplay::SetEmotion(const char* emotion) {
     std::string_view emotion_view(emotion);
     auto it = std::find_if(emotions.begin(), emotions.end(),
                            [&emotion_view](const Emotion& e) { return e.text == emotion_view; });
-    DisplayLockGuard lock(this);
     if (emotion_label_ == nullptr) {
         return;
     }
@@ -743,8 +816,7 @@ void LcdDisplay::SetEmotion(const char* emotion) {
 #endif
 }
 
-void LcdDisplay::SetIcon(const char* icon) {
-    DisplayLockGuard lock(this);
+void LcdDisplay::ApplyIcon(const char* icon) {
     if (emotion_label_ == nullptr) {
         return;
     }
@@ -947,3 +1019,104 @@ void LcdDisplay::SetTheme(const std::string& theme_name) {
     // No errors occurred. Save theme to settings
     Display::SetTheme(theme_name);
 }
+
+#if CONFIG_LCD_BENCHMARK
+#define BENCHMARK_SCENE_MS 3000
+
+// Runs two scenes on an overlay, a full screen repaint every frame and a scrolling text column,
+// then shows and logs the frame rate, render time and the time spent waiting for the panel
+void LcdDisplay::RunBenchmark(const char* panel_type) {
+    struct Scene {
+        const char* name;
+        int text_lines;
+        lv_timer_cb_t step;
+    };
+    static const Scene scenes[] = {
+        {"fill", 1, [](lv_timer_t* timer) {
+            auto overlay = static_cast<lv_obj_t*>(lv_timer_get_user_data(timer));
+            static uint32_t hue = 0;
+            hue = (hue + 7) % 360;
+            lv_obj_set_style_bg_color(overlay, lv_color_hsv_to_rgb(hue, 80, 90), 0);
+        }},
+        {"scroll", 40, [](lv_timer_t* timer) {
+            auto overlay = static_cast<lv_obj_t*>(lv_timer_get_user_data(timer));
+            if (lv_obj_get_scroll_bottom(overlay) <= 0) {
+                lv_obj_scroll_to_y(overlay, 0, LV_ANIM_OFF);
+            } else {
+                lv_obj_scroll_by(overlay, 0, -4, LV_ANIM_OFF);
+            }
+        }},
+    };
+
+    lv_obj_t* overlay;
+    lv_obj_t* label;
+    lv_timer_t* refr_timer;
+    uint32_t refr_period;
+    {
+        DisplayLockGuard lock(this);
+        if (display_ == nullptr) {
+            return;
+        }
+        if (!render_stats_attached_) {
+            AttachRenderStats();
+        }
+        benchmark_running_ = true;
+        // Let LVGL refresh as fast as the pipeline allows
+        refr_timer = lv_display_get_refr_timer(display_);
+        refr_period = lv_timer_get_period(refr_timer);
+        lv_timer_set_period(refr_timer, 1);
+
+        overlay = lv_obj_create(lv_layer_top());
+        lv_obj_set_size(overlay, LV_HOR_RES, LV_VER_RES);
+        lv_obj_set_style_radius(overlay, 0, 0);
+        lv_obj_set_style_border_width(overlay, 0, 0);
+        lv_obj_set_scrollbar_mode(overlay, LV_SCROLLBAR_MODE_OFF);
+        label = lv_label_create(overlay);
+        lv_obj_set_width(label, LV_HOR_RES * 0.9);
+        lv_label_set_long_mode(label, LV_LABEL_LONG_WRAP);
+    }
+
+    std::string report = std::string(panel_type) + " " + std::to_string(width_) + "x" + std::to_string(height_);
+    for (auto& scene : scenes) {
+        lv_timer_t* timer;
+        {
+            DisplayLockGuard lock(this);
+            std::string text;
+            for (int i = 0; i < scene.text_lines; i++) {
+                text += "LVGL benchmark line " + std::to_string(i) + "\n";
+            }
+            lv_label_set_text(label, text.c_str());
+            lv_obj_scroll_to_y(overlay, 0, LV_ANIM_OFF);
+            stats_frames_ = 0;
+            stats_render_time_us_ = 0;
+            stats_max_render_time_us_ = 0;
+            stats_flush_wait_us_ = 0;
+            stats_flushed_pixels_ = 0;
+            timer = lv_timer_create(scene.step, 0, overlay);
+        }
+        vTaskDelay(pdMS_TO_TICKS(BENCHMARK_SCENE_MS));
+
+        DisplayLockGuard lock(this);
+        lv_timer_delete(timer);
+        uint32_t frames = std::max<uint32_t>(stats_frames_, 1);
+        char line[128];
+        snprintf(line, sizeof(line), "\n%s: %lu fps, render %lld us, flush wait %lld us, %llu px/frame",
+            scene.name, stats_frames_ * 1000 / BENCHMARK_SCENE_MS, stats_render_time_us_ / frames,
+            stats_flush_wait_us_ / frames, stats_flushed_pixels_ / frames);
+        report += line;
+    }
+    ESP_LOGI(TAG, "Benchmark %s", report.c_str());
+
+    {
+        DisplayLockGuard lock(this);
+        lv_obj_set_style_bg_color(overlay, current_theme.background, 0);
+        lv_label_set_text(label, report.c_str());
+        lv_timer_set_period(refr_timer, refr_period);
+    }
+    vTaskDelay(pdMS_TO_TICKS(BENCHMARK_SCENE_MS));
+
+    DisplayLockGuard lock(this);
+    lv_obj_delete(overlay);
+    benchmark_running_ = false;
+}
+#endif
@@ -8,6 +8,11 @@
 #include <font_emoji.h>
 
 #include <atomic>
+#include <memory>
+
+#if CONFIG_USE_GIF_EMOTION_STYLE
+#include "emotion_animation.h"
+#endif
 
 class LcdDisplay : public Display {
 protected:
@@ -19,29 +24,46 @@ protected:
     lv_obj_t* content_ = nullptr;
     lv_obj_t* container_ = nullptr;
     lv_obj_t* side_bar_ = nullptr;
+    // The message currently being revealed, cleared when its object is deleted
+    lv_obj_t* streaming_text_ = nullptr;
 
 #if CONFIG_USE_GIF_EMOTION_STYLE
-    lv_obj_t* emotion_gif = nullptr;
+    std::unique_ptr<EmotionAnimation> emotion_animation_;
 #endif
 
     DisplayFonts fonts_;
 
     void SetupUI();
+#if CONFIG_LCD_BENCHMARK
+    void RunBenchmark(const char* panel_type);
+#endif
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
 
+    virtual void ApplyEmotion(const char* emotion) override;
+    virtual void ApplyIcon(const char* icon) override;
+    virtual void ApplyChatMessage(const char* role, const char* content) override;
+    virtual void ApplyStreamingMessage(const char* role, const char* content) override;
+    virtual void ApplyStreamingReveal(float progress) override;
+    virtual void PrepareChatMessage(const std::string& content) override;
+    int ChatMessageWidth() const;
+    void TrackStreamingText(lv_obj_t* text);
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+    void AddMessageBubble(const char* role, const char* content, bool streaming);
+#endif
+
 protected:
     // 添加protected构造函数
     LcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel, DisplayFonts fonts)
-        : panel_io_(panel_io), panel_(panel), fonts_(fonts) {}
+        : panel_io_(panel_io), panel_(panel), fonts_(fonts) {
+        fonts_.text_font = GlyphCache::Wrap(fonts.text_font);
+    }
     
 public:
     ~LcdDisplay();
-    virtual void SetEmotion(const char* emotion) override;
-    virtual void SetIcon(const char* icon) override;
 #if CONFIG_USE_WECHAT_MESSAGE_STYLE
-    virtual void SetChatMessage(const char* role, const char* content) override; 
-#endif  
+    virtual bool KeepsChatHistory() const override { return true; }
+#endif
 
     // Add theme switching function
     virtual void SetTheme(const std::string& theme_name) override;
@@ -4,6 +4,7 @@
 
 #include <string>
 #include <algorithm>
+#include <cstring>
 
 #include <esp_log.h>
 #include <esp_err.h>
@@ -16,14 +17,12 @@ LV_FONT_DECLARE(font_awesome_30_1);
 OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
     int width, int height, bool mirror_x, bool mirror_y, DisplayFonts fonts)
     : panel_io_(panel_io), panel_(panel), fonts_(fonts) {
+    fonts_.text_font = GlyphCache::Wrap(fonts.text_font);
     width_ = width;
     height_ = height;
 
     ESP_LOGI(TAG, "Initialize LVGL");
-    lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
-    port_cfg.timer_period_ms = 50;
-    lvgl_port_init(&port_cfg);
+    InitializeLvglPort();
 
     ESP_LOGI(TAG, "Adding LCD screen");
     const lvgl_port_display_cfg_t display_cfg = {
@@ -56,6 +55,20 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
         return;
     }
 
+#if CONFIG_OLED_FRAMEBUFFER_DIFF
+    // Take over the flush, the panel is cleared once so the shadow matches its memory
+    frame_.assign(width_ * height_ / 8, 0);
+    shadow_.assign(width_ * height_ / 8, 0);
+    tx_buffer_.resize(width_ * height_ / 8);
+    ESP_ERROR_CHECK(esp_lcd_panel_draw_bitmap(panel_, 0, 0, width_, height_, shadow_.data()));
+    lv_display_set_user_data(display_, this);
+    lv_display_set_flush_cb(display_, [](lv_display_t* disp, const lv_area_t* area, uint8_t* px_map) {
+        auto display = static_cast<OledDisplay*>(lv_display_get_user_data(disp));
+        display->FlushArea(area, px_map);
+        lv_display_flush_ready(disp);
+    });
+#endif
+
     if (height_ == 64) {
         SetupUI_128x64();
     } else {
@@ -86,6 +99,74 @@ OledDisplay::~OledDisplay() {
     lvgl_port_deinit();
 }
 
+#if CONFIG_OLED_FRAMEBUFFER_DIFF
+void OledDisplay::FlushArea(const lv_area_t* area, uint8_t* px_map) {
+    // LVGL renders I1 rows with a palette in front, pixels in the first color (black) are lit
+    px_map += 8;
+    int width = lv_area_get_width(area);
+    uint32_t stride = lv_draw_buf_width_to_stride(width, LV_COLOR_FORMAT_I1);
+    for (int y = area->y1; y <= area->y2; y++) {
+        const uint8_t* row = px_map + (y - area->y1) * stride;
+        uint8_t* page = frame_.data() + (y / 8) * width_;
+        uint8_t bit = 1 << (y % 8);
+        for (int x = area->x1; x <= area->x2; x++) {
+            int i = x - area->x1;
+            if (row[i / 8] & (0x80 >> (i % 8))) {
+                page[x] &= ~bit;
+            } else {
+                page[x] |= bit;
+            }
+        }
+    }
+    stats_bytes_rendered_ += (area->y2 / 8 - area->y1 / 8 + 1) * width;
+
+    // Consecutive changed pages go out in one transaction covering the union of their changed columns
+    int first_page = area->y1 / 8;
+    int last_page = area->y2 / 8;
+    int page = first_page;
+    while (page <= last_page) {
+        int batch_start = -1, x1 = width_, x2 = -1;
+        for (; page <= last_page; page++) {
+            const uint8_t* new_page = frame_.data() + page * width_;
+            const uint8_t* old_page = shadow_.data() + page * width_;
+            int first = area->x1, last = area->x2;
+            while (first <= last && new_page[first] == old_page[first]) {
+                first++;
+            }
+            if (first > last) {
+                break;
+            }
+            while (new_page[last] == old_page[last]) {
+                last--;
+            }
+            if (batch_start < 0) {
+                batch_start = page;
+            }
+            x1 = std::min(x1, first);
+            x2 = std::max(x2, last);
+        }
+        if (batch_start >= 0) {
+            int columns = x2 - x1 + 1;
+            uint8_t* tx = tx_buffer_.data();
+            for (int p = batch_start; p < page; p++) {
+                memcpy(tx, frame_.data() + p * width_ + x1, columns);
+                memcpy(shadow_.data() + p * width_ + x1, tx, columns);
+                tx += columns;
+            }
+            esp_lcd_panel_draw_bitmap(panel_, x1, batch_start * 8, x2 + 1, page * 8, tx_buffer_.data());
+            stats_transactions_++;
+            stats_bytes_sent_ += tx - tx_buffer_.data();
+        }
+        page++;
+    }
+
+    if (++stats_flushes_ % 1000 == 0) {
+        ESP_LOGI(TAG, "%lu flushes, %lu transactions, %llu of %llu rendered bytes sent",
+            stats_flushes_, stats_transactions_, stats_bytes_sent_, stats_bytes_rendered_);
+    }
+}
+#endif
+
 bool OledDisplay::Lock(int timeout_ms) {
     return lvgl_port_lock(timeout_ms);
 }
@@ -94,28 +175,30 @@ void OledDisplay::Unlock() {
     lvgl_port_unlock();
 }
 
-void OledDisplay::SetChatMessage(const char* role, const char* content) {
-    DisplayLockGuard lock(this);
+void OledDisplay::ApplyChatMessage(const char* role, const char* content) {
     if (chat_message_label_ == nullptr) {
         return;
     }
 
-    // Replace all newlines with spaces
-    std::string content_str = content;
-    std::replace(content_str.begin(), content_str.end(), '\n', ' ');
+    // Single line with newlines replaced by spaces, usually already laid out by PrepareChatMessage
+    auto layout = text_layout_cache_.Get(content, fonts_.text_font, 0);
 
     if (content_right_ == nullptr) {
-        lv_label_set_text(chat_message_label_, content_str.c_str());
+        lv_label_set_text(chat_message_label_, layout->text.c_str());
     } else {
         if (content == nullptr || content[0] == '\0') {
             lv_obj_add_flag(content_right_, LV_OBJ_FLAG_HIDDEN);
         } else {
-            lv_label_set_text(chat_message_label_, content_str.c_str());
+            lv_label_set_text(chat_message_label_, layout->text.c_str());
             lv_obj_clear_flag(content_right_, LV_OBJ_FLAG_HIDDEN);
         }
     }
 }
 
+void OledDisplay::PrepareChatMessage(const std::string& content) {
+    text_layout_cache_.Get(content, fonts_.text_font, 0);
+}
+
 void OledDisplay::SetupUI_128x64() {
     DisplayLockGuard lock(this);
 
@@ -6,6 +6,8 @@
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
 
+#include <vector>
+
 class OledDisplay : public Display {
 private:
     esp_lcd_panel_io_handle_t panel_io_ = nullptr;
@@ -20,6 +22,19 @@ private:
 
     DisplayFonts fonts_;
 
+#if CONFIG_OLED_FRAMEBUFFER_DIFF
+    // Both in the panel's page layout: width_ bytes per page, bit n of a byte is row n of the page
+    std::vector<uint8_t> frame_;    // What LVGL rendered
+    std::vector<uint8_t> shadow_;   // What the panel shows
+    std::vector<uint8_t> tx_buffer_;
+    uint32_t stats_flushes_ = 0;
+    uint32_t stats_transactions_ = 0;
+    uint64_t stats_bytes_sent_ = 0;
+    uint64_t stats_bytes_rendered_ = 0;
+
+    void FlushArea(const lv_area_t* area, uint8_t* px_map);
+#endif
+
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
 
@@ -31,7 +46,9 @@ public:
                 DisplayFonts fonts);
     ~OledDisplay();
 
-    virtual void SetChatMessage(const char* role, const char* content) override;
+protected:
+    virtual void ApplyChatMessage(const char* role, const char* content) override;
+    virtual void PrepareChatMessage(const std::string& content) override;
 };
 
 #endif // OLED_DISPLAY_H
@@ -0,0 +1,132 @@
+#include "streaming_text.h"
+
+#include <algorithm>
+
+static size_t NextCharOffset(const std::string& text, size_t offset) {
+    offset++;
+    while (offset < text.size() && (text[offset] & 0xC0) == 0x80) {
+        offset++;
+    }
+    return offset;
+}
+
+lv_obj_t* StreamingText::Create(lv_obj_t* parent, std::shared_ptr<const TextLayout> layout) {
+    lv_obj_t* obj = lv_obj_create(parent);
+    lv_obj_remove_style_all(obj);
+    lv_obj_remove_flag(obj, LV_OBJ_FLAG_SCROLLABLE);
+    lv_obj_remove_flag(obj, LV_OBJ_FLAG_CLICKABLE);
+    lv_obj_set_size(obj, layout->width, layout->height);
+
+    auto text = new StreamingText(obj, std::move(layout));
+    lv_obj_set_user_data(obj, text);
+    lv_obj_add_event_cb(obj, [](lv_event_t* e) {
+        static_cast<StreamingText*>(lv_event_get_user_data(e))->Draw(e);
+    }, LV_EVENT_DRAW_MAIN, text);
+    lv_obj_add_event_cb(obj, [](lv_event_t* e) {
+        delete static_cast<StreamingText*>(lv_event_get_user_data(e));
+    }, LV_EVENT_DELETE, text);
+    return obj;
+}
+
+void StreamingText::Reveal(lv_obj_t* obj, float progress) {
+    auto text = static_cast<StreamingText*>(lv_obj_get_user_data(obj));
+    progress = std::clamp(progress, 0.0f, 1.0f);
+    text->RevealTo(progress * text->total_chars_ + 0.5f);
+}
+
+StreamingText::StreamingText(lv_obj_t* obj, std::shared_ptr<const TextLayout> layout)
+    : obj_(obj), layout_(std::move(layout)) {
+    auto& text = layout_->text;
+    size_t start = 0;
+    while (true) {
+        size_t end = text.find('\n', start);
+        lines_.push_back(text.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    for (auto& line : lines_) {
+        for (size_t offset = 0; offset < line.size(); offset = NextCharOffset(line, offset)) {
+            total_chars_++;
+        }
+    }
+}
+
+int StreamingText::LineX(size_t line) const {
+    int line_width = line < layout_->line_widths.size() ? layout_->line_widths[line] : 0;
+    int free_width = lv_obj_get_content_width(obj_) - line_width;
+    switch (lv_obj_get_style_text_align(obj_, LV_PART_MAIN)) {
+        case LV_TEXT_ALIGN_CENTER:
+            return free_width / 2;
+        case LV_TEXT_ALIGN_RIGHT:
+            return free_width;
+        default:
+            return 0;
+    }
+}
+
+void StreamingText::RevealTo(size_t chars) {
+    chars = std::min(chars, total_chars_);
+    if (chars <= revealed_chars_) {
+        return;
+    }
+
+    auto font = lv_obj_get_style_text_font(obj_, LV_PART_MAIN);
+    int line_height = lv_font_get_line_height(font);
+    lv_area_t content;
+    lv_obj_get_content_coords(obj_, &content);
+
+    while (revealed_chars_ < chars && line_ < lines_.size()) {
+        auto& line = lines_[line_];
+        size_t old_offset = offset_;
+        while (offset_ < line.size() && revealed_chars_ < chars) {
+            offset_ = NextCharOffset(line, offset_);
+            revealed_chars_++;
+        }
+
+        // Only the glyphs added to this line need to be redrawn, with some slack for overhangs
+        if (offset_ > old_offset) {
+            int x = content.x1 + LineX(line_);
+            lv_area_t area;
+            area.x1 = x + lv_txt_get_width(line.c_str(), old_offset, font, 0);
+            area.x2 = x + lv_txt_get_width(line.c_str(), offset_, font, 0) + line_height / 4;
+            area.y1 = content.y1 + line_ * line_height;
+            area.y2 = area.y1 + line_height - 1;
+            lv_obj_invalidate_area(obj_, &area);
+        }
+
+        if (offset_ >= line.size()) {
+            line_++;
+            offset_ = 0;
+        }
+    }
+    partial_ = line_ < lines_.size() ? lines_[line_].substr(0, offset_) : std::string();
+}
+
+void StreamingText::Draw(lv_event_t* e) {
+    lv_layer_t* layer = lv_event_get_layer(e);
+    lv_area_t content;
+    lv_obj_get_content_coords(obj_, &content);
+
+    lv_draw_label_dsc_t dsc;
+    lv_draw_label_dsc_init(&dsc);
+    lv_obj_init_draw_label_dsc(obj_, LV_PART_MAIN, &dsc);
+    // Every line is positioned here, so a partially revealed line stays where the full line will be
+    dsc.align = LV_TEXT_ALIGN_LEFT;
+    int line_height = lv_font_get_line_height(dsc.font);
+
+    for (size_t i = 0; i <= line_ && i < lines_.size(); i++) {
+        const std::string& text = i < line_ ? lines_[i] : partial_;
+        if (text.empty()) {
+            continue;
+        }
+        lv_area_t area;
+        area.x1 = content.x1 + LineX(i);
+        area.x2 = content.x2;
+        area.y1 = content.y1 + i * line_height;
+        area.y2 = area.y1 + line_height - 1;
+        dsc.text = text.c_str();
+        lv_draw_label(layer, &dsc, &area);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef STREAMING_TEXT_H
+#define STREAMING_TEXT_H
+
+#include "text_layout.h"
+
+#include <lvgl.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Shows a pre-wrapped message a few characters at a time while it is being spoken.
+// The object is sized for the whole message up front, so revealing more text never relayouts
+// anything and only invalidates the area of the glyphs that were added.
+class StreamingText {
+public:
+    // The returned object owns the StreamingText, it is freed together with the object
+    static lv_obj_t* Create(lv_obj_t* parent, std::shared_ptr<const TextLayout> layout);
+    // progress is the spoken share of the message from 0 to 1, revealed text is never hidden again
+    static void Reveal(lv_obj_t* obj, float progress);
+
+private:
+    StreamingText(lv_obj_t* obj, std::shared_ptr<const TextLayout> layout);
+
+    lv_obj_t* obj_;
+    std::shared_ptr<const TextLayout> layout_;
+    std::vector<std::string> lines_;
+    size_t total_chars_ = 0;
+    size_t revealed_chars_ = 0;
+    // Position of the next hidden character
+    size_t line_ = 0;
+    size_t offset_ = 0;
+    // Revealed part of lines_[line_], kept alive for the draw tasks
+    std::string partial_;
+
+    int LineX(size_t line) const;
+    void RevealTo(size_t chars);
+    void Draw(lv_event_t* e);
+};
+
+#endif // STREAMING_TEXT_H
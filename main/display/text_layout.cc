@@ -0,0 +1,265 @@
+#include "text_layout.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "fnv_hash.h"
+
+#define TAG "TextLayout"
+
+static uint32_t DecodeUtf8(const std::string& text, size_t& pos) {
+    uint8_t c = text[pos++];
+    int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+    uint32_t letter = extra == 0 ? c : c & (0x3F >> extra);
+    for (int i = 0; i < extra && pos < text.size(); i++) {
+        letter = (letter << 6) | (text[pos++] & 0x3F);
+    }
+    return letter;
+}
+
+// CJK text may break between any two characters
+static bool IsWideLetter(uint32_t letter) {
+    return letter >= 0x2E80 && letter <= 0xFFEF;
+}
+
+const lv_font_t* GlyphCache::Wrap(const lv_font_t* font) {
+    static std::mutex mutex;
+    static std::vector<GlyphCache*> caches;
+    if (font == nullptr) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto cache : caches) {
+        if (cache->base_ == font || &cache->font_ == font) {
+            return &cache->font_;
+        }
+    }
+    auto cache = new GlyphCache(font);
+    caches.push_back(cache);
+    return &cache->font_;
+}
+
+GlyphCache::GlyphCache(const lv_font_t* font) : base_(font), font_(*font) {
+    font_.get_glyph_dsc = GetGlyphDsc;
+    font_.get_glyph_bitmap = GetGlyphBitmap;
+    font_.release_glyph = font->release_glyph != nullptr ? ReleaseGlyph : nullptr;
+    font_.user_data = this;
+
+    // Only compiled-in fonts without a kerning table have an advance that ignores the next letter
+    kerning_ = font->get_glyph_dsc != lv_font_get_glyph_dsc_fmt_txt ||
+        static_cast<const lv_font_fmt_txt_dsc_t*>(font->dsc)->kern_dsc != nullptr;
+    bitmap_budget_ = heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0 ? GLYPH_CACHE_BITMAP_BYTES : GLYPH_CACHE_BITMAP_BYTES / 8;
+    ESP_LOGI(TAG, "Glyph cache for font %p, line height %d, kerning %d, bitmap budget %u",
+        font, (int)font->line_height, kerning_, (unsigned)bitmap_budget_);
+}
+
+bool GlyphCache::GetGlyphDsc(const lv_font_t* font, lv_font_glyph_dsc_t* dsc, uint32_t letter, uint32_t letter_next) {
+    auto cache = static_cast<GlyphCache*>(font->user_data);
+    uint64_t key = cache->kerning_ ? ((uint64_t)letter << 32) | letter_next : letter;
+
+    std::lock_guard<std::mutex> lock(cache->mutex_);
+    auto it = cache->glyphs_.find(key);
+    if (it != cache->glyphs_.end()) {
+        cache->glyph_lru_.splice(cache->glyph_lru_.begin(), cache->glyph_lru_, it->second.second);
+        *dsc = it->second.first.dsc;
+        return it->second.first.found;
+    }
+
+    GlyphEntry entry;
+    entry.found = cache->base_->get_glyph_dsc(cache->base_, dsc, letter, letter_next);
+    entry.dsc = *dsc;
+    if (cache->glyphs_.size() >= GLYPH_CACHE_MAX_GLYPHS) {
+        cache->glyphs_.erase(cache->glyph_lru_.back());
+        cache->glyph_lru_.pop_back();
+    }
+    cache->glyph_lru_.push_front(key);
+    cache->glyphs_.emplace(key, std::make_pair(entry, cache->glyph_lru_.begin()));
+    return entry.found;
+}
+
+const void* GlyphCache::GetGlyphBitmap(lv_font_glyph_dsc_t* dsc, lv_draw_buf_t* draw_buf) {
+    auto cache = static_cast<GlyphCache*>(dsc->resolved_font->user_data);
+    uint32_t key = dsc->gid.index;
+
+    if (draw_buf != nullptr) {
+        std::lock_guard<std::mutex> lock(cache->mutex_);
+        auto it = cache->bitmaps_.find(key);
+        if (it != cache->bitmaps_.end()) {
+            auto& entry = it->second.first;
+            if (entry.stride == draw_buf->header.stride && entry.size <= draw_buf->data_size) {
+                cache->bitmap_lru_.splice(cache->bitmap_lru_.begin(), cache->bitmap_lru_, it->second.second);
+                memcpy(draw_buf->data, entry.data, entry.size);
+                return draw_buf;
+            }
+        }
+    }
+
+    // The base font reads its own descriptor through resolved_font
+    auto wrapper = dsc->resolved_font;
+    dsc->resolved_font = cache->base_;
+    const void* bitmap = cache->base_->get_glyph_bitmap(dsc, draw_buf);
+    dsc->resolved_font = wrapper;
+
+    // Only bitmaps expanded into the draw buffer are worth keeping, others point into the font data
+    if (bitmap == nullptr || bitmap != draw_buf) {
+        return bitmap;
+    }
+    BitmapEntry entry;
+    entry.stride = draw_buf->header.stride;
+    entry.size = entry.stride * dsc->box_h;
+    if (entry.size == 0 || entry.size > draw_buf->data_size || entry.size > cache->bitmap_budget_ / 8) {
+        return bitmap;
+    }
+
+    std::lock_guard<std::mutex> lock(cache->mutex_);
+    if (cache->bitmaps_.find(key) != cache->bitmaps_.end()) {
+        return bitmap;
+    }
+    while (cache->bitmap_bytes_ + entry.size > cache->bitmap_budget_ && !cache->bitmap_lru_.empty()) {
+        auto old = cache->bitmaps_.find(cache->bitmap_lru_.back());
+        cache->bitmap_bytes_ -= old->second.first.size;
+        heap_caps_free(old->second.first.data);
+        cache->bitmaps_.erase(old);
+        cache->bitmap_lru_.pop_back();
+    }
+    entry.data = (uint8_t*)heap_caps_malloc_prefer(entry.size, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+    if (entry.data == nullptr) {
+        return bitmap;
+    }
+    memcpy(entry.data, draw_buf->data, entry.size);
+    cache->bitmap_bytes_ += entry.size;
+    cache->bitmap_lru_.push_front(key);
+    cache->bitmaps_.emplace(key, std::make_pair(entry, cache->bitmap_lru_.begin()));
+    return bitmap;
+}
+
+void GlyphCache::ReleaseGlyph(const lv_font_t* font, lv_font_glyph_dsc_t* dsc) {
+    auto cache = static_cast<GlyphCache*>(font->user_data);
+    dsc->resolved_font = cache->base_;
+    cache->base_->release_glyph(cache->base_, dsc);
+    dsc->resolved_font = font;
+}
+
+std::shared_ptr<const TextLayout> TextLayoutCache::Get(const std::string& content, const lv_font_t* font, int max_width) {
+    // Hash of the content, mixed with the font and the width
+    uint32_t hash = FnvHash(content);
+    hash ^= (uint32_t)(uintptr_t)font * 31 + max_width;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->hash == hash && it->font == font && it->max_width == max_width && it->content == content) {
+                entries_.splice(entries_.begin(), entries_, it);
+                return it->layout;
+            }
+        }
+    }
+
+    // Lay out without holding the lock, a concurrent miss for the same text only costs a duplicate
+    auto layout = Layout(content, font, max_width);
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_front({hash, content, font, max_width, layout});
+    if (entries_.size() > TEXT_LAYOUT_CACHE_SIZE) {
+        entries_.pop_back();
+    }
+    return layout;
+}
+
+std::shared_ptr<const TextLayout> TextLayoutCache::Layout(const std::string& content, const lv_font_t* font, int max_width) {
+    auto layout = std::make_shared<TextLayout>();
+    std::string& text = layout->text;
+    text.reserve(content.size() + 16);
+
+    int line_width = 0;
+    // Where the current line may be broken: the text offset the next line starts at, the width of
+    // the line without trailing spaces, and the width consumed up to that offset
+    size_t break_pos = std::string::npos;
+    int break_line_width = 0;
+    int break_consumed_width = 0;
+
+    auto end_line = [&](int width) {
+        layout->width = std::max(layout->width, width);
+        layout->line_widths.push_back(width);
+        layout->lines++;
+    };
+
+    size_t pos = 0;
+    while (pos < content.size()) {
+        size_t start = pos;
+        uint32_t letter = DecodeUtf8(content, pos);
+        if (letter == '\r') {
+            continue;
+        }
+        if (letter == '\n') {
+            if (max_width <= 0) {
+                letter = ' ';
+            } else {
+                end_line(line_width);
+                text += '\n';
+                line_width = 0;
+                break_pos = std::string::npos;
+                continue;
+            }
+        }
+
+        size_t next_pos = pos;
+        uint32_t letter_next = next_pos < content.size() ? DecodeUtf8(content, next_pos) : 0;
+        int letter_width = lv_font_get_glyph_width(font, letter, letter_next);
+        bool wide = IsWideLetter(letter);
+        if (wide && line_width > 0) {
+            break_pos = text.size();
+            break_line_width = line_width;
+            break_consumed_width = line_width;
+        }
+
+        if (max_width > 0 && line_width > 0 && line_width + letter_width > max_width) {
+            if (letter == ' ') {
+                // The space that overflows becomes the line break
+                end_line(line_width);
+                text += '\n';
+                line_width = 0;
+                break_pos = std::string::npos;
+                continue;
+            }
+            if (break_pos != std::string::npos) {
+                std::string tail = text.substr(break_pos);
+                text.resize(break_pos);
+                while (!text.empty() && text.back() == ' ') {
+                    text.pop_back();
+                }
+                end_line(break_line_width);
+                text += '\n';
+                text += tail;
+                line_width -= break_consumed_width;
+            } else {
+                end_line(line_width);
+                text += '\n';
+                line_width = 0;
+            }
+            break_pos = std::string::npos;
+        }
+
+        if (letter == ' ') {
+            text += ' ';
+        } else {
+            text.append(content, start, pos - start);
+        }
+        int width_before = line_width;
+        line_width += letter_width;
+        if (letter == ' ') {
+            break_pos = text.size();
+            break_line_width = width_before;
+            break_consumed_width = line_width;
+        } else if (wide) {
+            break_pos = text.size();
+            break_line_width = line_width;
+            break_consumed_width = line_width;
+        }
+    }
+    end_line(line_width);
+    layout->height = layout->lines * lv_font_get_line_height(font);
+    return layout;
+}
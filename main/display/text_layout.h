@@ -0,0 +1,87 @@
+#ifndef TEXT_LAYOUT_H
+#define TEXT_LAYOUT_H
+
+#include <lvgl.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define GLYPH_CACHE_MAX_GLYPHS 512
+// Budget for the A8 glyph bitmaps, allocated from PSRAM when the board has it
+#define GLYPH_CACHE_BITMAP_BYTES (64 * 1024)
+#define TEXT_LAYOUT_CACHE_SIZE 16
+
+// Wraps an LVGL font so glyph lookups and rendered bitmaps are served from an LRU cache.
+// Large CJK fonts resolve every code point through a sparse cmap search and expand every bitmap
+// to A8 on each use, while a chat message rarely needs more than a few hundred distinct glyphs.
+class GlyphCache {
+public:
+    // Returns the cached wrapper of font, creating it on first use. Wrappers are never freed.
+    static const lv_font_t* Wrap(const lv_font_t* font);
+
+private:
+    struct GlyphEntry {
+        bool found;
+        lv_font_glyph_dsc_t dsc;
+    };
+    struct BitmapEntry {
+        uint8_t* data;
+        uint32_t stride;
+        uint32_t size;
+    };
+
+    GlyphCache(const lv_font_t* font);
+
+    const lv_font_t* base_;
+    lv_font_t font_;
+    bool kerning_;
+    std::mutex mutex_;
+    std::list<uint64_t> glyph_lru_;
+    std::unordered_map<uint64_t, std::pair<GlyphEntry, std::list<uint64_t>::iterator>> glyphs_;
+    std::list<uint32_t> bitmap_lru_;
+    std::unordered_map<uint32_t, std::pair<BitmapEntry, std::list<uint32_t>::iterator>> bitmaps_;
+    size_t bitmap_bytes_ = 0;
+    size_t bitmap_budget_;
+
+    static bool GetGlyphDsc(const lv_font_t* font, lv_font_glyph_dsc_t* dsc, uint32_t letter, uint32_t letter_next);
+    static const void* GetGlyphBitmap(lv_font_glyph_dsc_t* dsc, lv_draw_buf_t* draw_buf);
+    static void ReleaseGlyph(const lv_font_t* font, lv_font_glyph_dsc_t* dsc);
+};
+
+// A message wrapped for a given font and width. text has a '\n' at every line break, so the label
+// only needs to split at newlines and the width doubles as the bubble width.
+struct TextLayout {
+    std::string text;
+    int width = 0;
+    int height = 0;
+    int lines = 0;
+    std::vector<int> line_widths;
+};
+
+// Remembers the last few layouts, keyed by a hash of the content, font and width.
+// Thread safe, so layouts can be computed before the display lock is taken.
+class TextLayoutCache {
+public:
+    // max_width <= 0 lays the text out on a single line, newlines become spaces
+    std::shared_ptr<const TextLayout> Get(const std::string& content, const lv_font_t* font, int max_width);
+
+private:
+    struct Entry {
+        uint32_t hash;
+        std::string content;
+        const lv_font_t* font;
+        int max_width;
+        std::shared_ptr<const TextLayout> layout;
+    };
+
+    std::mutex mutex_;
+    std::list<Entry> entries_;
+
+    static std::shared_ptr<const TextLayout> Layout(const std::string& content, const lv_font_t* font, int max_width);
+};
+
+#endif // TEXT_LAYOUT_H
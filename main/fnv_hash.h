@@ -0,0 +1,16 @@
+#ifndef FNV_HASH_H
+#define FNV_HASH_H
+
+#include <cstdint>
+#include <string_view>
+
+// 32-bit FNV-1a. constexpr, so keys known at compile time can be hashed ahead of the lookup.
+// Pass a previous result as hash to continue hashing over several pieces.
+constexpr uint32_t FnvHash(std::string_view data, uint32_t hash = 2166136261u) {
+    for (char c : data) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+#endif // FNV_HASH_H
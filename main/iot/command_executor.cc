@@ -0,0 +1,176 @@
+#include "command_executor.h"
+
+#include <esp_log.h>
+
+#define TAG "CommandExecutor"
+
+#define IOT_WORKER_TASK_PRIORITY 2
+
+namespace iot {
+
+static std::string FormatResult(const std::string& id, const std::string& name, const std::string& method,
+        const char* status, int64_t duration_us) {
+    std::string result = "{\"id\":" + id + ",\"name\":";
+    AppendJsonString(result, name);
+    result += ",\"method\":";
+    AppendJsonString(result, method);
+    result += ",\"status\":\"";
+    result += status;
+    result += "\"";
+    if (duration_us >= 0) {
+        result += ",\"duration_ms\":" + std::to_string(duration_us / 1000);
+    }
+    result += "}";
+    return result;
+}
+
+CommandExecutor::CommandExecutor(int worker_count, uint32_t stack_size) {
+    // Workers keep a pointer to their slot, the vector must never grow after this
+    workers_.resize(worker_count);
+    for (int i = 0; i < worker_count; i++) {
+        auto& worker = workers_[i];
+        worker.executor = this;
+        esp_timer_create_args_t timer_args = {
+            .callback = &CommandExecutor::OnDeadline,
+            .arg = &worker,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "iot_deadline",
+            .skip_unhandled_events = true,
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &worker.deadline_timer));
+
+        char name[16];
+        snprintf(name, sizeof(name), "iot_worker_%d", i);
+        xTaskCreate([](void* arg) {
+            auto worker = (Worker*)arg;
+            worker->executor->WorkerLoop(*worker);
+        }, name, stack_size, &worker, IOT_WORKER_TASK_PRIORITY, &worker.task);
+    }
+}
+
+CommandExecutor::~CommandExecutor() {
+    for (auto& worker : workers_) {
+        if (worker.task != nullptr) {
+            vTaskDelete(worker.task);
+        }
+        if (worker.deadline_timer != nullptr) {
+            esp_timer_stop(worker.deadline_timer);
+            esp_timer_delete(worker.deadline_timer);
+        }
+    }
+}
+
+void CommandExecutor::OnResult(std::function<void(std::string&& result)> callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    on_result_ = callback;
+}
+
+void CommandExecutor::Submit(Thing* thing, ThingCall&& call, std::string&& id, int timeout_ms) {
+    int64_t now = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The front of a queue is the call in progress, it is only popped when the method returns
+    auto& queue = queues_[thing];
+    if (queue.empty()) {
+        ready_.push_back(thing);
+        condition_variable_.notify_one();
+    }
+    queue.push_back(Job{thing, std::move(call), std::move(id), now, now + timeout_ms * 1000LL, false});
+}
+
+void CommandExecutor::Reject(const std::string& id, const std::string& name, const std::string& method, const char* status) {
+    if (id.empty()) {
+        return;
+    }
+    std::function<void(std::string&& result)> on_result;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        on_result = on_result_;
+    }
+    if (on_result) {
+        on_result(FormatResult(id, name, method, status, -1));
+    }
+}
+
+void CommandExecutor::WorkerLoop(Worker& worker) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        condition_variable_.wait(lock, [this]() { return !ready_.empty(); });
+        Thing* thing = ready_.front();
+        ready_.pop_front();
+        auto& queue = queues_[thing];
+        // Deque elements keep their address while other calls are appended
+        Job& job = queue.front();
+
+        int64_t now = esp_timer_get_time();
+        std::string result;
+        if (now >= job.deadline_us) {
+            ESP_LOGW(TAG, "%s.%s expired after %lld ms in the queue", thing->name().c_str(),
+                thing->method_name(job.call).c_str(), (now - job.queued_us) / 1000);
+            if (!job.id.empty()) {
+                result = FormatResult(job.id, thing->name(), thing->method_name(job.call), "timeout", now - job.queued_us);
+            }
+        } else {
+            worker.job = &job;
+            esp_timer_start_once(worker.deadline_timer, job.deadline_us - now);
+            lock.unlock();
+
+            int64_t start = esp_timer_get_time();
+            thing->Call(job.call);
+            int64_t end = esp_timer_get_time();
+
+            esp_timer_stop(worker.deadline_timer);
+            lock.lock();
+            worker.job = nullptr;
+            ESP_LOGI(TAG, "%s.%s took %lld ms, waited %lld ms", thing->name().c_str(),
+                thing->method_name(job.call).c_str(), (end - start) / 1000, (start - job.queued_us) / 1000);
+            if (job.reported) {
+                ESP_LOGW(TAG, "%s.%s finished after its timeout was reported", thing->name().c_str(),
+                    thing->method_name(job.call).c_str());
+            } else if (!job.id.empty()) {
+                result = FormatResult(job.id, thing->name(), thing->method_name(job.call), "ok", end - job.queued_us);
+            }
+        }
+
+        queue.pop_front();
+        if (!queue.empty()) {
+            ready_.push_back(thing);
+            condition_variable_.notify_one();
+        }
+
+        if (!result.empty() && on_result_) {
+            auto on_result = on_result_;
+            lock.unlock();
+            on_result(std::move(result));
+            lock.lock();
+        }
+    }
+}
+
+void CommandExecutor::OnDeadline(void* arg) {
+    auto worker = (Worker*)arg;
+    auto executor = worker->executor;
+    std::string result;
+    std::function<void(std::string&& result)> on_result;
+    {
+        std::lock_guard<std::mutex> lock(executor->mutex_);
+        Job* job = worker->job;
+        int64_t now = esp_timer_get_time();
+        // A late timer of the previous call may fire after the next one started
+        if (job == nullptr || job->reported || now < job->deadline_us) {
+            return;
+        }
+        job->reported = true;
+        ESP_LOGW(TAG, "%s.%s is still running after %lld ms", job->thing->name().c_str(),
+            job->thing->method_name(job->call).c_str(), (now - job->queued_us) / 1000);
+        if (job->id.empty()) {
+            return;
+        }
+        result = FormatResult(job->id, job->thing->name(), job->thing->method_name(job->call), "timeout", now - job->queued_us);
+        on_result = executor->on_result_;
+    }
+    if (on_result) {
+        on_result(std::move(result));
+    }
+}
+
+} // namespace iot
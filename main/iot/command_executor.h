@@ -0,0 +1,71 @@
+#ifndef COMMAND_EXECUTOR_H
+#define COMMAND_EXECUTOR_H
+
+#include "thing.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace iot {
+
+// Runs thing methods on a small pool of worker tasks so a slow servo or I2C transfer never blocks
+// the main loop. Calls to the same thing run one after another in arrival order, different things
+// run in parallel. A call that is still queued or running at its deadline is reported as timed out;
+// a running method cannot be stopped, its thing stays busy until it returns.
+class CommandExecutor {
+public:
+    CommandExecutor(int worker_count, uint32_t stack_size);
+    ~CommandExecutor();
+    CommandExecutor(const CommandExecutor&) = delete;
+    CommandExecutor& operator=(const CommandExecutor&) = delete;
+
+    // Receives {"id":...,"name":...,"method":...,"status":...} for every command that carried an id.
+    // Called from a worker or the esp_timer task.
+    void OnResult(std::function<void(std::string&& result)> callback);
+
+    // id is the JSON text of the command id, empty if the server did not ask for a result
+    void Submit(Thing* thing, ThingCall&& call, std::string&& id, int timeout_ms);
+    // Reports a command that could not be started
+    void Reject(const std::string& id, const std::string& name, const std::string& method, const char* status);
+
+private:
+    struct Job {
+        Thing* thing;
+        ThingCall call;
+        std::string id;
+        int64_t queued_us;
+        int64_t deadline_us;
+        bool reported;
+    };
+
+    struct Worker {
+        CommandExecutor* executor;
+        TaskHandle_t task = nullptr;
+        esp_timer_handle_t deadline_timer = nullptr;
+        Job* job = nullptr;         // Guarded by mutex_, the call in progress
+    };
+
+    std::mutex mutex_;
+    std::condition_variable condition_variable_;
+    std::map<Thing*, std::deque<Job>> queues_;
+    std::deque<Thing*> ready_;      // Things with queued calls and no call in progress
+    std::vector<Worker> workers_;
+    std::function<void(std::string&& result)> on_result_;
+
+    void WorkerLoop(Worker& worker);
+    void Report(const Job& job, const char* status, int64_t now_us);
+    static void OnDeadline(void* arg);
+};
+
+} // namespace iot
+
+#endif // COMMAND_EXECUTOR_H
@@ -1,8 +1,10 @@
 #include "thing.h"
-#include "application.h"
 
 #include <esp_log.h>
 
+#include <charconv>
+#include <cstdio>
+
 #define TAG "Thing"
 
 
@@ -36,42 +38,128 @@ std::string Thing::GetDescriptorJson() {
     return json_str;
 }
 
-std::string Thing::GetStateJson() {
-    std::string json_str = "{";
-    json_str += "\"name\":\"" + name_ + "\",";
-    json_str += "\"state\":" + properties_.GetStateJson();
-    json_str += "}";
-    return json_str;
+void AppendJsonString(std::string& out, const std::string& value) {
+    out += '"';
+    for (char c : value) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+                break;
+        }
+    }
+    out += '"';
+}
+
+void Property::AppendStateJson(std::string& out) const {
+    if (type_ == kValueTypeBoolean) {
+        out += boolean_ ? "true" : "false";
+    } else if (type_ == kValueTypeNumber) {
+        char number[12];
+        auto result = std::to_chars(number, number + sizeof(number), number_);
+        out.append(number, result.ptr);
+    } else if (type_ == kValueTypeString) {
+        AppendJsonString(out, string_);
+    } else {
+        out += "null";
+    }
+}
+
+void PropertyList::AppendStateJson(std::string& out, bool delta) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out += '{';
+    bool first = true;
+    for (auto& property : properties_) {
+        if (delta && !property.dirty()) {
+            continue;
+        }
+        if (!first) {
+            out += ',';
+        }
+        first = false;
+        AppendJsonString(out, property.name());
+        out += ':';
+        property.AppendStateJson(out);
+        property.set_dirty(false);
+    }
+    out += '}';
 }
 
-void Thing::Invoke(const cJSON* command) {
+bool Thing::AppendStateJson(std::string& out, bool delta) {
+    if (!properties_.Refresh() && delta) {
+        return false;
+    }
+    out += "{\"name\":";
+    AppendJsonString(out, name_);
+    out += ",\"state\":";
+    properties_.AppendStateJson(out, delta);
+    out += '}';
+    return true;
+}
+
+const Parameter& ParameterList::operator[](std::string_view name) const {
+    static const Parameter missing("", "", kValueTypeNumber, false);
+    uint32_t hash = HashName(name);
+    for (auto& parameter : parameters_) {
+        if (parameter.hash() == hash && parameter.name() == name) {
+            return parameter;
+        }
+    }
+    ESP_LOGW(TAG, "Parameter not found: %.*s", (int)name.size(), name.data());
+    return missing;
+}
+
+bool Thing::PrepareCall(const cJSON* command, ThingCall& call) const {
     auto method_name = cJSON_GetObjectItem(command, "method");
-    auto input_params = cJSON_GetObjectItem(command, "parameters");
+    if (!cJSON_IsString(method_name)) {
+        ESP_LOGE(TAG, "Command for %s has no method", name_.c_str());
+        return false;
+    }
+    int index = methods_.Find(method_name->valuestring);
+    if (index < 0) {
+        ESP_LOGE(TAG, "Method not found: %s.%s", name_.c_str(), method_name->valuestring);
+        return false;
+    }
 
-    try {
-        auto& method = methods_[method_name->valuestring];
-        for (auto& param : method.parameters()) {
-            auto input_param = cJSON_GetObjectItem(input_params, param.name().c_str());
-            if (param.required() && input_param == nullptr) {
-                throw std::runtime_error("Parameter " + param.name() + " is required");
-            }
-            if (param.type() == kValueTypeNumber) {
-                param.set_number(input_param->valueint);
-            } else if (param.type() == kValueTypeString) {
-                param.set_string(input_param->valuestring);
-            } else if (param.type() == kValueTypeBoolean) {
-                param.set_boolean(input_param->valueint == 1);
+    // Every invocation gets its own arguments, concurrent commands never share them
+    call.method = index;
+    call.arguments = methods_.at(index).parameters();
+    auto input_params = cJSON_GetObjectItem(command, "parameters");
+    for (auto& param : call.arguments) {
+        auto input_param = cJSON_GetObjectItem(input_params, param.name().c_str());
+        if (input_param == nullptr) {
+            if (param.required()) {
+                ESP_LOGE(TAG, "Parameter %s of %s is required", param.name().c_str(), method_name->valuestring);
+                return false;
             }
+            continue;
+        }
+        if (param.type() == kValueTypeNumber && cJSON_IsNumber(input_param)) {
+            param.set_number(input_param->valueint);
+        } else if (param.type() == kValueTypeString && cJSON_IsString(input_param)) {
+            param.set_string(input_param->valuestring);
+        } else if (param.type() == kValueTypeBoolean && (cJSON_IsBool(input_param) || cJSON_IsNumber(input_param))) {
+            param.set_boolean(cJSON_IsTrue(input_param) || (cJSON_IsNumber(input_param) && input_param->valueint == 1));
+        } else {
+            ESP_LOGE(TAG, "Parameter %s of %s has the wrong type", param.name().c_str(), method_name->valuestring);
+            return false;
         }
-
-        Application::GetInstance().Schedule([&method]() {
-            method.Invoke();
-        });
-    } catch (const std::runtime_error& e) {
-        ESP_LOGE(TAG, "Method not found: %s", method_name->valuestring);
-        return;
     }
+    return true;
 }
 
+void Thing::Call(const ThingCall& call) {
+    methods_.at(call.method).Invoke(call.arguments);
+}
 
 } // namespace iot
@@ -2,12 +2,17 @@
 #define THING_H
 
 #include <string>
+#include <string_view>
 #include <map>
+#include <memory>
 #include <functional>
 #include <vector>
-#include <stdexcept>
+#include <algorithm>
+#include <mutex>
 #include <cJSON.h>
 
+#include "fnv_hash.h"
+
 namespace iot {
 
 enum ValueType {
@@ -16,6 +21,42 @@ enum ValueType {
     kValueTypeString
 };
 
+constexpr uint32_t HashName(std::string_view name) {
+    return FnvHash(name);
+}
+
+// Sorted (hash, position) pairs. A lookup is a binary search on the hash and a single name
+// compare to rule out collisions, instead of comparing against every name.
+class NameIndex {
+private:
+    std::vector<std::pair<uint32_t, size_t>> entries_;
+
+public:
+    void Add(uint32_t hash, size_t position) {
+        auto it = std::upper_bound(entries_.begin(), entries_.end(), std::make_pair(hash, position));
+        entries_.insert(it, std::make_pair(hash, position));
+    }
+
+    // Returns the position whose name matches, or -1
+    template <typename NameAt>
+    int Find(uint32_t hash, std::string_view name, NameAt&& name_at) const {
+        auto it = std::lower_bound(entries_.begin(), entries_.end(), std::make_pair(hash, (size_t)0));
+        for (; it != entries_.end() && it->first == hash; ++it) {
+            if (name_at(it->second) == name) {
+                return it->second;
+            }
+        }
+        return -1;
+    }
+};
+
+// Appends value as a quoted JSON string
+void AppendJsonString(std::string& out, const std::string& value);
+
+// A property keeps its last value and whether it changed since the last state report, so a delta
+// report only has to serialize what changed. Values are either pushed through the setters or, for
+// properties created with a getter, polled by Refresh(). Not thread safe on its own, PropertyList
+// guards every access.
 class Property {
 private:
     std::string name_;
@@ -24,6 +65,10 @@ private:
     std::function<bool()> boolean_getter_;
     std::function<int()> number_getter_;
     std::function<std::string()> string_getter_;
+    bool boolean_ = false;
+    int number_ = 0;
+    std::string string_;
+    bool dirty_ = true;
 
 public:
     Property(const std::string& name, const std::string& description, std::function<bool()> getter) :
@@ -32,14 +77,50 @@ public:
         name_(name), description_(description), type_(kValueTypeNumber), number_getter_(getter) {}
     Property(const std::string& name, const std::string& description, std::function<std::string()> getter) :
         name_(name), description_(description), type_(kValueTypeString), string_getter_(getter) {}
+    // Pushed property, the owner reports every change through a setter
+    Property(const std::string& name, const std::string& description, ValueType type) :
+        name_(name), description_(description), type_(type) {}
 
     const std::string& name() const { return name_; }
     const std::string& description() const { return description_; }
     ValueType type() const { return type_; }
+    bool dirty() const { return dirty_; }
+    void set_dirty(bool dirty) { dirty_ = dirty; }
 
-    bool boolean() const { return boolean_getter_(); }
-    int number() const { return number_getter_(); }
-    std::string string() const { return string_getter_(); }
+    bool boolean() const { return boolean_; }
+    int number() const { return number_; }
+    const std::string& string() const { return string_; }
+
+    void SetBoolean(bool value) {
+        if (value != boolean_) {
+            boolean_ = value;
+            dirty_ = true;
+        }
+    }
+    void SetNumber(int value) {
+        if (value != number_) {
+            number_ = value;
+            dirty_ = true;
+        }
+    }
+    void SetString(const std::string& value) {
+        if (value != string_) {
+            string_ = value;
+            dirty_ = true;
+        }
+    }
+
+    // Poll the getter if there is one, returns true if the value is dirty
+    bool Refresh() {
+        if (boolean_getter_) {
+            SetBoolean(boolean_getter_());
+        } else if (number_getter_) {
+            SetNumber(number_getter_());
+        } else if (string_getter_) {
+            SetString(string_getter_());
+        }
+        return dirty_;
+    }
 
     std::string GetDescriptorJson() {
         std::string json_str = "{";
@@ -55,61 +136,95 @@ public:
         return json_str;
     }
 
-    std::string GetStateJson() {
-        if (type_ == kValueTypeBoolean) {
-            return boolean_getter_() ? "true" : "false";
-        } else if (type_ == kValueTypeNumber) {
-            return std::to_string(number_getter_());
-        } else if (type_ == kValueTypeString) {
-            return "\"" + string_getter_() + "\"";
-        }
-        return "null";
-    }
+    void AppendStateJson(std::string& out) const;
 };
 
+// Methods run on the IoT worker tasks and push values through the setters while the main loop
+// refreshes and reports the states, so every access to the values goes through mutex_
 class PropertyList {
 private:
     std::vector<Property> properties_;
+    NameIndex index_;
+    std::mutex mutex_;
+
+    size_t Add(Property&& property) {
+        index_.Add(HashName(property.name()), properties_.size());
+        properties_.push_back(std::move(property));
+        return properties_.size() - 1;
+    }
 
 public:
     PropertyList() = default;
-    PropertyList(const std::vector<Property>& properties) : properties_(properties) {}
+    PropertyList(const std::vector<Property>& properties) {
+        for (auto& property : properties) {
+            Add(Property(property));
+        }
+    }
+
+    // The Add* functions return the index used by the setters
+    size_t AddBooleanProperty(const std::string& name, const std::string& description, std::function<bool()> getter) {
+        return Add(Property(name, description, getter));
+    }
+    size_t AddNumberProperty(const std::string& name, const std::string& description, std::function<int()> getter) {
+        return Add(Property(name, description, getter));
+    }
+    size_t AddStringProperty(const std::string& name, const std::string& description, std::function<std::string()> getter) {
+        return Add(Property(name, description, getter));
+    }
+    // Pushed properties start at false / 0 / "" until the first Set*
+    size_t AddBooleanProperty(const std::string& name, const std::string& description) {
+        return Add(Property(name, description, kValueTypeBoolean));
+    }
+    size_t AddNumberProperty(const std::string& name, const std::string& description) {
+        return Add(Property(name, description, kValueTypeNumber));
+    }
+    size_t AddStringProperty(const std::string& name, const std::string& description) {
+        return Add(Property(name, description, kValueTypeString));
+    }
 
-    void AddBooleanProperty(const std::string& name, const std::string& description, std::function<bool()> getter) {
-        properties_.push_back(Property(name, description, getter));
+    void SetBoolean(size_t index, bool value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        properties_[index].SetBoolean(value);
+    }
+    void SetNumber(size_t index, int value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        properties_[index].SetNumber(value);
     }
-    void AddNumberProperty(const std::string& name, const std::string& description, std::function<int()> getter) {
-        properties_.push_back(Property(name, description, getter));
+    void SetString(size_t index, const std::string& value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        properties_[index].SetString(value);
     }
-    void AddStringProperty(const std::string& name, const std::string& description, std::function<std::string()> getter) {
-        properties_.push_back(Property(name, description, getter));
+
+    // Returns the position of the property, or -1 if there is no such property
+    int Find(std::string_view name) const {
+        return index_.Find(HashName(name), name, [this](size_t i) -> const std::string& {
+            return properties_[i].name();
+        });
     }
 
-    const Property& operator[](const std::string& name) const {
+    // Poll the getters, returns true if any property is dirty. Getters run with the lock held and
+    // must not call the setters.
+    bool Refresh() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bool dirty = false;
         for (auto& property : properties_) {
-            if (property.name() == name) {
-                return property;
-            }
+            dirty |= property.Refresh();
         }
-        throw std::runtime_error("Property not found: " + name);
+        return dirty;
     }
 
-    std::string GetDescriptorJson() {
-        std::string json_str = "{";
+    // Mark everything dirty, so the next delta report is a full one
+    void MarkDirty() {
+        std::lock_guard<std::mutex> lock(mutex_);
         for (auto& property : properties_) {
-            json_str += "\"" + property.name() + "\":" + property.GetDescriptorJson() + ",";
+            property.set_dirty(true);
         }
-        if (json_str.back() == ',') {
-            json_str.pop_back();
-        }
-        json_str += "}";
-        return json_str;
     }
 
-    std::string GetStateJson() {
+    std::string GetDescriptorJson() {
         std::string json_str = "{";
         for (auto& property : properties_) {
-            json_str += "\"" + property.name() + "\":" + property.GetStateJson() + ",";
+            json_str += "\"" + property.name() + "\":" + property.GetDescriptorJson() + ",";
         }
         if (json_str.back() == ',') {
             json_str.pop_back();
@@ -117,26 +232,37 @@ public:
         json_str += "}";
         return json_str;
     }
+
+    // Appends a JSON object with the dirty properties (all of them if delta is false) and clears
+    // their dirty bits
+    void AppendStateJson(std::string& out, bool delta);
 };
 
+// The declaration is shared between copies, so the per-invocation copy of a ParameterList only
+// carries the values
 class Parameter {
 private:
-    std::string name_;
-    std::string description_;
-    ValueType type_;
-    bool required_;
-    bool boolean_;
-    int number_;
+    struct Declaration {
+        std::string name;
+        std::string description;
+        uint32_t hash;
+        ValueType type;
+        bool required;
+    };
+    std::shared_ptr<const Declaration> declaration_;
+    bool boolean_ = false;
+    int number_ = 0;
     std::string string_;
 
 public:
     Parameter(const std::string& name, const std::string& description, ValueType type, bool required = true) :
-        name_(name), description_(description), type_(type), required_(required) {}
+        declaration_(std::make_shared<const Declaration>(Declaration{name, description, HashName(name), type, required})) {}
 
-    const std::string& name() const { return name_; }
-    const std::string& description() const { return description_; }
-    ValueType type() const { return type_; }
-    bool required() const { return required_; }
+    const std::string& name() const { return declaration_->name; }
+    const std::string& description() const { return declaration_->description; }
+    uint32_t hash() const { return declaration_->hash; }
+    ValueType type() const { return declaration_->type; }
+    bool required() const { return declaration_->required; }
 
     bool boolean() const { return boolean_; }
     int number() const { return number_; }
@@ -148,12 +274,12 @@ public:
 
     std::string GetDescriptorJson() {
         std::string json_str = "{";
-        json_str += "\"description\":\"" + description_ + "\",";
-        if (type_ == kValueTypeBoolean) {
+        json_str += "\"description\":\"" + description() + "\",";
+        if (type() == kValueTypeBoolean) {
             json_str += "\"type\":\"boolean\"";
-        } else if (type_ == kValueTypeNumber) {
+        } else if (type() == kValueTypeNumber) {
             json_str += "\"type\":\"number\"";
-        } else if (type_ == kValueTypeString) {
+        } else if (type() == kValueTypeString) {
             json_str += "\"type\":\"string\"";
         }
         json_str += "}";
@@ -172,14 +298,9 @@ public:
         parameters_.push_back(parameter);
     }
 
-    const Parameter& operator[](const std::string& name) const {
-        for (auto& parameter : parameters_) {
-            if (parameter.name() == name) {
-                return parameter;
-            }
-        }
-        throw std::runtime_error("Parameter not found: " + name);
-    }
+    // Methods only have a handful of parameters, comparing hashes first is enough. An unknown
+    // name yields an empty parameter (false / 0 / "") instead of throwing
+    const Parameter& operator[](std::string_view name) const;
 
     // iterator
     auto begin() { return parameters_.begin(); }
@@ -211,7 +332,8 @@ public:
 
     const std::string& name() const { return name_; }
     const std::string& description() const { return description_; }
-    ParameterList& parameters() { return parameters_; }
+    // The declared parameters, Thing::Invoke fills a copy for every invocation
+    const ParameterList& parameters() const { return parameters_; }
 
     std::string GetDescriptorJson() {
         std::string json_str = "{";
@@ -221,31 +343,37 @@ public:
         return json_str;
     }
 
-    void Invoke() {
-        callback_(parameters_);
+    void Invoke(const ParameterList& arguments) const {
+        callback_(arguments);
     }
 };
 
 class MethodList {
 private:
     std::vector<Method> methods_;
+    NameIndex index_;
 
 public:
     MethodList() = default;
-    MethodList(const std::vector<Method>& methods) : methods_(methods) {}
+    MethodList(const std::vector<Method>& methods) {
+        for (auto& method : methods) {
+            index_.Add(HashName(method.name()), methods_.size());
+            methods_.push_back(method);
+        }
+    }
 
     void AddMethod(const std::string& name, const std::string& description, const ParameterList& parameters, std::function<void(const ParameterList&)> callback) {
+        index_.Add(HashName(name), methods_.size());
         methods_.push_back(Method(name, description, parameters, callback));
     }
 
-    Method& operator[](const std::string& name) {
-        for (auto& method : methods_) {
-            if (method.name() == name) {
-                return method;
-            }
-        }
-        throw std::runtime_error("Method not found: " + name);
+    // Returns the position of the method, or -1 if there is no such method
+    int Find(std::string_view name) const {
+        return index_.Find(HashName(name), name, [this](size_t i) -> const std::string& {
+            return methods_[i].name();
+        });
     }
+    const Method& at(size_t index) const { return methods_[index]; }
 
     std::string GetDescriptorJson() {
         std::string json_str = "{";
@@ -260,6 +388,12 @@ public:
     }
 };
 
+// A validated call of one method with its own copy of the arguments
+struct ThingCall {
+    int method = -1;
+    ParameterList arguments;
+};
+
 class Thing {
 public:
     Thing(const std::string& name, const std::string& description) :
@@ -267,8 +401,14 @@ public:
     virtual ~Thing() = default;
 
     virtual std::string GetDescriptorJson();
-    virtual std::string GetStateJson();
-    virtual void Invoke(const cJSON* command);
+    // Appends {"name":...,"state":{...}} to out. With delta only changed properties are written,
+    // and nothing at all if none changed. Returns true if something was appended.
+    virtual bool AppendStateJson(std::string& out, bool delta);
+    // Validates the command and fills in the call, returns false on errors
+    virtual bool PrepareCall(const cJSON* command, ThingCall& call) const;
+    // Runs the method on the calling task, ThingManager calls it from its workers one call at a time
+    virtual void Call(const ThingCall& call);
+    const std::string& method_name(const ThingCall& call) const { return methods_.at(call.method).name(); }
 
     const std::string& name() const { return name_; }
     const std::string& description() const { return description_; }
@@ -1,62 +1,113 @@
 #include "thing_manager.h"
 
 #include <esp_log.h>
+#include <mbedtls/sha256.h>
 #define TAG "ThingManager"
 
+#define IOT_WORKER_STACK_SIZE (4096 * 2)
+
 namespace iot {
 
+ThingManager::ThingManager() : executor_(CONFIG_IOT_WORKER_COUNT, IOT_WORKER_STACK_SIZE) {
+}
+
 void ThingManager::AddThing(Thing* thing) {
+    index_.Add(HashName(thing->name()), things_.size());
     things_.push_back(thing);
-}
 
-std::string ThingManager::GetDescriptorsJson() {
-    std::string json_str = "[";
-    for (auto& thing : things_) {
-        json_str += thing->GetDescriptorJson() + ",";
+    descriptors_.pop_back();
+    if (things_.size() > 1) {
+        descriptors_ += ',';
     }
-    if (json_str.back() == ',') {
-        json_str.pop_back();
+    descriptors_ += thing->GetDescriptorJson();
+    descriptors_ += ']';
+    descriptors_hash_.clear();
+}
+
+const std::string& ThingManager::GetDescriptorsHash() {
+    if (descriptors_hash_.empty()) {
+        uint8_t digest[32];
+        mbedtls_sha256(reinterpret_cast<const uint8_t*>(descriptors_.data()), descriptors_.size(), digest, 0);
+        // The first 64 bits are plenty to tell two descriptor sets of one device apart
+        char hex[17];
+        for (int i = 0; i < 8; i++) {
+            snprintf(hex + i * 2, sizeof(hex) - i * 2, "%02x", digest[i]);
+        }
+        descriptors_hash_ = hex;
+        ESP_LOGI(TAG, "IoT descriptors: %u bytes, hash %s", (unsigned)descriptors_.size(), hex);
     }
-    json_str += "]";
-    return json_str;
+    return descriptors_hash_;
 }
 
+// Only things with dirty properties are serialized in a delta, straight into the caller's buffer
 bool ThingManager::GetStatesJson(std::string& json, bool delta) {
-    if (!delta) {
-        last_states_.clear();
-    }
+    std::lock_guard<std::mutex> lock(states_mutex_);
     bool changed = false;
-    json = "[";
-    // 枚举thing，获取每个thing的state，如果发生变化，则更新，保存到last_states_
-    // 如果delta为true，则只返回变化的部分
+    json.clear();
+    json += '[';
     for (auto& thing : things_) {
-        std::string state = thing->GetStateJson();
-        if (delta) {
-            // 如果delta为true，则只返回变化的部分
-            auto it = last_states_.find(thing->name());
-            if (it != last_states_.end() && it->second == state) {
-                continue;
-            }
+        size_t mark = json.size();
+        if (changed) {
+            json += ',';
+        }
+        if (thing->AppendStateJson(json, delta)) {
             changed = true;
-            last_states_[thing->name()] = state;
+        } else {
+            json.resize(mark);
         }
-        json += state + ",";
-    }
-    if (json.back() == ',') {
-        json.pop_back();
     }
-    json += "]";
+    json += ']';
     return changed;
 }
 
-void ThingManager::Invoke(const cJSON* command) {
+static const char* StringOf(const cJSON* item) {
+    return cJSON_IsString(item) ? item->valuestring : "";
+}
+
+bool ThingManager::Invoke(const cJSON* command) {
+    // The id is echoed back as is, the server may use strings or numbers
+    std::string id;
+    auto id_item = cJSON_GetObjectItem(command, "id");
+    if (cJSON_IsString(id_item)) {
+        AppendJsonString(id, id_item->valuestring);
+    } else if (cJSON_IsNumber(id_item)) {
+        id = std::to_string(static_cast<long long>(id_item->valuedouble));
+    }
+
     auto name = cJSON_GetObjectItem(command, "name");
-    for (auto& thing : things_) {
-        if (thing->name() == name->valuestring) {
-            thing->Invoke(command);
-            return;
-        }
+    auto method = cJSON_GetObjectItem(command, "method");
+    if (!cJSON_IsString(name)) {
+        ESP_LOGE(TAG, "IoT command has no name");
+        executor_.Reject(id, "", StringOf(method), "invalid");
+        return false;
+    }
+    int index = index_.Find(HashName(name->valuestring), name->valuestring, [this](size_t i) -> const std::string& {
+        return things_[i]->name();
+    });
+    if (index < 0) {
+        ESP_LOGW(TAG, "Thing not found: %s", name->valuestring);
+        executor_.Reject(id, name->valuestring, StringOf(method), "not_found");
+        return false;
     }
+
+    Thing* thing = things_[index];
+    ThingCall call;
+    if (!thing->PrepareCall(command, call)) {
+        executor_.Reject(id, thing->name(), StringOf(method), "invalid");
+        return false;
+    }
+
+    int timeout_ms = CONFIG_IOT_COMMAND_TIMEOUT_MS;
+    auto timeout = cJSON_GetObjectItem(command, "timeout_ms");
+    if (cJSON_IsNumber(timeout) && timeout->valueint > 0) {
+        timeout_ms = timeout->valueint;
+    }
+    executor_.Submit(thing, std::move(call), std::move(id), timeout_ms);
+    return true;
+}
+
+void ThingManager::OnCommandResult(std::function<void(std::string&& result)> callback) {
+    executor_.OnResult(callback);
 }
 
 } // namespace iot
@@ -3,6 +3,7 @@
 
 
 #include "thing.h"
+#include "command_executor.h"
 
 #include <cJSON.h>
 
@@ -10,6 +11,7 @@
 #include <memory>
 #include <functional>
 #include <map>
+#include <mutex>
 
 namespace iot {
 
@@ -24,16 +26,30 @@ public:
 
     void AddThing(Thing* thing);
 
-    std::string GetDescriptorsJson();
+    // Descriptors never change after a thing is added, the array is built once at registration
+    const std::string& GetDescriptorsJson() const { return descriptors_; }
+    // Content hash of GetDescriptorsJson(), lets the server tell whether it already holds them
+    const std::string& GetDescriptorsHash();
+    // Fills json with the states of all things, or with delta only the properties that changed
+    // since the last call. Returns false if there is nothing to report.
     bool GetStatesJson(std::string& json, bool delta = false);
-    void Invoke(const cJSON* command);
+    // Validates the command and queues it on the IoT workers. Returns false if the thing or method
+    // does not exist or the parameters are invalid. A command with an "id" gets a result when it
+    // finishes, times out or is rejected.
+    bool Invoke(const cJSON* command);
+    // Called from a worker or timer task with {"id":...,"status":...}
+    void OnCommandResult(std::function<void(std::string&& result)> callback);
 
 private:
-    ThingManager() = default;
+    ThingManager();
     ~ThingManager() = default;
 
     std::vector<Thing*> things_;
-    std::map<std::string, std::string> last_states_;
+    NameIndex index_;
+    std::string descriptors_ = "[]";
+    std::string descriptors_hash_;
+    std::mutex states_mutex_;
+    CommandExecutor executor_;
 };
 
 
@@ -37,6 +37,7 @@ namespace iot {
     class Lamp : public Thing {
         private:
     bool power_ = false;
+    size_t power_property_ = 0;
     mcpwm_cmpr_handle_t comparator = NULL;
     void example_ledc_init(void) {
         ESP_LOGI(TAG, "Create timer and operator");
@@ -95,13 +96,12 @@ Lamp() : Thing("Arm", "你的手臂，可以运动"), power_(false) {
         example_ledc_init();
 
         // 定义设备的属性
-        properties_.AddBooleanProperty("power", "手臂是否运动", [this]() -> bool {
-            return power_;
-        });
+        power_property_ = properties_.AddBooleanProperty("power", "手臂是否运动");
 
         // 定义设备可以被远程执行的指令
         methods_.AddMethod("TurnOn", "手臂运用", ParameterList(), [this](const ParameterList& parameters) {
             power_ = true;
+            properties_.SetBoolean(power_property_, power_);
             int angle = 0;
                 ESP_LOGI(TAG, "Angle of rotation: %d", angle);
                 ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(comparator, example_angle_to_compare(angle)));
@@ -126,6 +126,7 @@ Lamp() : Thing("Arm", "你的手臂，可以运动"), power_(false) {
 
         methods_.AddMethod("TurnOff", "手臂返回原来的位置", ParameterList(), [this](const ParameterList& parameters) {
             power_ = false;
+            properties_.SetBoolean(power_property_, power_);
             // ****
         });
     }
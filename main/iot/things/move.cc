@@ -7,27 +7,8 @@
 namespace iot {
 
 Move::Move() : Thing("Move", "移动控制") {
-    // 配置LEDC定时器
-    ledc_timer_config_t ledc_timer = {
-        .speed_mode = LEDC_MODE,
-        .duty_resolution = LEDC_DUTY_RES,
-        .timer_num = LEDC_TIMER,
-        .freq_hz = LEDC_FREQ,
-        .clk_cfg = LEDC_AUTO_CLK
-    };
-    ledc_timer_config(&ledc_timer);
-
-    // 配置LEDC通道
-    ledc_channel_config_t ledc_channel = {
-        .gpio_num = SERVO_PIN,
-        .speed_mode = LEDC_MODE,
-        .channel = LEDC_CHANNEL,
-        .intr_type = LEDC_INTR_DISABLE,
-        .timer_sel = LEDC_TIMER,
-        .duty = 0,
-        .hpoint = 0
-    };
-    ledc_channel_config(&ledc_channel);
+    // 分配LEDC通道，定时器与其他模块共享
+    ledc_ = LedcAllocator::GetInstance().Allocate(SERVO_PIN, LEDC_FREQ, LEDC_DUTY_RES);
 
     // 初始化舵机到90度位置
     SetServoAngle(90);
@@ -47,8 +28,11 @@ void Move::SetServoAngle(int angle) {
     int duty = 102 + (angle * 102) / 180;  // 102~512
 
     // 设置占空比
-    ledc_set_duty(LEDC_MODE, LEDC_CHANNEL, duty);
-    ledc_update_duty(LEDC_MODE, LEDC_CHANNEL);
+    if (!ledc_.valid()) {
+        return;
+    }
+    ledc_set_duty(ledc_.speed_mode, ledc_.channel, duty);
+    ledc_update_duty(ledc_.speed_mode, ledc_.channel);
 
     ESP_LOGI(TAG, "Set servo angle to %d degrees (duty: %d)", angle, duty);
 }
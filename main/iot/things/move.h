@@ -4,6 +4,7 @@
 #include "iot/thing.h"
 #include "board.h"
 #include "settings.h"
+#include "ledc_allocator.h"
 #include <esp_log.h>
 #include <driver/ledc.h>
 
@@ -12,9 +13,6 @@
 #define MAX_DISTANCE_CM 300  // 最大移动距离3米
 #define MAX_ANGLE_DEG 3600   // 最大旋转角度10圈
 #define SERVO_PIN GPIO_NUM_12
-#define LEDC_TIMER LEDC_TIMER_0
-#define LEDC_MODE LEDC_LOW_SPEED_MODE
-#define LEDC_CHANNEL LEDC_CHANNEL_0
 #define LEDC_DUTY_RES LEDC_TIMER_13_BIT
 #define LEDC_FREQ 50         // 50Hz, 20ms周期
 
@@ -37,6 +35,8 @@ private:
     // 移动限制检查
     bool CheckDistanceLimit(int distance_cm);
     bool CheckAngleLimit(int angle_deg);
+
+    LedcChannel ledc_;
 };
 
 } // namespace iot
@@ -0,0 +1,46 @@
+#include "iot/thing.h"
+#include "application.h"
+
+#include <esp_log.h>
+
+#define TAG "WakeWord"
+
+#if CONFIG_USE_WAKE_WORD_DETECT
+
+namespace iot {
+
+// 唤醒词模型的查询与切换，切换后的选择保存在设置中
+class WakeWord : public Thing {
+public:
+    WakeWord() : Thing("WakeWord", "唤醒词") {
+        properties_.AddStringProperty("model", "当前唤醒词模型", []() -> std::string {
+            return Application::GetInstance().GetWakeWordDetect().GetModel();
+        });
+        properties_.AddStringProperty("models", "可用的唤醒词模型，以逗号分隔", []() -> std::string {
+            std::string models;
+            for (auto& model : Application::GetInstance().GetWakeWordDetect().GetModels()) {
+                if (!models.empty()) {
+                    models += ',';
+                }
+                models += model;
+            }
+            return models;
+        });
+
+        methods_.AddMethod("SetModel", "切换唤醒词模型", ParameterList({
+            Parameter("model", "models 中的一个模型名", kValueTypeString, true)
+        }), [](const ParameterList& parameters) {
+            // 放回主循环执行，与设备状态切换中的启动、停止检测串行
+            auto& app = Application::GetInstance();
+            app.Schedule([&app, model = parameters["model"].string()]() {
+                app.GetWakeWordDetect().SetModel(model);
+            });
+        });
+    }
+};
+
+} // namespace iot
+
+DECLARE_THING(WakeWord);
+
+#endif
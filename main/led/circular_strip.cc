@@ -1,179 +1,408 @@
 #include "circular_strip.h"
 #include "application.h"
 #include <esp_log.h>
+#include <esp_attr.h>
+#include <soc/soc_caps.h>
+
+#include <algorithm>
+#include <cstdlib>
 
 #define TAG "CircularStrip"
 
-#define BLINK_INFINITE -1
+// WS2812 timing at a 10MHz RMT clock, one tick is 0.1us
+#define STRIP_RMT_RESOLUTION_HZ (10 * 1000 * 1000)
+#define STRIP_T0H_TICKS 3
+#define STRIP_T0L_TICKS 9
+#define STRIP_T1H_TICKS 9
+#define STRIP_T1L_TICKS 3
+// Low time that latches a frame, newer WS2812B need 280us instead of the 50us of the datasheet
+#define STRIP_RESET_US 300
+#define STRIP_RMT_DMA_SYMBOLS 1024
+// Retry delay when the RMT has not finished with the back buffer yet
+#define STRIP_RETRY_US 1000
+
+static bool IRAM_ATTR OnStripTransDone(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t* event, void* arg) {
+    auto frames_done = static_cast<std::atomic<uint32_t>*>(arg);
+    frames_done->fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// Pixel bytes followed by the reset symbol, so frames queued back to back are latched one by one
+// instead of reading as pixels past the end of the strip
+struct StripEncoder {
+    rmt_encoder_t base;
+    rmt_encoder_handle_t bytes_encoder;
+    rmt_encoder_handle_t copy_encoder;
+    int state;
+    rmt_symbol_word_t reset_code;
+};
+
+static size_t StripEncode(rmt_encoder_t* encoder, rmt_channel_handle_t channel, const void* data, size_t size, rmt_encode_state_t* ret_state) {
+    auto strip_encoder = __containerof(encoder, StripEncoder, base);
+    rmt_encode_state_t session_state = RMT_ENCODING_RESET;
+    int state = RMT_ENCODING_RESET;
+    size_t encoded_symbols = 0;
+    if (strip_encoder->state == 0) {
+        auto bytes_encoder = strip_encoder->bytes_encoder;
+        encoded_symbols += bytes_encoder->encode(bytes_encoder, channel, data, size, &session_state);
+        if (session_state & RMT_ENCODING_COMPLETE) {
+            strip_encoder->state = 1;
+        }
+        if (session_state & RMT_ENCODING_MEM_FULL) {
+            *ret_state = static_cast<rmt_encode_state_t>(state | RMT_ENCODING_MEM_FULL);
+            return encoded_symbols;
+        }
+    }
+    if (strip_encoder->state == 1) {
+        auto copy_encoder = strip_encoder->copy_encoder;
+        encoded_symbols += copy_encoder->encode(copy_encoder, channel, &strip_encoder->reset_code,
+            sizeof(strip_encoder->reset_code), &session_state);
+        if (session_state & RMT_ENCODING_COMPLETE) {
+            strip_encoder->state = 0;
+            state |= RMT_ENCODING_COMPLETE;
+        }
+        if (session_state & RMT_ENCODING_MEM_FULL) {
+            state |= RMT_ENCODING_MEM_FULL;
+        }
+    }
+    *ret_state = static_cast<rmt_encode_state_t>(state);
+    return encoded_symbols;
+}
+
+static esp_err_t StripEncoderReset(rmt_encoder_t* encoder) {
+    auto strip_encoder = __containerof(encoder, StripEncoder, base);
+    rmt_encoder_reset(strip_encoder->bytes_encoder);
+    rmt_encoder_reset(strip_encoder->copy_encoder);
+    strip_encoder->state = 0;
+    return ESP_OK;
+}
+
+static esp_err_t StripEncoderDelete(rmt_encoder_t* encoder) {
+    auto strip_encoder = __containerof(encoder, StripEncoder, base);
+    rmt_del_encoder(strip_encoder->bytes_encoder);
+    rmt_del_encoder(strip_encoder->copy_encoder);
+    delete strip_encoder;
+    return ESP_OK;
+}
+
+static rmt_encoder_handle_t NewStripEncoder() {
+    auto strip_encoder = new StripEncoder();
+    strip_encoder->base.encode = StripEncode;
+    strip_encoder->base.reset = StripEncoderReset;
+    strip_encoder->base.del = StripEncoderDelete;
+
+    rmt_bytes_encoder_config_t bytes_config = {};
+    bytes_config.bit0.duration0 = STRIP_T0H_TICKS;
+    bytes_config.bit0.level0 = 1;
+    bytes_config.bit0.duration1 = STRIP_T0L_TICKS;
+    bytes_config.bit0.level1 = 0;
+    bytes_config.bit1.duration0 = STRIP_T1H_TICKS;
+    bytes_config.bit1.level0 = 1;
+    bytes_config.bit1.duration1 = STRIP_T1L_TICKS;
+    bytes_config.bit1.level1 = 0;
+    bytes_config.flags.msb_first = 1;
+    ESP_ERROR_CHECK(rmt_new_bytes_encoder(&bytes_config, &strip_encoder->bytes_encoder));
+
+    rmt_copy_encoder_config_t copy_config = {};
+    ESP_ERROR_CHECK(rmt_new_copy_encoder(&copy_config, &strip_encoder->copy_encoder));
+
+    // The reset time is split over both halves of one symbol
+    uint32_t reset_ticks = STRIP_RMT_RESOLUTION_HZ / 1000000 * STRIP_RESET_US / 2;
+    strip_encoder->reset_code.level0 = 0;
+    strip_encoder->reset_code.duration0 = reset_ticks;
+    strip_encoder->reset_code.level1 = 0;
+    strip_encoder->reset_code.duration1 = reset_ticks;
+    return &strip_encoder->base;
+}
 
 CircularStrip::CircularStrip(gpio_num_t gpio, uint8_t max_leds) : max_leds_(max_leds) {
     // If the gpio is not connected, you should use NoLed class
     assert(gpio != GPIO_NUM_NC);
 
     colors_.resize(max_leds_);
+    output_.resize(max_leds_);
+    level_table_ = std::make_shared<LedFrameTable>();
+    level_table_->frame_ms = 1;
+    level_table_->frame_count = 1;
+    level_table_->led_count = max_leds_;
+    level_table_->pixels.resize(max_leds_);
+    for (auto& buffer : pixel_buffers_) {
+        buffer.resize(max_leds_ * 3);
+    }
 
-    led_strip_config_t strip_config = {};
-    strip_config.strip_gpio_num = gpio;
-    strip_config.max_leds = max_leds_;
-    strip_config.led_pixel_format = LED_PIXEL_FORMAT_GRB;
-    strip_config.led_model = LED_MODEL_WS2812;
+    rmt_tx_channel_config_t tx_config = {};
+    tx_config.gpio_num = gpio;
+    tx_config.clk_src = RMT_CLK_SRC_DEFAULT;
+    tx_config.resolution_hz = STRIP_RMT_RESOLUTION_HZ;
+    tx_config.trans_queue_depth = 2;
+    esp_err_t err = ESP_ERR_NOT_SUPPORTED;
+#if SOC_RMT_SUPPORT_DMA
+    // With DMA the whole frame is streamed without refilling the RMT memory from interrupts
+    tx_config.mem_block_symbols = STRIP_RMT_DMA_SYMBOLS;
+    tx_config.flags.with_dma = true;
+    err = rmt_new_tx_channel(&tx_config, &rmt_channel_);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "RMT DMA channel not available, falling back to ping-pong mode");
+    }
+#endif
+    if (err != ESP_OK) {
+        tx_config.mem_block_symbols = SOC_RMT_MEM_WORDS_PER_CHANNEL;
+        tx_config.flags.with_dma = false;
+        ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_config, &rmt_channel_));
+    }
 
-    led_strip_rmt_config_t rmt_config = {};
-    rmt_config.resolution_hz = 10 * 1000 * 1000; // 10MHz
+    rmt_encoder_ = NewStripEncoder();
 
-    ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_));
-    led_strip_clear(led_strip_);
+    rmt_tx_event_callbacks_t callbacks = {};
+    callbacks.on_trans_done = OnStripTransDone;
+    ESP_ERROR_CHECK(rmt_tx_register_event_callbacks(rmt_channel_, &callbacks, &frames_done_));
+    ESP_ERROR_CHECK(rmt_enable(rmt_channel_));
 
     esp_timer_create_args_t strip_timer_args = {
         .callback = [](void *arg) {
             auto strip = static_cast<CircularStrip*>(arg);
             std::lock_guard<std::mutex> lock(strip->mutex_);
-            if (strip->strip_callback_ != nullptr) {
-                strip->strip_callback_();
-            }
+            strip->Render();
         },
         .arg = this,
         .dispatch_method = ESP_TIMER_TASK,
         .name = "strip_timer",
-        .skip_unhandled_events = false,
+        .skip_unhandled_events = true,
     };
     ESP_ERROR_CHECK(esp_timer_create(&strip_timer_args, &strip_timer_));
+
+    // Clear the strip
+    std::lock_guard<std::mutex> lock(mutex_);
+    Render();
 }
 
 CircularStrip::~CircularStrip() {
+    UnsubscribeAudioLevel();
     esp_timer_stop(strip_timer_);
-    if (led_strip_ != nullptr) {
-        led_strip_del(led_strip_);
+    esp_timer_delete(strip_timer_);
+    if (rmt_channel_ != nullptr) {
+        rmt_tx_wait_all_done(rmt_channel_, 100);
+        rmt_disable(rmt_channel_);
+        rmt_del_channel(rmt_channel_);
+    }
+    if (rmt_encoder_ != nullptr) {
+        rmt_del_encoder(rmt_encoder_);
     }
 }
 
+// Called with mutex_ held. Looks up the current frame of every layer, blends them and queues the
+// result on the RMT, then sleeps until the next frame of any layer is due.
+void CircularStrip::Render() {
+    int64_t now = esp_timer_get_time();
 
-void CircularStrip::SetAllColor(StripColor color) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(strip_timer_);
+    // The back buffer was queued two frames ago and must be sent before it is reused
+    if (frames_sent_ - frames_done_.load(std::memory_order_relaxed) >= 2) {
+        esp_timer_start_once(strip_timer_, STRIP_RETRY_US);
+        return;
+    }
+
+    const StripColor* frames[kStripLayerCount] = {};
+    int64_t next_due = INT64_MAX;
+    for (int l = 0; l < kStripLayerCount; l++) {
+        auto& layer = layers_[l];
+        if (!layer.table) {
+            continue;
+        }
+        auto& table = *layer.table;
+        int64_t frame_us = table.frame_ms * 1000LL;
+        int64_t elapsed = (now - layer.start_time) / frame_us;
+        int frame;
+        if (table.loop) {
+            frame = elapsed % table.frame_count;
+        } else {
+            frame = std::min<int64_t>(elapsed, table.frame_count - 1);
+        }
+        if (table.loop || elapsed < table.frame_count - 1) {
+            next_due = std::min(next_due, layer.start_time + (elapsed + 1) * frame_us);
+        }
+        frames[l] = table.Frame(frame);
+    }
+
+    bool changed = frames_sent_ == 0;
+    auto& buffer = pixel_buffers_[back_buffer_];
     for (int i = 0; i < max_leds_; i++) {
-        colors_[i] = color;
-        led_strip_set_pixel(led_strip_, i, color.red, color.green, color.blue);
+        StripColor color;
+        for (int l = 0; l < kStripLayerCount; l++) {
+            if (frames[l] == nullptr) {
+                continue;
+            }
+            int leds = layers_[l].table->led_count;
+            if (leds != 1 && i >= leds) {
+                continue;
+            }
+            auto& pixel = frames[l][leds == 1 ? 0 : i];
+            switch (layers_[l].blend) {
+                case kStripBlendReplace:
+                    if (pixel.red != 0 || pixel.green != 0 || pixel.blue != 0 || l == kStripLayerBase) {
+                        color = pixel;
+                    }
+                    break;
+                case kStripBlendAdd:
+                    color.red = std::min(color.red + pixel.red, 255);
+                    color.green = std::min(color.green + pixel.green, 255);
+                    color.blue = std::min(color.blue + pixel.blue, 255);
+                    break;
+                case kStripBlendMax:
+                    color.red = std::max(color.red, pixel.red);
+                    color.green = std::max(color.green, pixel.green);
+                    color.blue = std::max(color.blue, pixel.blue);
+                    break;
+            }
+        }
+        if (color.red != output_[i].red || color.green != output_[i].green || color.blue != output_[i].blue) {
+            output_[i] = color;
+            changed = true;
+        }
+        buffer[i * 3] = color.green;
+        buffer[i * 3 + 1] = color.red;
+        buffer[i * 3 + 2] = color.blue;
+    }
+
+    if (changed) {
+        rmt_transmit_config_t transmit_config = {};
+        if (rmt_transmit(rmt_channel_, rmt_encoder_, buffer.data(), buffer.size(), &transmit_config) == ESP_OK) {
+            frames_sent_++;
+            back_buffer_ ^= 1;
+        }
+    }
+
+    if (next_due != INT64_MAX) {
+        esp_timer_start_once(strip_timer_, std::max<int64_t>(next_due - now, 1));
     }
-    led_strip_refresh(led_strip_);
 }
 
-void CircularStrip::SetSingleColor(uint8_t index, StripColor color) {
+void CircularStrip::PlayLayer(StripLayer layer, std::shared_ptr<const LedFrameTable> table, StripBlend blend) {
     std::lock_guard<std::mutex> lock(mutex_);
     esp_timer_stop(strip_timer_);
-    colors_[index] = color;
-    led_strip_set_pixel(led_strip_, index, color.red, color.green, color.blue);
-    led_strip_refresh(led_strip_);
+    layers_[layer].table = std::move(table);
+    layers_[layer].blend = blend;
+    layers_[layer].start_time = esp_timer_get_time();
+    Render();
 }
 
-void CircularStrip::Blink(StripColor color, int interval_ms) {
-    for (int i = 0; i < max_leds_; i++) {
-        colors_[i] = color;
+void CircularStrip::PlayEffect(const LedEffect& effect) {
+    PlayLayer(kStripLayerBase, CompileLedEffect(effect, max_leds_));
+}
+
+void CircularStrip::SetAllColor(StripColor color) {
+    std::vector<StripColor> colors;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::fill(colors_.begin(), colors_.end(), color);
+        colors = colors_;
     }
-    StartStripTask(interval_ms, [this]() {
-        static bool on = true;
-        if (on) {
-            for (int i = 0; i < max_leds_; i++) {
-                led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
-            }
-            led_strip_refresh(led_strip_);
-        } else {
-            led_strip_clear(led_strip_);
+    PlayLayer(kStripLayerBase, CompileLedStatic(colors));
+}
+
+void CircularStrip::SetSingleColor(uint8_t index, StripColor color) {
+    std::vector<StripColor> colors;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (index >= max_leds_) {
+            ESP_LOGW(TAG, "Invalid led index: %d", index);
+            return;
         }
-        on = !on;
-    });
+        colors_[index] = color;
+        colors = colors_;
+    }
+    PlayLayer(kStripLayerBase, CompileLedStatic(colors));
+}
+
+void CircularStrip::Blink(StripColor color, int interval_ms) {
+    LedEffect effect;
+    effect.frame_ms = interval_ms;
+    effect.interpolate = false;
+    effect.keyframes = {
+        { 0, color },
+        { interval_ms, StripColor{} },
+        { interval_ms * 2, color },
+    };
+    PlayEffect(effect);
 }
 
 void CircularStrip::FadeOut(int interval_ms) {
-    StartStripTask(interval_ms, [this]() {
-        bool all_off = true;
-        for (int i = 0; i < max_leds_; i++) {
-            colors_[i].red /= 2;
-            colors_[i].green /= 2;
-            colors_[i].blue /= 2;
-            if (colors_[i].red != 0 || colors_[i].green != 0 || colors_[i].blue != 0) {
-                all_off = false;
-            }
-            led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
-        }
-        if (all_off) {
-            led_strip_clear(led_strip_);
-            esp_timer_stop(strip_timer_);
-        } else {
-            led_strip_refresh(led_strip_);
-        }
-    });
+    std::vector<StripColor> colors;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        colors = output_;
+    }
+    PlayLayer(kStripLayerBase, CompileLedFadeOut(colors, interval_ms));
 }
 
 void CircularStrip::Breathe(StripColor low, StripColor high, int interval_ms) {
-    StartStripTask(interval_ms, [this, low, high]() {
-        static bool increase = true;
-        static StripColor color = low;
-        if (increase) {
-            if (color.red < high.red) {
-                color.red++;
-            }
-            if (color.green < high.green) {
-                color.green++;
-            }
-            if (color.blue < high.blue) {
-                color.blue++;
-            }
-            if (color.red == high.red && color.green == high.green && color.blue == high.blue) {
-                increase = false;
-            }
-        } else {
-            if (color.red > low.red) {
-                color.red--;
-            }
-            if (color.green > low.green) {
-                color.green--;
-            }
-            if (color.blue > low.blue) {
-                color.blue--;
-            }
-            if (color.red == low.red && color.green == low.green && color.blue == low.blue) {
-                increase = true;
-            }
-        }
-        for (int i = 0; i < max_leds_; i++) {
-            led_strip_set_pixel(led_strip_, i, color.red, color.green, color.blue);
-        }
-        led_strip_refresh(led_strip_);
+    // One step per tick on the channel that changes the most, like stepping it by one
+    int steps = std::max({
+        std::abs(high.red - low.red),
+        std::abs(high.green - low.green),
+        std::abs(high.blue - low.blue),
+        1,
     });
+    LedEffect effect;
+    effect.frame_ms = interval_ms;
+    effect.keyframes = {
+        { 0, low },
+        { steps * interval_ms, high },
+        { steps * interval_ms * 2, low },
+    };
+    PlayEffect(effect);
 }
 
 void CircularStrip::Scroll(StripColor low, StripColor high, int length, int interval_ms) {
-    for (int i = 0; i < max_leds_; i++) {
-        colors_[i] = low;
-    }
-    StartStripTask(interval_ms, [this, low, high, length]() {
-        static int offset = 0;
-        for (int i = 0; i < max_leds_; i++) {
-            colors_[i] = low;
-        }
-        for (int j = 0; j < length; j++) {
-            int i = (offset + j) % max_leds_;
-            colors_[i] = high;
-        }
-        for (int i = 0; i < max_leds_; i++) {
-            led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
-        }
-        led_strip_refresh(led_strip_);
-        offset = (offset + 1) % max_leds_;
-    });
+    LedEffect effect;
+    effect.type = kLedEffectScroll;
+    effect.frame_ms = interval_ms;
+    effect.low = low;
+    effect.high = high;
+    effect.length = length;
+    PlayEffect(effect);
 }
 
-void CircularStrip::StartStripTask(int interval_ms, std::function<void()> cb) {
-    if (led_strip_ == nullptr) {
-        return;
+void CircularStrip::Rainbow(StripColor low, StripColor high, int interval_ms) {
+    LedEffect effect;
+    effect.type = kLedEffectRainbow;
+    effect.frame_ms = interval_ms;
+    effect.low = low;
+    effect.high = high;
+    PlayEffect(effect);
+}
+
+void CircularStrip::SetAudioColor(StripColor color) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        audio_color_ = color;
     }
+    SubscribeAudioLevel();
+}
 
+// Lights a bar proportional to the level, brightened up to 4x over the state color and blended
+// with max over the base layer, so silence leaves the state color untouched. The bar is drawn
+// into level_table_ in place, this runs at the LED frame rate on the esp_timer task
+void CircularStrip::OnAudioLevel(const AudioLevel& level) {
     std::lock_guard<std::mutex> lock(mutex_);
+    int gain = 255 + 3 * level.level;
+    StripColor lit = {
+        static_cast<uint8_t>(std::min(audio_color_.red * gain / 255, 255)),
+        static_cast<uint8_t>(std::min(audio_color_.green * gain / 255, 255)),
+        static_cast<uint8_t>(std::min(audio_color_.blue * gain / 255, 255)),
+    };
+    auto& bar = level_table_->pixels;
+    for (int i = 0; i < max_leds_; i++) {
+        bar[i] = level.level > 0 && i * 255 < level.level * max_leds_ ? lit : StripColor{};
+    }
+
+    auto& layer = layers_[kStripLayerOverlay];
+    if (layer.table != level_table_) {
+        layer.table = level_table_;
+        layer.blend = kStripBlendMax;
+        layer.start_time = esp_timer_get_time();
+    }
     esp_timer_stop(strip_timer_);
-    
-    strip_callback_ = cb;
-    esp_timer_start_periodic(strip_timer_, interval_ms * 1000);
+    Render();
 }
 
 void CircularStrip::SetBrightness(uint8_t default_brightness, uint8_t low_brightness) {
@@ -185,6 +414,10 @@ void CircularStrip::SetBrightness(uint8_t default_brightness, uint8_t low_bright
 void CircularStrip::OnStateChanged() {
     auto& app = Application::GetInstance();
     auto device_state = app.GetDeviceState();
+    if (device_state != kDeviceStateListening && device_state != kDeviceStateSpeaking) {
+        UnsubscribeAudioLevel();
+        PlayLayer(kStripLayerOverlay, nullptr);
+    }
     switch (device_state) {
         case kDeviceStateStarting: {
             StripColor low = { 0, 0, 0 };
@@ -208,11 +441,13 @@ void CircularStrip::OnStateChanged() {
         case kDeviceStateListening: {
             StripColor color = { default_brightness_, low_brightness_, low_brightness_ };
             SetAllColor(color);
+            SetAudioColor(color);
             break;
         }
         case kDeviceStateSpeaking: {
             StripColor color = { low_brightness_, default_brightness_, low_brightness_ };
             SetAllColor(color);
+            SetAudioColor(color);
             break;
         }
         case kDeviceStateUpgrading: {
@@ -2,18 +2,29 @@
 #define _CIRCULAR_STRIP_H_
 
 #include "led.h"
+#include "led_animation.h"
 #include <driver/gpio.h>
-#include <led_strip.h>
+#include <driver/rmt_tx.h>
 #include <esp_timer.h>
 #include <atomic>
+#include <memory>
 #include <mutex>
 #include <vector>
 
 #define DEFAULT_BRIGHTNESS 32
 #define LOW_BRIGHTNESS 4
 
-struct StripColor {
-    uint8_t red = 0, green = 0, blue = 0;
+// Layers are blended from the bottom up, the state effects play on the base layer
+enum StripLayer {
+    kStripLayerBase,
+    kStripLayerOverlay,
+    kStripLayerCount,
+};
+
+enum StripBlend {
+    kStripBlendReplace,     // Non-black pixels of the layer replace the ones below
+    kStripBlendAdd,
+    kStripBlendMax,
 };
 
 class CircularStrip : public Led {
@@ -28,22 +39,46 @@ public:
     void Blink(StripColor color, int interval_ms);
     void Breathe(StripColor low, StripColor high, int interval_ms);
     void Scroll(StripColor low, StripColor high, int length, int interval_ms);
+    // Play a compiled table on a layer, a null table clears the layer
+    void PlayLayer(StripLayer layer, std::shared_ptr<const LedFrameTable> table, StripBlend blend = kStripBlendReplace);
+
+protected:
+    void OnAudioLevel(const AudioLevel& level) override;
 
 private:
+    struct Layer {
+        std::shared_ptr<const LedFrameTable> table;
+        StripBlend blend = kStripBlendReplace;
+        int64_t start_time = 0;
+    };
+
     std::mutex mutex_;
-    TaskHandle_t blink_task_ = nullptr;
-    led_strip_handle_t led_strip_ = nullptr;
     int max_leds_ = 0;
+    // Colors set by SetAllColor / SetSingleColor
     std::vector<StripColor> colors_;
-    int blink_counter_ = 0;
-    int blink_interval_ms_ = 0;
+    // What the strip shows now, FadeOut starts from here
+    std::vector<StripColor> output_;
+    Layer layers_[kStripLayerCount];
+    // Overlay the audio level bar is drawn into, it is only written with mutex_ held
+    std::shared_ptr<LedFrameTable> level_table_;
     esp_timer_handle_t strip_timer_ = nullptr;
-    std::function<void()> strip_callback_ = nullptr;
+
+    // Two GRB buffers, one is filled while the RMT sends the other
+    rmt_channel_handle_t rmt_channel_ = nullptr;
+    rmt_encoder_handle_t rmt_encoder_ = nullptr;
+    std::vector<uint8_t> pixel_buffers_[2];
+    int back_buffer_ = 0;
+    uint32_t frames_sent_ = 0;
+    std::atomic<uint32_t> frames_done_{0};
 
     uint8_t default_brightness_ = DEFAULT_BRIGHTNESS;
     uint8_t low_brightness_ = LOW_BRIGHTNESS;
+    // State color the audio level bar is drawn in
+    StripColor audio_color_;
 
-    void StartStripTask(int interval_ms, std::function<void()> cb);
+    void PlayEffect(const LedEffect& effect);
+    void SetAudioColor(StripColor color);
+    void Render();
     void Rainbow(StripColor low, StripColor high, int interval_ms);
     void FadeOut(int interval_ms);
 };
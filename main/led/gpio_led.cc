@@ -2,6 +2,8 @@
 #include "application.h"
 #include <esp_log.h>
 
+#include <algorithm>
+
 #define TAG "GpioLed"
 
 #define DEFAULT_BRIGHTNESS 50
@@ -13,194 +15,187 @@
 #define UPGRADING_BRIGHTNESS 25
 #define ACTIVATING_BRIGHTNESS 35
 
-#define BLINK_INFINITE -1
-
-// GPIO_LED
-#define LEDC_LS_TIMER          LEDC_TIMER_1
-#define LEDC_LS_MODE           LEDC_LOW_SPEED_MODE
-#define LEDC_LS_CH0_CHANNEL    LEDC_CHANNEL_0
+#define GPIO_LED_PWM_FREQ 4000
+#define GPIO_LED_RESOLUTION LEDC_TIMER_13_BIT
+// Brightness changes between states fade instead of jumping
+#define GPIO_LED_TRANSITION_MS 200
+// Blink edges are fades as well, short enough to look instant
+#define GPIO_LED_EDGE_MS 5
+#define GPIO_LED_BREATHE_PERIOD_MS 2000
+// Upper limit of the cycle count per fade step of the LEDC
+#define GPIO_LED_MAX_CYCLE_NUM 1023
 
-#define LEDC_DUTY              (8191)
-#define LEDC_FADE_TIME    (1000)
-// GPIO_LED
+#define FADE_NOTIFY_END (1 << 0)
+#define FADE_NOTIFY_PATTERN (1 << 1)
+#define FADE_NOTIFY_AUDIO (1 << 2)
 
 GpioLed::GpioLed(gpio_num_t gpio)
-        : GpioLed(gpio, 0, LEDC_LS_TIMER, LEDC_LS_CH0_CHANNEL) {
-}
-
-GpioLed::GpioLed(gpio_num_t gpio, int output_invert)
-        : GpioLed(gpio, output_invert, LEDC_LS_TIMER, LEDC_LS_CH0_CHANNEL) {
+        : GpioLed(gpio, 0) {
 }
 
-GpioLed::GpioLed(gpio_num_t gpio, int output_invert, ledc_timer_t timer_num, ledc_channel_t channel) {
+GpioLed::GpioLed(gpio_num_t gpio, int output_invert) {
     // If the gpio is not connected, you should use NoLed class
     assert(gpio != GPIO_NUM_NC);
 
-    /*
-     * Prepare and set configuration of timers
-     * that will be used by LED Controller
-     */
-    ledc_timer_config_t ledc_timer = {};
-    ledc_timer.duty_resolution = LEDC_TIMER_13_BIT;  // resolution of PWM duty
-    ledc_timer.freq_hz = 4000;                      // frequency of PWM signal
-    ledc_timer.speed_mode = LEDC_LS_MODE;           // timer mode
-    ledc_timer.timer_num = timer_num;               // timer index
-    ledc_timer.clk_cfg = LEDC_AUTO_CLK;              // Auto select the source clock
-
-    ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
-
-    ledc_channel_.channel    = channel,
-    ledc_channel_.duty       = 0,
-    ledc_channel_.gpio_num   = gpio,
-    ledc_channel_.speed_mode = LEDC_LS_MODE,
-    ledc_channel_.hpoint     = 0,
-    ledc_channel_.timer_sel  = timer_num,
-    ledc_channel_.flags.output_invert = output_invert & 0x01,
-
-    // Set LED Controller with previously prepared configuration
-    ledc_channel_config(&ledc_channel_);
-
-    // Initialize fade service.
-    ledc_fade_func_install(0);
-
-    // When the callback registered by ledc_cb_degister is called, run led ->OnFadeEnd()
+    auto& allocator = LedcAllocator::GetInstance();
+    ledc_ = allocator.Allocate(gpio, GPIO_LED_PWM_FREQ, GPIO_LED_RESOLUTION, output_invert & 0x01);
+    if (!ledc_.valid()) {
+        return;
+    }
+    allocator.AcquireFadeService();
+
+    xTaskCreate([](void* arg) {
+        auto led = static_cast<GpioLed*>(arg);
+        led->FadeTask();
+    }, "led_fade", 2048, this, 4, &fade_task_);
+
     ledc_cbs_t ledc_callbacks = {
         .fade_cb = FadeCallback
     };
-    ledc_cb_register(ledc_channel_.speed_mode, ledc_channel_.channel, &ledc_callbacks, this);
-
-    esp_timer_create_args_t blink_timer_args = {
-        .callback = [](void *arg) {
-            auto led = static_cast<GpioLed*>(arg);
-            led->OnBlinkTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "Blink Timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&blink_timer_args, &blink_timer_));
-
-    ledc_initialized_ = true;
+    ledc_cb_register(ledc_.speed_mode, ledc_.channel, &ledc_callbacks, this);
 }
 
 GpioLed::~GpioLed() {
-    esp_timer_stop(blink_timer_);
-    if (ledc_initialized_) {
-        ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-        ledc_fade_func_uninstall();
+    UnsubscribeAudioLevel();
+    if (!ledc_.valid()) {
+        return;
     }
-}
-
-
-void GpioLed::SetBrightness(uint8_t brightness) {
-    if (brightness == 100) {
-        duty_ = LEDC_DUTY;
-    } else {
-        duty_ = brightness * LEDC_DUTY / 100;
+    // Silence the fade interrupt first, it notifies fade_task_
+    ledc_fade_stop(ledc_.speed_mode, ledc_.channel);
+    ledc_cbs_t ledc_callbacks = {
+        .fade_cb = nullptr
+    };
+    ledc_cb_register(ledc_.speed_mode, ledc_.channel, &ledc_callbacks, nullptr);
+    if (fade_task_ != nullptr) {
+        vTaskDelete(fade_task_);
+        fade_task_ = nullptr;
     }
+    auto& allocator = LedcAllocator::GetInstance();
+    allocator.ReleaseFadeService();
+    allocator.Free(ledc_);
 }
 
-void GpioLed::TurnOn() {
-    if (!ledc_initialized_) {
-        return;
-    }
-
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-    ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+void GpioLed::SetBrightness(uint8_t brightness) {
+    duty_ = brightness * ledc_.max_duty / 100;
 }
 
-void GpioLed::TurnOff() {
-    if (!ledc_initialized_) {
+void GpioLed::Play(const LedFadePattern& pattern) {
+    if (fade_task_ == nullptr) {
         return;
     }
-
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-    ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+    taskENTER_CRITICAL(&pattern_lock_);
+    pending_pattern_ = pattern;
+    taskEXIT_CRITICAL(&pattern_lock_);
+    xTaskNotify(fade_task_, FADE_NOTIFY_PATTERN, eSetBits);
 }
 
-void GpioLed::BlinkOnce() {
-    Blink(1, 100);
+void GpioLed::TurnOn() {
+    Play({ { { duty_.load(), GPIO_LED_TRANSITION_MS } }, 1, false });
 }
 
-void GpioLed::Blink(int times, int interval_ms) {
-    StartBlinkTask(times, interval_ms);
+void GpioLed::TurnOff() {
+    Play({ { { 0, GPIO_LED_TRANSITION_MS } }, 1, false });
 }
 
 void GpioLed::StartContinuousBlink(int interval_ms) {
-    StartBlinkTask(BLINK_INFINITE, interval_ms);
-}
-
-void GpioLed::StartBlinkTask(int times, int interval_ms) {
-    if (!ledc_initialized_) {
-        return;
-    }
-
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-
-    blink_counter_ = times * 2;
-    blink_interval_ms_ = interval_ms;
-    esp_timer_start_periodic(blink_timer_, interval_ms * 1000);
-}
+    uint32_t interval = interval_ms;
+    uint32_t duty = duty_;
+    Play({ {
+        { duty, 0 },
+        { duty, interval },
+        { 0, 0 },
+        { 0, interval },
+    }, 4, true });
+}
+
+void GpioLed::StartBreathe(int period_ms) {
+    uint32_t half = period_ms / 2;
+    Play({ { { duty_.load(), half }, { 0, half } }, 2, true });
+}
+
+// Runs only when a segment ended or the pattern changed, all timing is done by the LEDC
+void GpioLed::FadeTask() {
+    while (true) {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, portMAX_DELAY);
+
+        if (bits & FADE_NOTIFY_PATTERN) {
+            taskENTER_CRITICAL(&pattern_lock_);
+            pattern_ = pending_pattern_;
+            taskEXIT_CRITICAL(&pattern_lock_);
+            ledc_fade_stop(ledc_.speed_mode, ledc_.channel);
+            current_duty_ = ledc_get_duty(ledc_.speed_mode, ledc_.channel);
+            segment_ = 0;
+            if (pattern_.count > 0) {
+                StartSegment(pattern_.segments[0]);
+            }
+            continue;
+        }
 
-void GpioLed::OnBlinkTimer() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    blink_counter_--;
-    if (blink_counter_ & 1) {
-        ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
-    } else {
-        ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
+        if ((bits & FADE_NOTIFY_AUDIO) && audio_reactive_) {
+            // Follow the level from wherever the LED is, the state pattern is done
+            ledc_fade_stop(ledc_.speed_mode, ledc_.channel);
+            current_duty_ = ledc_get_duty(ledc_.speed_mode, ledc_.channel);
+            segment_ = pattern_.count;
+            pattern_.loop = false;
+            StartSegment({ audio_duty_, LED_AUDIO_LEVEL_INTERVAL_MS });
+            continue;
+        }
 
-        if (blink_counter_ == 0) {
-            esp_timer_stop(blink_timer_);
+        if (bits & FADE_NOTIFY_END) {
+            if (++segment_ >= pattern_.count) {
+                if (!pattern_.loop) {
+                    continue;
+                }
+                segment_ = 0;
+            }
+            StartSegment(pattern_.segments[segment_]);
         }
     }
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
 }
 
-void GpioLed::StartFadeTask() {
-    if (!ledc_initialized_) {
-        return;
+void GpioLed::StartSegment(const LedFadeSegment& segment) {
+    if (segment.duty == current_duty_ && segment.time_ms > 0) {
+        // Hold the duty: a step fade that moves it by a few LSB, too little to see, still ends
+        // with an interrupt after time_ms
+        uint32_t cycles = std::max<uint32_t>(segment.time_ms * GPIO_LED_PWM_FREQ / 1000, 1);
+        uint32_t steps = (cycles + GPIO_LED_MAX_CYCLE_NUM - 1) / GPIO_LED_MAX_CYCLE_NUM;
+        uint32_t target = segment.duty + steps <= ledc_.max_duty ? segment.duty + steps : segment.duty - steps;
+        ledc_set_fade_with_step(ledc_.speed_mode, ledc_.channel, target, 1, (cycles + steps - 1) / steps);
+    } else {
+        uint32_t time_ms = segment.time_ms > 0 ? segment.time_ms : GPIO_LED_EDGE_MS;
+        ledc_set_fade_with_time(ledc_.speed_mode, ledc_.channel, segment.duty, time_ms);
+        current_duty_ = segment.duty;
     }
-
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-    fade_up_ = true;
-    ledc_set_fade_with_time(ledc_channel_.speed_mode,
-                            ledc_channel_.channel, LEDC_DUTY, LEDC_FADE_TIME);
-    ledc_fade_start(ledc_channel_.speed_mode,
-                    ledc_channel_.channel, LEDC_FADE_NO_WAIT);
-}
-
-void GpioLed::OnFadeEnd() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    fade_up_ = !fade_up_;
-    ledc_set_fade_with_time(ledc_channel_.speed_mode,
-                            ledc_channel_.channel, fade_up_ ? LEDC_DUTY : 0, LEDC_FADE_TIME);
-    ledc_fade_start(ledc_channel_.speed_mode,
-                    ledc_channel_.channel, LEDC_FADE_NO_WAIT);
+    ledc_fade_start(ledc_.speed_mode, ledc_.channel, LEDC_FADE_NO_WAIT);
 }
 
-bool GpioLed::FadeCallback(const ledc_cb_param_t *param, void *user_arg) {
+bool IRAM_ATTR GpioLed::FadeCallback(const ledc_cb_param_t *param, void *user_arg) {
+    BaseType_t woken = pdFALSE;
     if (param->event == LEDC_FADE_END_EVT) {
         auto led = static_cast<GpioLed*>(user_arg);
-        led->OnFadeEnd();
+        xTaskNotifyFromISR(led->fade_task_, FADE_NOTIFY_END, eSetBits, &woken);
+    }
+    return woken == pdTRUE;
+}
+
+// While speaking the brightness follows the playback level, from the state brightness up to full
+void GpioLed::OnAudioLevel(const AudioLevel& level) {
+    if (fade_task_ == nullptr) {
+        return;
     }
-    return true;
+    uint32_t duty = duty_;
+    audio_duty_ = duty + (ledc_.max_duty - duty) * level.level / 255;
+    xTaskNotify(fade_task_, FADE_NOTIFY_AUDIO, eSetBits);
 }
 
 void GpioLed::OnStateChanged() {
     auto& app = Application::GetInstance();
     auto device_state = app.GetDeviceState();
+    audio_reactive_ = device_state == kDeviceStateSpeaking;
+    if (!audio_reactive_) {
+        UnsubscribeAudioLevel();
+    }
     switch (device_state) {
         case kDeviceStateStarting:
             SetBrightness(DEFAULT_BRIGHTNESS);
@@ -225,12 +220,12 @@ void GpioLed::OnStateChanged() {
             } else {
                 SetBrightness(LOW_BRIGHTNESS);
             }
-            // TurnOn();
-            StartFadeTask();
+            StartBreathe(GPIO_LED_BREATHE_PERIOD_MS);
             break;
         case kDeviceStateSpeaking:
             SetBrightness(SPEAKING_BRIGHTNESS);
             TurnOn();
+            SubscribeAudioLevel();
             break;
         case kDeviceStateUpgrading:
             SetBrightness(UPGRADING_BRIGHTNESS);
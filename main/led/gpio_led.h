@@ -4,17 +4,31 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include "led.h"
+#include "ledc_allocator.h"
 #include <driver/gpio.h>
 #include <driver/ledc.h>
-#include <esp_timer.h>
+#include <esp_attr.h>
 #include <atomic>
-#include <mutex>
+
+// Every state is a short list of fade segments played by the LEDC fade unit. The fade-end interrupt
+// wakes a small task that starts the next segment, nothing runs between two segments.
+struct LedFadeSegment {
+    uint32_t duty;
+    uint32_t time_ms;       // 0 jumps to the duty, the same duty as before holds it for time_ms
+};
+
+#define LED_FADE_MAX_SEGMENTS 4
+
+struct LedFadePattern {
+    LedFadeSegment segments[LED_FADE_MAX_SEGMENTS];
+    int count;
+    bool loop;
+};
 
 class GpioLed : public Led {
  public:
     GpioLed(gpio_num_t gpio);
     GpioLed(gpio_num_t gpio, int output_invert);
-    GpioLed(gpio_num_t gpio, int output_invert, ledc_timer_t timer_num, ledc_channel_t channel);
     virtual ~GpioLed();
 
     void OnStateChanged() override;
@@ -22,26 +36,32 @@ class GpioLed : public Led {
     void TurnOff();
     void SetBrightness(uint8_t brightness);
 
+ protected:
+    void OnAudioLevel(const AudioLevel& level) override;
+
  private:
-    std::mutex mutex_;
-    TaskHandle_t blink_task_ = nullptr;
-    ledc_channel_config_t ledc_channel_ = {0};
-    bool ledc_initialized_ = false;
-    uint32_t duty_ = 0;
-    int blink_counter_ = 0;
-    int blink_interval_ms_ = 0;
-    esp_timer_handle_t blink_timer_ = nullptr;
-    bool fade_up_ = true;
-
-    void StartBlinkTask(int times, int interval_ms);
-    void OnBlinkTimer();
-
-    void BlinkOnce();
-    void Blink(int times, int interval_ms);
+    LedcChannel ledc_;
+    TaskHandle_t fade_task_ = nullptr;
+    // Set by OnStateChanged on the main loop, read by OnAudioLevel on the esp_timer task
+    std::atomic<uint32_t> duty_{0};
+
+    // Written by the callers, picked up by the fade task when it is notified
+    portMUX_TYPE pattern_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    LedFadePattern pending_pattern_ = {};
+    std::atomic<bool> audio_reactive_{false};
+    std::atomic<uint32_t> audio_duty_{0};
+
+    // Only touched by the fade task
+    LedFadePattern pattern_ = {};
+    int segment_ = 0;
+    uint32_t current_duty_ = 0;
+
+    void Play(const LedFadePattern& pattern);
     void StartContinuousBlink(int interval_ms);
-    void StartFadeTask();
-    void OnFadeEnd();
-    static bool FadeCallback(const ledc_cb_param_t *param, void *user_arg);
+    void StartBreathe(int period_ms);
+    void FadeTask();
+    void StartSegment(const LedFadeSegment& segment);
+    static bool IRAM_ATTR FadeCallback(const ledc_cb_param_t *param, void *user_arg);
 };
 
 #endif  // _GPIO_LED_H_
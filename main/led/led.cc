@@ -0,0 +1,41 @@
+#include "led.h"
+#include "application.h"
+
+#include <cstring>
+
+Led::~Led() {
+    if (audio_level_timer_ != nullptr) {
+        esp_timer_stop(audio_level_timer_);
+        esp_timer_delete(audio_level_timer_);
+    }
+}
+
+void Led::SubscribeAudioLevel() {
+    if (audio_level_timer_ == nullptr) {
+        esp_timer_create_args_t timer_args = {
+            .callback = [](void* arg) {
+                auto led = static_cast<Led*>(arg);
+                auto level = Application::GetInstance().GetAudioLevel();
+                if (memcmp(&level, &led->last_audio_level_, sizeof(level)) != 0) {
+                    led->last_audio_level_ = level;
+                    led->OnAudioLevel(level);
+                }
+            },
+            .arg = this,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "led_audio_level",
+            .skip_unhandled_events = true,
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &audio_level_timer_));
+    }
+    if (!esp_timer_is_active(audio_level_timer_)) {
+        last_audio_level_ = AudioLevel();
+        esp_timer_start_periodic(audio_level_timer_, LED_AUDIO_LEVEL_INTERVAL_MS * 1000);
+    }
+}
+
+void Led::UnsubscribeAudioLevel() {
+    if (audio_level_timer_ != nullptr) {
+        esp_timer_stop(audio_level_timer_);
+    }
+}
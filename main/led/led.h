@@ -1,11 +1,28 @@
 #ifndef _LED_H_
 #define _LED_H_
 
+#include <esp_timer.h>
+#include "audio_level_meter.h"
+
+// Audio levels are polled at the LED frame rate, not per audio frame
+#define LED_AUDIO_LEVEL_INTERVAL_MS 40
+
 class Led {
 public:
-    virtual ~Led() = default;
+    virtual ~Led();
     // Set the led state based on the device state
     virtual void OnStateChanged() = 0;
+
+protected:
+    // Start calling OnAudioLevel with the playback or microphone level, whichever is active.
+    // Only changes are delivered, from the esp_timer task.
+    void SubscribeAudioLevel();
+    void UnsubscribeAudioLevel();
+    virtual void OnAudioLevel(const AudioLevel& level) {}
+
+private:
+    esp_timer_handle_t audio_level_timer_ = nullptr;
+    AudioLevel last_audio_level_;
 };
 
 
@@ -0,0 +1,162 @@
+#include "led_animation.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#define RAINBOW_HUE_STEPS 64
+
+using led_gamma::kToOutput;
+using led_gamma::kToPerceptual;
+
+static uint8_t MixChannel(uint8_t from, uint8_t to, int step, int steps) {
+    if (step <= 0) {
+        return from;
+    }
+    if (step >= steps) {
+        return to;
+    }
+    int a = kToPerceptual[from];
+    int b = kToPerceptual[to];
+    return kToOutput[a + (b - a) * step / steps];
+}
+
+static StripColor MixColor(StripColor from, StripColor to, int step, int steps) {
+    return {
+        MixChannel(from.red, to.red, step, steps),
+        MixChannel(from.green, to.green, step, steps),
+        MixChannel(from.blue, to.blue, step, steps),
+    };
+}
+
+static StripColor ColorAt(const std::vector<LedKeyframe>& keyframes, bool interpolate, int time_ms) {
+    if (time_ms <= keyframes.front().time_ms) {
+        return keyframes.front().color;
+    }
+    for (size_t i = 1; i < keyframes.size(); i++) {
+        auto& from = keyframes[i - 1];
+        auto& to = keyframes[i];
+        if (time_ms < to.time_ms) {
+            if (!interpolate) {
+                return from.color;
+            }
+            return MixColor(from.color, to.color, time_ms - from.time_ms, to.time_ms - from.time_ms);
+        }
+    }
+    return keyframes.back().color;
+}
+
+static std::shared_ptr<LedFrameTable> NewTable(int frame_ms, int frame_count, int led_count, bool loop) {
+    auto table = std::make_shared<LedFrameTable>();
+    table->frame_ms = std::max(frame_ms, 1);
+    table->frame_count = std::max(frame_count, 1);
+    table->led_count = std::max(led_count, 1);
+    table->loop = loop;
+    table->pixels.resize(table->frame_count * table->led_count);
+    return table;
+}
+
+static void CompileKeyframes(const LedEffect& effect, LedFrameTable& table) {
+    for (int f = 0; f < table.frame_count; f++) {
+        table.pixels[f] = ColorAt(effect.keyframes, effect.interpolate,
+            effect.keyframes.front().time_ms + f * table.frame_ms);
+    }
+}
+
+static void CompileScroll(const LedEffect& effect, LedFrameTable& table) {
+    int leds = table.led_count;
+    for (int f = 0; f < table.frame_count; f++) {
+        StripColor* frame = &table.pixels[f * leds];
+        std::fill(frame, frame + leds, effect.low);
+        for (int j = 0; j < effect.length; j++) {
+            frame[(f + j) % leds] = effect.high;
+        }
+    }
+}
+
+static void CompileRainbow(const LedEffect& effect, LedFrameTable& table) {
+    int leds = table.led_count;
+    int value = kToPerceptual[std::max({effect.high.red, effect.high.green, effect.high.blue})];
+    for (int f = 0; f < table.frame_count; f++) {
+        for (int i = 0; i < leds; i++) {
+            int hue = (f + i * RAINBOW_HUE_STEPS / leds) % RAINBOW_HUE_STEPS;
+            int h6 = hue * 6 * 256 / RAINBOW_HUE_STEPS;
+            int rem = h6 & 0xFF;
+            int rising = kToOutput[value * rem / 255];
+            int falling = kToOutput[value * (255 - rem) / 255];
+            int full = kToOutput[value];
+            int r = 0, g = 0, b = 0;
+            switch (h6 >> 8) {
+                case 0: r = full; g = rising; break;
+                case 1: r = falling; g = full; break;
+                case 2: g = full; b = rising; break;
+                case 3: g = falling; b = full; break;
+                case 4: r = rising; b = full; break;
+                default: r = full; b = falling; break;
+            }
+            table.pixels[f * leds + i] = {
+                static_cast<uint8_t>(std::max<int>(r, effect.low.red)),
+                static_cast<uint8_t>(std::max<int>(g, effect.low.green)),
+                static_cast<uint8_t>(std::max<int>(b, effect.low.blue)),
+            };
+        }
+    }
+}
+
+std::shared_ptr<const LedFrameTable> CompileLedEffect(const LedEffect& effect, int led_count) {
+    switch (effect.type) {
+        case kLedEffectKeyframes: {
+            if (effect.keyframes.empty()) {
+                return CompileLedStatic({StripColor{}});
+            }
+            int duration = effect.keyframes.back().time_ms - effect.keyframes.front().time_ms;
+            int frames = duration / std::max(effect.frame_ms, 1);
+            if (!effect.loop) {
+                // Also show the final keyframe
+                frames++;
+            }
+            auto table = NewTable(effect.frame_ms, frames, 1, effect.loop);
+            CompileKeyframes(effect, *table);
+            return table;
+        }
+        case kLedEffectScroll: {
+            auto table = NewTable(effect.frame_ms, led_count, led_count, effect.loop);
+            CompileScroll(effect, *table);
+            return table;
+        }
+        case kLedEffectRainbow: {
+            auto table = NewTable(effect.frame_ms, RAINBOW_HUE_STEPS, led_count, effect.loop);
+            CompileRainbow(effect, *table);
+            return table;
+        }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<const LedFrameTable> CompileLedStatic(const std::vector<StripColor>& colors) {
+    auto table = NewTable(1, 1, colors.size(), false);
+    std::copy(colors.begin(), colors.end(), table->pixels.begin());
+    return table;
+}
+
+std::shared_ptr<const LedFrameTable> CompileLedFadeOut(const std::vector<StripColor>& colors, int frame_ms) {
+    uint8_t brightest = 0;
+    for (auto& color : colors) {
+        brightest = std::max({brightest, color.red, color.green, color.blue});
+    }
+    // Halving reaches zero after one step per bit, the last frame is all off
+    int frames = 1;
+    while (brightest >> (frames - 1)) {
+        frames++;
+    }
+    auto table = NewTable(frame_ms, frames, colors.size(), false);
+    for (int f = 0; f < frames; f++) {
+        for (size_t i = 0; i < colors.size(); i++) {
+            table->pixels[f * colors.size() + i] = {
+                static_cast<uint8_t>(colors[i].red >> (f + 1)),
+                static_cast<uint8_t>(colors[i].green >> (f + 1)),
+                static_cast<uint8_t>(colors[i].blue >> (f + 1)),
+            };
+        }
+    }
+    return table;
+}
@@ -0,0 +1,99 @@
+#ifndef _LED_ANIMATION_H_
+#define _LED_ANIMATION_H_
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct StripColor {
+    uint8_t red = 0, green = 0, blue = 0;
+};
+
+// Gamma 2.2 tables used to interpolate between colors. Keyframe colors are output values and are
+// shown as is, only the steps in between are spaced evenly in perceived brightness.
+namespace led_gamma {
+
+// x^2.2 = x^2 * x^(1/5), the fifth root is found with Newton's method so the tables stay constexpr
+constexpr double Pow22(double x) {
+    if (x <= 0.0) {
+        return 0.0;
+    }
+    double y = 1.0;
+    for (int i = 0; i < 32; i++) {
+        y -= (y * y * y * y * y - x) / (5.0 * y * y * y * y);
+    }
+    return x * x * y;
+}
+
+constexpr std::array<uint8_t, 256> MakeToOutput() {
+    std::array<uint8_t, 256> table = {};
+    for (int i = 0; i < 256; i++) {
+        table[i] = static_cast<uint8_t>(Pow22(i / 255.0) * 255.0 + 0.5);
+    }
+    return table;
+}
+
+// Smallest perceptual level whose output reaches the value, so ToOutput(ToPerceptual(v)) >= v
+constexpr std::array<uint8_t, 256> MakeToPerceptual(const std::array<uint8_t, 256>& to_output) {
+    std::array<uint8_t, 256> table = {};
+    int level = 0;
+    for (int value = 0; value < 256; value++) {
+        while (level < 255 && to_output[level] < value) {
+            level++;
+        }
+        table[value] = static_cast<uint8_t>(level);
+    }
+    return table;
+}
+
+inline constexpr std::array<uint8_t, 256> kToOutput = MakeToOutput();
+inline constexpr std::array<uint8_t, 256> kToPerceptual = MakeToPerceptual(kToOutput);
+
+static_assert(kToOutput[0] == 0 && kToOutput[255] == 255, "gamma table must keep the end points");
+
+} // namespace led_gamma
+
+// Color for every LED of every frame, computed once when an effect starts so a frame only costs
+// a table lookup and a blend
+struct LedFrameTable {
+    int frame_ms = 0;
+    int frame_count = 0;
+    int led_count = 0;      // 1 when all LEDs show the same color
+    bool loop = false;
+    std::vector<StripColor> pixels;
+
+    const StripColor* Frame(int frame) const { return &pixels[frame * led_count]; }
+};
+
+struct LedKeyframe {
+    int time_ms;
+    StripColor color;
+};
+
+enum LedEffectType {
+    kLedEffectKeyframes,    // The whole strip follows the keyframes
+    kLedEffectScroll,       // A bar of `length` LEDs in `high` moves over `low`
+    kLedEffectRainbow,      // Hue wheel spread around the strip, at the brightness of `high`
+};
+
+struct LedEffect {
+    LedEffectType type = kLedEffectKeyframes;
+    int frame_ms = 50;
+    bool loop = true;
+    // kLedEffectKeyframes: the last keyframe closes the cycle, its color is not shown when looping
+    std::vector<LedKeyframe> keyframes;
+    bool interpolate = true;
+    // kLedEffectScroll / kLedEffectRainbow
+    StripColor low;
+    StripColor high;
+    int length = 1;
+};
+
+std::shared_ptr<const LedFrameTable> CompileLedEffect(const LedEffect& effect, int led_count);
+// One frame that holds the given colors until replaced
+std::shared_ptr<const LedFrameTable> CompileLedStatic(const std::vector<StripColor>& colors);
+// Halve the colors every frame until they are off, like the idle fade of the ring
+std::shared_ptr<const LedFrameTable> CompileLedFadeOut(const std::vector<StripColor>& colors, int frame_ms);
+
+#endif // _LED_ANIMATION_H_
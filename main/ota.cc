@@ -14,13 +14,23 @@
 #include <esp_hmac.h>
 #endif
 
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
 #include <cstring>
+#include <memory>
 #include <vector>
 #include <sstream>
 #include <algorithm>
 
 #define TAG "Ota"
 
+#define OTA_WRITER_TASK_PRIORITY 3
+// Enough of the image to read its app description
+#define OTA_IMAGE_HEADER_SIZE (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+// Resume attempts in a row that receive nothing, the wait grows by a second each time
+#define OTA_MAX_RESUMES 5
+
 
 Ota::Ota() {
     SetCheckVersionUrl(CONFIG_OTA_VERSION_URL);
@@ -83,6 +93,9 @@ bool Ota::CheckVersion() {
     }
 
     auto http = SetupHttp();
+    // The server may answer with firmware.patch_url, a patch against this build, or
+    // firmware.compressed_url, a deflated image (see scripts/ota_delta.py)
+    http->SetHeader("Ota-Features", "delta,deflate");
 
     std::string data = board.GetJson();
     std::string method = data.length() > 0 ? "POST" : "GET";
@@ -178,6 +191,10 @@ bool Ota::CheckVersion() {
         if (url != NULL) {
             firmware_url_ = url->valuestring;
         }
+        cJSON *patch_url = cJSON_GetObjectItem(firmware, "patch_url");
+        firmware_patch_url_ = cJSON_IsString(patch_url) ? patch_url->valuestring : "";
+        cJSON *compressed_url = cJSON_GetObjectItem(firmware, "compressed_url");
+        firmware_compressed_url_ = cJSON_IsString(compressed_url) ? compressed_url->valuestring : "";
 
         if (version != NULL && url != NULL) {
             // Check if the version is newer, for example, 0.1.0 is newer than 0.0.1
@@ -218,95 +235,331 @@ void Ota::MarkCurrentVersionValid() {
     }
 }
 
-void Ota::Upgrade(const std::string& firmware_url) {
-    ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
-    esp_ota_handle_t update_handle = 0;
-    auto update_partition = esp_ota_get_next_update_partition(NULL);
-    if (update_partition == NULL) {
-        ESP_LOGE(TAG, "Failed to get update partition");
+OtaWriter::OtaWriter() {
+    for (int i = 0; i < OTA_CHUNK_COUNT; i++) {
+        auto data = (uint8_t*)heap_caps_malloc(OTA_CHUNK_SIZE, MALLOC_CAP_SPIRAM);
+        if (data == nullptr) {
+            data = (uint8_t*)heap_caps_malloc(OTA_CHUNK_SIZE, MALLOC_CAP_8BIT);
+        }
+        if (data == nullptr) {
+            break;
+        }
+        chunks_.push_back({data, 0});
+    }
+    if (chunks_.empty()) {
+        ESP_LOGE(TAG, "Failed to allocate OTA buffers");
         return;
     }
 
-    ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
+    free_queue_ = xQueueCreate(chunks_.size(), sizeof(OtaChunk*));
+    full_queue_ = xQueueCreate(chunks_.size() + 1, sizeof(OtaChunk*));
+    done_ = xSemaphoreCreateBinary();
+    chunk_done_ = xSemaphoreCreateBinary();
+    for (auto& chunk : chunks_) {
+        OtaChunk* item = &chunk;
+        xQueueSend(free_queue_, &item, 0);
+    }
+    xTaskCreate([](void* arg) {
+        auto writer = (OtaWriter*)arg;
+        writer->WriterLoop();
+        xSemaphoreGive(writer->done_);
+        vTaskDelete(NULL);
+    }, "ota_writer", 4096, this, OTA_WRITER_TASK_PRIORITY, nullptr);
+    ESP_LOGI(TAG, "OTA pipeline: %u buffers of %u bytes", (unsigned)chunks_.size(), (unsigned)OTA_CHUNK_SIZE);
+}
 
-    auto http = Board::GetInstance().CreateHttp();
-    if (!http->Open("GET", firmware_url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
-        delete http;
-        return;
+OtaWriter::~OtaWriter() {
+    if (!chunks_.empty()) {
+        OtaChunk* stop = nullptr;
+        xQueueSend(full_queue_, &stop, portMAX_DELAY);
+        xSemaphoreTake(done_, portMAX_DELAY);
+        vSemaphoreDelete(done_);
+        vSemaphoreDelete(chunk_done_);
+        vQueueDelete(free_queue_);
+        vQueueDelete(full_queue_);
+    }
+    for (auto& chunk : chunks_) {
+        heap_caps_free(chunk.data);
     }
+}
 
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
-        delete http;
-        return;
+OtaChunk* OtaWriter::Acquire() {
+    OtaChunk* chunk = nullptr;
+    if (chunks_.empty() || failed_) {
+        return nullptr;
     }
+    xQueueReceive(free_queue_, &chunk, portMAX_DELAY);
+    chunk->size = 0;
+    return chunk;
+}
 
-    char buffer[512];
-    size_t total_read = 0, recent_read = 0;
-    auto last_calc_time = esp_timer_get_time();
-    while (true) {
-        int ret = http->Read(buffer, sizeof(buffer));
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            delete http;
-            return;
+void OtaWriter::Submit(OtaChunk* chunk) {
+    submitted_ += chunk->size;
+    xQueueSend(full_queue_, &chunk, portMAX_DELAY);
+}
+
+size_t OtaWriter::Flush() {
+    // A stale give from an earlier chunk only costs one more check, the writer gives after
+    // updating written_ or failed_, so the last chunk is never missed
+    while (!failed_ && written_ < submitted_) {
+        xSemaphoreTake(chunk_done_, portMAX_DELAY);
+    }
+    return written_;
+}
+
+void OtaWriter::WriterLoop() {
+    OtaChunk* chunk = nullptr;
+    while (xQueueReceive(full_queue_, &chunk, portMAX_DELAY) == pdTRUE && chunk != nullptr) {
+        // After a failure the chunks still go back, so the network side never blocks on a dead writer
+        if (!failed_ && chunk->size > 0) {
+            if (patcher_ != nullptr) {
+                failed_ = !patcher_->Feed(chunk->data, chunk->size);
+            } else {
+                auto err = esp_ota_write(handle_, chunk->data, chunk->size);
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+                    failed_ = true;
+                }
+            }
+            if (!failed_) {
+                written_ += chunk->size;
+            }
         }
+        xQueueSend(free_queue_, &chunk, portMAX_DELAY);
+        xSemaphoreGive(chunk_done_);
+    }
+}
+
+// Reads the app description in the first OTA_IMAGE_HEADER_SIZE bytes of an image, false if it is
+// the running version
+static bool IsNewImage(const uint8_t* image) {
+    esp_app_desc_t new_app_info;
+    memcpy(&new_app_info, image + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
+    ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
 
-        // Calculate speed and progress every second
-        recent_read += ret;
-        total_read += ret;
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
-            size_t progress = total_read * 100 / content_length;
-            ESP_LOGI(TAG, "Progress: %zu%% (%zu/%zu), Speed: %zuB/s", progress, total_read, content_length, recent_read);
-            if (upgrade_callback_) {
-                upgrade_callback_(progress, recent_read);
+    auto current_version = esp_app_get_description()->version;
+    if (memcmp(new_app_info.version, current_version, sizeof(new_app_info.version)) == 0) {
+        ESP_LOGE(TAG, "Firmware version is the same, skipping upgrade");
+        return false;
+    }
+    return true;
+}
+
+// Checks the app description in the first bytes of the image and starts writing the partition
+bool Ota::BeginUpgrade(const uint8_t* image, const esp_partition_t* partition, esp_ota_handle_t& handle) {
+    if (!IsNewImage(image)) {
+        return false;
+    }
+
+    if (esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &handle)) {
+        esp_ota_abort(handle);
+        handle = 0;
+        ESP_LOGE(TAG, "Failed to begin OTA");
+        return false;
+    }
+    return true;
+}
+
+// Reads the image or patch into the writer's buffers while the writer task erases and programs the
+// flash. begin gets the first header_size bytes before anything is written. A dropped connection
+// waits for the writer to flush everything received, then continues from that offset with an HTTP
+// Range request.
+bool Ota::Download(const std::string& url, OtaWriter& writer, size_t header_size, std::function<bool(const uint8_t* header)> begin) {
+    bool started = false;
+    size_t content_length = 0;
+    size_t received = 0;
+    size_t recent_read = 0;
+    auto last_calc_time = esp_timer_get_time();
+    OtaChunk* chunk = nullptr;
+
+    // Only connections that deliver nothing count against the limit, a long download may drop many times
+    int failures = 0;
+    for (int attempt = 0; failures <= OTA_MAX_RESUMES; attempt++) {
+        if (attempt > 0) {
+            if (!started) {
+                // Nothing is in flash before the header was checked, start over
+                received = 0;
+                if (chunk != nullptr) {
+                    chunk->size = 0;
+                }
+            } else {
+                if (chunk != nullptr) {
+                    writer.Submit(chunk);
+                    chunk = nullptr;
+                }
+                received = writer.Flush();
+                if (writer.failed()) {
+                    return false;
+                }
             }
-            last_calc_time = esp_timer_get_time();
-            recent_read = 0;
+            ESP_LOGW(TAG, "Resuming download at %zu/%zu, attempt %d", received, content_length, attempt);
+            vTaskDelay(pdMS_TO_TICKS(1000 * failures));
         }
+        size_t received_at_open = received;
 
-        if (ret == 0) {
-            break;
+        std::unique_ptr<Http> http(Board::GetInstance().CreateHttp());
+        if (received > 0) {
+            http->SetHeader("Range", "bytes=" + std::to_string(received) + "-");
+        }
+        if (!http->Open("GET", url)) {
+            ESP_LOGE(TAG, "Failed to open HTTP connection");
+            failures++;
+            continue;
         }
 
-        if (!image_header_checked) {
-            image_header.append(buffer, ret);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
-                ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
-
-                auto current_version = esp_app_get_description()->version;
-                if (memcmp(new_app_info.version, current_version, sizeof(new_app_info.version)) == 0) {
-                    ESP_LOGE(TAG, "Firmware version is the same, skipping upgrade");
-                    delete http;
-                    return;
-                }
+        // A server without range support sends the whole image again, skip what is already in flash
+        size_t skip = 0;
+        size_t body_length = http->GetBodyLength();
+        if (received > 0 && http->GetStatusCode() != 206) {
+            skip = received;
+            body_length = body_length > received ? body_length - received : 0;
+        }
+        if (content_length == 0) {
+            content_length = body_length;
+        } else if (received + body_length != content_length) {
+            ESP_LOGE(TAG, "Image size changed from %zu to %zu", content_length, received + body_length);
+            return false;
+        }
+        if (content_length == 0) {
+            ESP_LOGE(TAG, "Failed to get content length");
+            return false;
+        }
 
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    delete http;
-                    ESP_LOGE(TAG, "Failed to begin OTA");
-                    return;
+        while (received < content_length) {
+            if (chunk == nullptr) {
+                chunk = writer.Acquire();
+                if (chunk == nullptr) {
+                    return false;
                 }
+            }
+            int ret = http->Read((char*)chunk->data + chunk->size, OTA_CHUNK_SIZE - chunk->size);
+            if (ret <= 0) {
+                ESP_LOGW(TAG, "Connection lost at %zu/%zu: %s", received, content_length, esp_err_to_name(ret));
+                break;
+            }
+            if (skip > 0) {
+                size_t dropped = std::min<size_t>(skip, ret);
+                memmove(chunk->data + chunk->size, chunk->data + chunk->size + dropped, ret - dropped);
+                skip -= dropped;
+                ret -= dropped;
+            }
+            chunk->size += ret;
+            received += ret;
+            recent_read += ret;
+
+            // Calculate speed and progress every second
+            if (esp_timer_get_time() - last_calc_time >= 1000000 || received == content_length) {
+                size_t progress = received * 100 / content_length;
+                ESP_LOGI(TAG, "Progress: %zu%% (%zu/%zu, %zu in flash), Speed: %zuB/s", progress, received, content_length,
+                    writer.written(), recent_read);
+                if (upgrade_callback_) {
+                    upgrade_callback_(progress, recent_read);
+                }
+                last_calc_time = esp_timer_get_time();
+                recent_read = 0;
+            }
 
-                image_header_checked = true;
-                std::string().swap(image_header);
+            if (!started && chunk->size >= header_size) {
+                if (!begin(chunk->data)) {
+                    return false;
+                }
+                started = true;
+            }
+            if (chunk->size == OTA_CHUNK_SIZE || received == content_length) {
+                if (!started) {
+                    ESP_LOGE(TAG, "Image is too small");
+                    return false;
+                }
+                writer.Submit(chunk);
+                chunk = nullptr;
+                if (writer.failed()) {
+                    return false;
+                }
             }
         }
-        auto err = esp_ota_write(update_handle, buffer, ret);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+
+        if (received == content_length) {
+            return writer.Flush() == content_length;
+        }
+        failures = received > received_at_open ? 0 : failures + 1;
+    }
+    ESP_LOGE(TAG, "Download failed, no progress in %d attempts", OTA_MAX_RESUMES + 1);
+    return false;
+}
+
+// Patches and compressed images share one format, see scripts/ota_delta.py. On failure nothing is
+// left open, so the caller can try the next source. The rebuilt image gets the same version check
+// as a plain one before its first byte is written, same_version tells the caller to stop trying.
+bool Ota::DownloadPatch(const std::string& url, const esp_partition_t* partition, esp_ota_handle_t& handle, bool& same_version) {
+    DeltaPatcher patcher;
+    patcher.set_image_check([&same_version](const uint8_t* image, size_t size) {
+        if (size < OTA_IMAGE_HEADER_SIZE) {
+            ESP_LOGE(TAG, "Image is too small");
+            return false;
+        }
+        same_version = !IsNewImage(image);
+        return !same_version;
+    });
+    bool downloaded;
+    {
+        OtaWriter writer;
+        writer.set_patcher(&patcher);
+        downloaded = writer.valid() && Download(url, writer, sizeof(DeltaPatchHeader), [&](const uint8_t* header) {
+            if (esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &handle) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to begin OTA");
+                return false;
+            }
+            return patcher.Begin(header, handle);
+        });
+    }
+    downloaded = downloaded && patcher.Finish();
+    if (!downloaded && handle != 0) {
+        esp_ota_abort(handle);
+        handle = 0;
+    }
+    return downloaded;
+}
+
+void Ota::Upgrade(const std::string& firmware_url) {
+    auto update_partition = esp_ota_get_next_update_partition(NULL);
+    if (update_partition == NULL) {
+        ESP_LOGE(TAG, "Failed to get update partition");
+        return;
+    }
+    ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
+
+    esp_ota_handle_t update_handle = 0;
+    bool downloaded = false;
+    bool same_version = false;
+
+    // A patch against the running firmware is a fraction of the image, a compressed image works from
+    // any version, the plain image is the last resort
+    if (!firmware_patch_url_.empty()) {
+        ESP_LOGI(TAG, "Upgrading firmware with patch %s", firmware_patch_url_.c_str());
+        downloaded = DownloadPatch(firmware_patch_url_, update_partition, update_handle, same_version);
+    }
+    if (!downloaded && !same_version && !firmware_compressed_url_.empty()) {
+        ESP_LOGI(TAG, "Upgrading firmware from compressed image %s", firmware_compressed_url_.c_str());
+        downloaded = DownloadPatch(firmware_compressed_url_, update_partition, update_handle, same_version);
+    }
+
+    if (!downloaded && !same_version) {
+        ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
+        OtaWriter writer;
+        downloaded = writer.valid() && Download(firmware_url, writer, OTA_IMAGE_HEADER_SIZE, [&](const uint8_t* header) {
+            if (!BeginUpgrade(header, update_partition, update_handle)) {
+                return false;
+            }
+            writer.set_handle(update_handle);
+            return true;
+        });
+    }
+    if (!downloaded) {
+        if (update_handle != 0) {
             esp_ota_abort(update_handle);
-            delete http;
-            return;
         }
+        return;
     }
-    delete http;
 
     esp_err_t err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
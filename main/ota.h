@@ -4,9 +4,65 @@
 #include <functional>
 #include <string>
 #include <map>
+#include <vector>
+#include <atomic>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <esp_err.h>
+#include <esp_ota_ops.h>
 #include "board.h"
+#include "delta_patch.h"
+
+#if CONFIG_SPIRAM
+#define OTA_CHUNK_SIZE (64 * 1024)
+#define OTA_CHUNK_COUNT 4
+#else
+#define OTA_CHUNK_SIZE (8 * 1024)
+#define OTA_CHUNK_COUNT 2
+#endif
+
+struct OtaChunk {
+    uint8_t* data;
+    size_t size;
+};
+
+// Flash side of the download pipeline. The network side fills free chunks and submits them, a
+// task writes them to the partition so erasing and programming overlap with the next HTTP read.
+class OtaWriter {
+public:
+    OtaWriter();
+    ~OtaWriter();
+
+    bool valid() const { return !chunks_.empty(); }
+    bool failed() const { return failed_; }
+    size_t written() const { return written_; }
+    void set_handle(esp_ota_handle_t handle) { handle_ = handle; }
+    // Chunks go through the patcher instead of straight to the partition
+    void set_patcher(DeltaPatcher* patcher) { patcher_ = patcher; }
+
+    // Blocks until a chunk is free, returns nullptr after a write error
+    OtaChunk* Acquire();
+    void Submit(OtaChunk* chunk);
+    // Waits until every submitted byte is in flash, returns the number of bytes written
+    size_t Flush();
+
+private:
+    std::vector<OtaChunk> chunks_;
+    QueueHandle_t free_queue_ = nullptr;
+    QueueHandle_t full_queue_ = nullptr;
+    SemaphoreHandle_t done_ = nullptr;
+    // Given by the writer task after every chunk, Flush waits on it
+    SemaphoreHandle_t chunk_done_ = nullptr;
+    esp_ota_handle_t handle_ = 0;
+    DeltaPatcher* patcher_ = nullptr;
+    size_t submitted_ = 0;
+    std::atomic<size_t> written_{0};
+    std::atomic<bool> failed_{false};
+
+    void WriterLoop();
+};
 
 class Ota {
 public:
@@ -43,12 +99,17 @@ private:
     std::string current_version_;
     std::string firmware_version_;
     std::string firmware_url_;
+    std::string firmware_patch_url_;
+    std::string firmware_compressed_url_;
     std::string activation_challenge_;
     std::string serial_number_;
     int activation_timeout_ms_ = 30000;
     std::map<std::string, std::string> headers_;
 
     void Upgrade(const std::string& firmware_url);
+    bool BeginUpgrade(const uint8_t* image, const esp_partition_t* partition, esp_ota_handle_t& handle);
+    bool DownloadPatch(const std::string& url, const esp_partition_t* partition, esp_ota_handle_t& handle, bool& same_version);
+    bool Download(const std::string& url, OtaWriter& writer, size_t header_size, std::function<bool(const uint8_t* header)> begin);
     std::function<void(int progress, size_t speed)> upgrade_callback_;
     std::vector<int> ParseVersion(const std::string& version);
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
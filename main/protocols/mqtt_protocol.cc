@@ -179,7 +179,9 @@ bool MqttProtocol::OpenAudioChannel() {
     message += "\"transport\":\"udp\",";
     message += "\"audio_params\":{";
     message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
+    message += "}";
+    AppendIotHello(message);
+    message += "}";
     if (!SendText(message)) {
         return false;
     }
@@ -255,6 +257,8 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
+    ParseIotHello(root);
+
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (audio_params != NULL) {
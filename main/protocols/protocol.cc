@@ -65,49 +65,41 @@ void Protocol::SendStopListening() {
     SendText(message);
 }
 
-void Protocol::SendIotDescriptors(const std::string& descriptors) {
-    cJSON* root = cJSON_Parse(descriptors.c_str());
-    if (root == nullptr) {
-        ESP_LOGE(TAG, "Failed to parse IoT descriptors: %s", descriptors.c_str());
-        return;
+void Protocol::SetIotDescriptorsHash(const std::string& hash) {
+    iot_descriptors_hash_ = hash;
+}
+
+void Protocol::AppendIotHello(std::string& message) const {
+    if (!iot_descriptors_hash_.empty()) {
+        message += ",\"iot\":{\"descriptors_hash\":\"" + iot_descriptors_hash_ + "\"}";
     }
+}
 
-    if (!cJSON_IsArray(root)) {
-        ESP_LOGE(TAG, "IoT descriptors should be an array");
-        cJSON_Delete(root);
-        return;
+void Protocol::ParseIotHello(const cJSON* root) {
+    server_iot_descriptors_hash_.clear();
+    auto iot = cJSON_GetObjectItem(root, "iot");
+    auto hash = cJSON_GetObjectItem(iot, "descriptors_hash");
+    if (cJSON_IsString(hash)) {
+        server_iot_descriptors_hash_ = hash->valuestring;
     }
+}
 
-    int arraySize = cJSON_GetArraySize(root);
-    for (int i = 0; i < arraySize; ++i) {
-        cJSON* descriptor = cJSON_GetArrayItem(root, i);
-        if (descriptor == nullptr) {
-            ESP_LOGE(TAG, "Failed to get IoT descriptor at index %d", i);
-            continue;
-        }
-
-        cJSON* messageRoot = cJSON_CreateObject();
-        cJSON_AddStringToObject(messageRoot, "session_id", session_id_.c_str());
-        cJSON_AddStringToObject(messageRoot, "type", "iot");
-        cJSON_AddBoolToObject(messageRoot, "update", true);
-
-        cJSON* descriptorArray = cJSON_CreateArray();
-        cJSON_AddItemToArray(descriptorArray, cJSON_Duplicate(descriptor, 1));
-        cJSON_AddItemToObject(messageRoot, "descriptors", descriptorArray);
-
-        char* message = cJSON_PrintUnformatted(messageRoot);
-        if (message == nullptr) {
-            ESP_LOGE(TAG, "Failed to print JSON message for IoT descriptor at index %d", i);
-            cJSON_Delete(messageRoot);
-            continue;
-        }
-
-        SendText(std::string(message));
-        cJSON_free(message);
-        cJSON_Delete(messageRoot);
+void Protocol::SendIotDescriptors(const std::string& descriptors, const std::string& hash) {
+    if (!hash.empty() && hash == server_iot_descriptors_hash_) {
+        ESP_LOGI(TAG, "Server already holds IoT descriptors %s", hash.c_str());
+        return;
     }
 
-    cJSON_Delete(root);
+    std::string message;
+    message.reserve(descriptors.size() + session_id_.size() + hash.size() + 96);
+    message += "{\"session_id\":\"" + session_id_ + "\",\"type\":\"iot\",\"update\":true";
+    if (!hash.empty()) {
+        message += ",\"descriptors_hash\":\"" + hash + "\"";
+    }
+    message += ",\"descriptors\":";
+    message += descriptors;
+    message += "}";
+    SendText(message);
 }
 
 void Protocol::SendIotStates(const std::string& states) {
@@ -115,6 +107,11 @@ void Protocol::SendIotStates(const std::string& states) {
     SendText(message);
 }
 
+void Protocol::SendIotResult(const std::string& result) {
+    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"iot\",\"result\":" + result + "}";
+    SendText(message);
+}
+
 bool Protocol::IsTimeout() const {
     const int kTimeoutSeconds = 120;
     auto now = std::chrono::steady_clock::now();
@@ -54,8 +54,12 @@ public:
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
-    virtual void SendIotDescriptors(const std::string& descriptors);
+    // Advertised in the client hello, the server answers with the hash of the descriptors it holds
+    void SetIotDescriptorsHash(const std::string& hash);
+    // Sends all descriptors in one message, or nothing if the server already holds this hash
+    virtual void SendIotDescriptors(const std::string& descriptors, const std::string& hash);
     virtual void SendIotStates(const std::string& states);
+    virtual void SendIotResult(const std::string& result);
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
@@ -69,11 +73,15 @@ protected:
     bool error_occurred_ = false;
     bool busy_sending_audio_ = false;
     std::string session_id_;
+    std::string iot_descriptors_hash_;
+    std::string server_iot_descriptors_hash_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
 
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    void AppendIotHello(std::string& message) const;
+    void ParseIotHello(const cJSON* root);
 };
 
 #endif // PROTOCOL_H
@@ -121,7 +121,9 @@ bool WebsocketProtocol::OpenAudioChannel() {
     message += "\"transport\":\"websocket\",";
     message += "\"audio_params\":{";
     message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
+    message += "}";
+    AppendIotHello(message);
+    message += "}";
     if (!SendText(message)) {
         return false;
     }
@@ -148,6 +150,8 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         return;
     }
 
+    ParseIotHello(root);
+
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (audio_params != NULL) {
         auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
@@ -0,0 +1,43 @@
+// Time AudioLevelMeter::Process on the frames it sees on the device: 60 ms of decoded TTS at
+// 24 kHz in the output task, and 30 ms microphone reads at 16 kHz, mono or with a reference channel
+#include "audio_level_meter.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#define BENCH_AUDIO_SECONDS 60
+
+static std::vector<int16_t> MakeTone(int sample_rate, int channels, int duration_ms, float frequency, float amplitude) {
+    std::vector<int16_t> pcm(sample_rate * duration_ms / 1000 * channels);
+    for (size_t i = 0; i < pcm.size() / channels; i++) {
+        float t = (float)i / sample_rate;
+        pcm[i * channels] = (int16_t)(amplitude * 32767 * sinf(2 * (float)M_PI * frequency * t));
+    }
+    return pcm;
+}
+
+static void Bench(const char* name, int sample_rate, int channels, int duration_ms) {
+    AudioLevelMeter meter(name);
+    auto tone = MakeTone(sample_rate, channels, duration_ms, 600, 0.5f);
+    int frames = BENCH_AUDIO_SECONDS * 1000 / duration_ms;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        meter.Process(tone.data(), tone.size(), sample_rate, channels);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double us = std::chrono::duration<double, std::micro>(elapsed).count() / frames;
+
+    auto level = meter.level();
+    printf("%-22s %6.2f us per %d ms frame  level %3d  bands %3d %3d %3d %3d\n", name, us, duration_ms,
+        level.level, level.bands[0], level.bands[1], level.bands[2], level.bands[3]);
+}
+
+int main() {
+    Bench("output 24kHz mono", 24000, 1, 60);
+    Bench("input 16kHz mono", 16000, 1, 30);
+    Bench("input 16kHz + ref", 16000, 2, 30);
+    return 0;
+}
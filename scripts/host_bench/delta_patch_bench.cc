@@ -0,0 +1,93 @@
+// Rebuild an image from a patch or a compressed image made by scripts/ota_delta.py with the device's
+// DeltaPatcher and the tinfl inflater, to see how fast it decodes compared to the flash writes.
+// Flash writes cost nothing here, the DeltaPatch log line reports the decode time alone.
+//
+//   delta_patch_bench firmware.patch old.bin
+//   delta_patch_bench firmware.compressed.bin
+#include "delta_patch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+// Size of the pieces the OTA writer task feeds to the patcher
+#define BENCH_FEED_SIZE (8 * 1024)
+#define BENCH_MIN_SECONDS 1.0
+
+static esp_partition_t running_partition = { "ota_0", 0, nullptr };
+static size_t bytes_written = 0;
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size) {
+    if (offset + size > partition->size) {
+        return ESP_FAIL;
+    }
+    memcpy(dst, partition->data + offset, size);
+    return ESP_OK;
+}
+
+const esp_partition_t* esp_ota_get_running_partition() {
+    return &running_partition;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size) {
+    bytes_written += size;
+    return ESP_OK;
+}
+
+static bool ReadFile(const char* path, std::vector<uint8_t>& data) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static bool Rebuild(const std::vector<uint8_t>& patch) {
+    DeltaPatcher patcher;
+    if (patch.size() < sizeof(DeltaPatchHeader) || !patcher.Begin(patch.data(), 1)) {
+        return false;
+    }
+    for (size_t offset = 0; offset < patch.size(); offset += BENCH_FEED_SIZE) {
+        if (!patcher.Feed(patch.data() + offset, std::min<size_t>(BENCH_FEED_SIZE, patch.size() - offset))) {
+            return false;
+        }
+    }
+    return patcher.Finish();
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2 && argc != 3) {
+        printf("usage: delta_patch_bench patch [source.bin]\n");
+        return 1;
+    }
+    std::vector<uint8_t> patch, source;
+    if (!ReadFile(argv[1], patch) || (argc == 3 && !ReadFile(argv[2], source))) {
+        return 1;
+    }
+    running_partition.data = source.data();
+    running_partition.size = source.size();
+
+    int rounds = 0;
+    double seconds = 0;
+    while (seconds < BENCH_MIN_SECONDS) {
+        bytes_written = 0;
+        auto start = std::chrono::steady_clock::now();
+        if (!Rebuild(patch)) {
+            printf("Patch failed\n");
+            return 1;
+        }
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        rounds++;
+    }
+
+    double kbps = bytes_written / 1024.0 * rounds / seconds;
+    printf("patch %zu bytes -> image %zu bytes, %.1f ms per rebuild, %.0f KB/s\n", patch.size(), bytes_written,
+        seconds * 1000 / rounds, kbps);
+    return 0;
+}
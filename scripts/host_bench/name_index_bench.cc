@@ -0,0 +1,85 @@
+// Time the name resolution of IoT command batches, the thing then the method of every command,
+// through NameIndex as ThingManager::Invoke and Thing::PrepareCall do, against the linear scan
+// with string compares they replaced
+#include "iot/thing.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#define BENCH_METHODS_PER_THING 10
+#define BENCH_BATCH_SIZE 1000
+#define BENCH_ROUNDS 1000
+
+using namespace iot;
+
+struct Command {
+    std::string thing;
+    std::string method;
+};
+
+// Names share a long prefix, like the descriptive names boards tend to use
+static std::string ThingName(int i) { return "BoardPeripheralThing" + std::to_string(i); }
+static std::string MethodName(int i) { return "SetPeripheralValue" + std::to_string(i); }
+
+template <typename Resolve>
+static double Time(const std::vector<Command>& batch, Resolve&& resolve, long& checksum) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (auto& command : batch) {
+            checksum += resolve(command);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / BENCH_ROUNDS / batch.size();
+}
+
+static void Bench(int thing_count) {
+    std::vector<std::string> thing_names;
+    NameIndex thing_index;
+    std::vector<MethodList> methods(thing_count);
+    std::vector<std::vector<std::string>> method_names(thing_count);
+    for (int t = 0; t < thing_count; t++) {
+        thing_index.Add(HashName(ThingName(t)), thing_names.size());
+        thing_names.push_back(ThingName(t));
+        for (int m = 0; m < BENCH_METHODS_PER_THING; m++) {
+            methods[t].AddMethod(MethodName(m), "", ParameterList(), [](const ParameterList&) {});
+            method_names[t].push_back(MethodName(m));
+        }
+    }
+
+    std::vector<Command> batch;
+    for (int i = 0; i < BENCH_BATCH_SIZE; i++) {
+        batch.push_back({ThingName(i * 7 % thing_count), MethodName(i * 3 % BENCH_METHODS_PER_THING)});
+    }
+
+    long indexed_sum = 0, linear_sum = 0;
+    double indexed_ns = Time(batch, [&](const Command& command) {
+        int thing = thing_index.Find(HashName(command.thing), command.thing, [&](size_t i) -> const std::string& {
+            return thing_names[i];
+        });
+        return thing * BENCH_METHODS_PER_THING + methods[thing].Find(command.method);
+    }, indexed_sum);
+    double linear_ns = Time(batch, [&](const Command& command) {
+        int thing = 0;
+        while (thing_names[thing] != command.thing) {
+            thing++;
+        }
+        int method = 0;
+        while (method_names[thing][method] != command.method) {
+            method++;
+        }
+        return thing * BENCH_METHODS_PER_THING + method;
+    }, linear_sum);
+
+    printf("%4d things x %d methods  index %6.1f ns  linear %6.1f ns per command%s\n", thing_count,
+        BENCH_METHODS_PER_THING, indexed_ns, linear_ns, indexed_sum == linear_sum ? "" : "  MISMATCH");
+}
+
+int main() {
+    for (int things : {4, 16, 40, 200}) {
+        Bench(things);
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef HOST_BENCH_CJSON_H
+#define HOST_BENCH_CJSON_H
+
+// The benchmarks only use declarations that take cJSON pointers
+struct cJSON;
+
+#endif
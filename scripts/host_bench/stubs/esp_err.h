@@ -0,0 +1,13 @@
+#ifndef HOST_BENCH_ESP_ERR_H
+#define HOST_BENCH_ESP_ERR_H
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+inline const char* esp_err_to_name(esp_err_t err) {
+    return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+#endif
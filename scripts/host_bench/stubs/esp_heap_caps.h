@@ -0,0 +1,18 @@
+#ifndef HOST_BENCH_ESP_HEAP_CAPS_H
+#define HOST_BENCH_ESP_HEAP_CAPS_H
+
+#include <cstddef>
+#include <cstdlib>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+inline void* heap_caps_malloc(size_t size, int caps) {
+    return malloc(size);
+}
+
+inline void heap_caps_free(void* ptr) {
+    free(ptr);
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef HOST_BENCH_ESP_LOG_H
+#define HOST_BENCH_ESP_LOG_H
+
+#include <cstdio>
+
+#define ESP_LOGE(tag, format, ...) printf("E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) printf("W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) printf("I %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) do {} while (0)
+
+#endif
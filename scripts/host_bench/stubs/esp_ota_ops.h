@@ -0,0 +1,15 @@
+#ifndef HOST_BENCH_ESP_OTA_OPS_H
+#define HOST_BENCH_ESP_OTA_OPS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+typedef uint32_t esp_ota_handle_t;
+
+const esp_partition_t* esp_ota_get_running_partition();
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size);
+
+#endif
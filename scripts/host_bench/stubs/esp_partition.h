@@ -0,0 +1,18 @@
+#ifndef HOST_BENCH_ESP_PARTITION_H
+#define HOST_BENCH_ESP_PARTITION_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_err.h"
+
+// The running partition is backed by a buffer the benchmark fills with the source image
+struct esp_partition_t {
+    const char* label;
+    uint32_t size;
+    const uint8_t* data;
+};
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef HOST_BENCH_MBEDTLS_SHA256_H
+#define HOST_BENCH_MBEDTLS_SHA256_H
+
+#include <openssl/evp.h>
+
+#include <cstddef>
+
+typedef EVP_MD_CTX* mbedtls_sha256_context;
+
+inline void mbedtls_sha256_init(mbedtls_sha256_context* ctx) {
+    *ctx = EVP_MD_CTX_new();
+}
+
+inline void mbedtls_sha256_free(mbedtls_sha256_context* ctx) {
+    EVP_MD_CTX_free(*ctx);
+}
+
+inline int mbedtls_sha256_starts(mbedtls_sha256_context* ctx, int is224) {
+    return EVP_DigestInit_ex(*ctx, EVP_sha256(), nullptr) == 1 ? 0 : -1;
+}
+
+inline int mbedtls_sha256_update(mbedtls_sha256_context* ctx, const unsigned char* input, size_t size) {
+    return EVP_DigestUpdate(*ctx, input, size) == 1 ? 0 : -1;
+}
+
+inline int mbedtls_sha256_finish(mbedtls_sha256_context* ctx, unsigned char* output) {
+    return EVP_DigestFinal_ex(*ctx, output, nullptr) == 1 ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef HOST_BENCH_ROM_MINIZ_H
+#define HOST_BENCH_ROM_MINIZ_H
+
+// The ROM carries the tinfl inflater of miniz, the host build uses the library
+#include <miniz.h>
+
+#endif
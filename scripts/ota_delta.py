@@ -0,0 +1,242 @@
+#! /usr/bin/env python3
+# 生成与验证差分升级包
+#
+#   python scripts/ota_delta.py diff old.bin new.bin out.patch
+#   python scripts/ota_delta.py apply old.bin in.patch new.bin
+#   python scripts/ota_delta.py compress new.bin out.bin
+#   python scripts/ota_delta.py bench new.bin 解压速度KB/s flash写入速度KB/s
+#
+# bench 的两个速度取自设备升级日志 "Patched image verified, decoding took ... (x KB/s), flash writes ... (y KB/s)"，
+# 解压速度也可以先用 scripts/host_bench 中的 delta_patch_bench（同为 miniz tinfl）在电脑上粗测
+#
+# 补丁格式与 main/delta_patch.h 一致：80 字节头部，后接 zlib 压缩的 bsdiff 风格命令流。
+# 每条命令为 diff 长度、extra 长度、源偏移 seek（zigzag），随后是 diff 字节（与源固件逐字节相加）
+# 与 extra 字节（直接写入）。固件小版本之间大部分代码只是地址平移，diff 字节几乎全为 0，压缩后很小。
+# 源固件为空的补丁就是压缩后的完整固件，任何版本都能使用，设备端用同一套代码解压。
+
+import hashlib
+import struct
+import sys
+import zlib
+
+MAGIC = b"XZDP"
+VERSION = 1
+COMPRESSION_ZLIB = 1
+HEADER = struct.Struct("<4sBBHII32s32s")
+
+BLOCK = 16          # 查找匹配的最小长度
+INDEX_STEP = 4      # 源固件每 4 字节建一次索引
+GIVE_UP = 32        # 近似匹配的得分比最高分低这么多时停止延伸
+WINDOW = 32 * 1024  # 设备端解压窗口，与 ROM 中 miniz 的字典大小一致
+OUTPUT_CHUNK = 4096 # 设备端每次写入 flash 的大小
+
+
+def write_varint(out, value):
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return
+
+
+def read_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def zigzag(value):
+    return value * 2 if value >= 0 else -value * 2 - 1
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def build_index(old):
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1, INDEX_STEP):
+        index.setdefault(old[i:i + BLOCK], i)
+    return index
+
+
+def extend_forward(old, old_pos, new, new_pos):
+    """近似延伸：相同字节加一分，不同减一分，取得分最高处为匹配长度"""
+    limit = min(len(old) - old_pos, len(new) - new_pos)
+    score = best_score = best_len = 0
+    i = 0
+    while i < limit:
+        # 先整段比较，连续相同的部分不用逐字节计分
+        step = min(64, limit - i)
+        if old[old_pos + i:old_pos + i + step] == new[new_pos + i:new_pos + i + step]:
+            score += step
+            i += step
+        else:
+            score += 1 if old[old_pos + i] == new[new_pos + i] else -1
+            i += 1
+        if score > best_score:
+            best_score = score
+            best_len = i
+        elif score < best_score - GIVE_UP:
+            break
+    return best_len
+
+
+def find_matches(old, new):
+    """返回 (new 起点, old 起点, 长度) 列表，按 new 起点递增且互不重叠"""
+    index = build_index(old)
+    matches = []
+    pos = 0
+    last_delta = 0
+    while pos + BLOCK <= len(new):
+        key = new[pos:pos + BLOCK]
+        candidate = pos + last_delta
+        # 先沿用上一个匹配的偏移，地址平移后代码大多整体移动
+        if not (0 <= candidate <= len(old) - BLOCK and old[candidate:candidate + BLOCK] == key):
+            candidate = index.get(key)
+        if candidate is None:
+            pos += 1
+            continue
+
+        # 向前补齐与上一段之间的相同字节
+        floor = matches[-1][0] + matches[-1][2] if matches else 0
+        back = 0
+        while pos - back > floor and candidate - back > 0 and old[candidate - back - 1] == new[pos - back - 1]:
+            back += 1
+        new_start = pos - back
+        old_start = candidate - back
+        length = back + extend_forward(old, candidate, new, pos)
+        matches.append((new_start, old_start, length))
+        last_delta = old_start - new_start
+        pos = new_start + length
+    return matches
+
+
+def diff(old, new):
+    matches = find_matches(old, new)
+    stream = bytearray()
+    new_pos = 0
+    # 第一条命令没有 diff，只输出开头未匹配的部分并跳到第一段匹配
+    segments = [(0, 0, 0)] + matches
+    for k, (new_start, old_start, length) in enumerate(segments):
+        if k > 0:
+            assert new_start == new_pos
+        next_new = segments[k + 1][0] if k + 1 < len(segments) else len(new)
+        next_old = segments[k + 1][1] if k + 1 < len(segments) else old_start + length
+        extra_start = new_start + length
+        write_varint(stream, length)
+        write_varint(stream, next_new - extra_start)
+        write_varint(stream, zigzag(next_old - (old_start + length)))
+        stream += bytes((new[new_start + i] - old[old_start + i]) & 0xFF for i in range(length))
+        stream += new[extra_start:next_new]
+        new_pos = next_new
+    return bytes(stream), len(matches)
+
+
+def apply(old, stream, target_size):
+    out = bytearray()
+    pos = 0
+    cursor = 0
+    while len(out) < target_size:
+        diff_len, pos = read_varint(stream, pos)
+        extra_len, pos = read_varint(stream, pos)
+        seek, pos = read_varint(stream, pos)
+        for i in range(diff_len):
+            out.append((old[cursor + i] + stream[pos + i]) & 0xFF)
+        pos += diff_len
+        cursor += diff_len
+        out += stream[pos:pos + extra_len]
+        pos += extra_len
+        cursor += unzigzag(seek)
+    return bytes(out)
+
+
+def make_patch(old, new):
+    stream, match_count = diff(old, new)
+    header = HEADER.pack(MAGIC, VERSION, COMPRESSION_ZLIB, 0, len(old), len(new),
+                         hashlib.sha256(old).digest(), hashlib.sha256(new).digest())
+    patch = header + zlib.compress(stream, 9)
+    # 生成后立即还原一次，保证设备端得到同样的结果
+    if apply_patch(old, patch) != new:
+        raise Exception("patch verification failed")
+    return patch, match_count
+
+
+def compress_image(new):
+    return make_patch(b"", new)[0]
+
+
+def bench(new, decode_kbps, flash_kbps):
+    """用设备上测得的解压与 flash 写入速度，估算压缩固件升级时解压是否会拖慢写入"""
+    patch = compress_image(new)
+    size_kb = len(new) / 1024
+    print(f"image {len(new)} bytes, compressed {len(patch)} bytes ({len(patch) * 100 / len(new):.1f}%)")
+    print(f"decode {size_kb / decode_kbps:.1f} s at {decode_kbps} KB/s, "
+          f"flash write {size_kb / flash_kbps:.1f} s at {flash_kbps} KB/s")
+    if decode_kbps < flash_kbps:
+        print("decoding is slower than the flash writes and will slow down the upgrade")
+
+
+def apply_patch(old, patch):
+    magic, version, compression, _, source_size, target_size, source_sha256, target_sha256 = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION or compression != COMPRESSION_ZLIB:
+        raise Exception("unsupported patch format")
+    if len(old) != source_size or hashlib.sha256(old).digest() != source_sha256:
+        raise Exception("patch was made for another firmware")
+    new = apply(old, zlib.decompress(patch[HEADER.size:]), target_size)
+    if hashlib.sha256(new).digest() != target_sha256:
+        raise Exception("patched image does not match its SHA-256")
+    return new
+
+
+def usage():
+    print("usage: ota_delta.py diff old.bin new.bin out.patch")
+    print("       ota_delta.py apply old.bin in.patch new.bin")
+    print("       ota_delta.py compress new.bin out.bin")
+    print("       ota_delta.py bench new.bin decode_kbps flash_kbps")
+    sys.exit(1)
+
+
+def main():
+    if len(sys.argv) < 2:
+        usage()
+    if sys.argv[1] == "compress" and len(sys.argv) == 4:
+        with open(sys.argv[2], "rb") as f:
+            new = f.read()
+        patch = compress_image(new)
+        with open(sys.argv[3], "wb") as f:
+            f.write(patch)
+        print(f"{len(new)} -> {len(patch)} bytes ({len(patch) * 100 / len(new):.1f}%)")
+        return
+    if sys.argv[1] == "bench" and len(sys.argv) == 5:
+        with open(sys.argv[2], "rb") as f:
+            new = f.read()
+        bench(new, int(sys.argv[3]), int(sys.argv[4]))
+        return
+    if len(sys.argv) != 5 or sys.argv[1] not in ("diff", "apply"):
+        usage()
+    with open(sys.argv[2], "rb") as f:
+        old = f.read()
+    with open(sys.argv[3], "rb") as f:
+        data = f.read()
+    if sys.argv[1] == "diff":
+        patch, match_count = make_patch(old, data)
+        with open(sys.argv[4], "wb") as f:
+            f.write(patch)
+        print(f"{len(data)} -> {len(patch)} bytes ({len(patch) * 100 / len(data):.1f}%), {match_count} matches")
+    else:
+        with open(sys.argv[4], "wb") as f:
+            f.write(apply_patch(old, data))
+
+
+if __name__ == "__main__":
+    main()
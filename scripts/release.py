@@ -3,6 +3,8 @@ import os
 import json
 import zipfile
 
+from ota_delta import compress_image
+
 # 切换到项目根目录
 os.chdir(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
 
@@ -30,6 +32,23 @@ def merge_bin():
         print("merge bin failed")
         sys.exit(1)
 
+def get_project_name():
+    with open("CMakeLists.txt") as f:
+        for line in f:
+            if line.startswith("project("):
+                return line.split("(")[1].split(")")[0].strip()
+    return None
+
+# 压缩后的应用固件用于 OTA，设备端边下载边解压，见 scripts/ota_delta.py
+def compress_app_bin():
+    app_path = f"build/{get_project_name()}.bin"
+    with open(app_path, "rb") as f:
+        app = f.read()
+    compressed = compress_image(app)
+    with open("build/compressed-app.bin", "wb") as f:
+        f.write(compressed)
+    print(f"compress {app_path}: {len(app)} -> {len(compressed)} bytes")
+
 def zip_bin(board_type, project_version):
     if not os.path.exists("releases"):
         os.makedirs("releases")
@@ -38,11 +57,13 @@ def zip_bin(board_type, project_version):
         os.remove(output_path)
     with zipfile.ZipFile(output_path, 'w', compression=zipfile.ZIP_DEFLATED) as zipf:
         zipf.write("build/merged-binary.bin", arcname="merged-binary.bin")
+        zipf.write("build/compressed-app.bin", arcname="compressed-app.bin")
     print(f"zip bin to {output_path} done")
     
 
 def release_current():
     merge_bin()
+    compress_app_bin()
     board_type = get_board_type()
     print("board type:", board_type)
     project_version = get_project_version()
@@ -114,6 +135,7 @@ def release(board_type, board_config):
         if os.system("idf.py merge-bin") != 0:
             print("merge-bin failed")
             sys.exit(1)
+        compress_app_bin()
         # Zip bin
         zip_bin(name, project_version)
         print("-" * 80)